@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Per-message ISHTP latency from the ishtp tracepoints.
+
+Reads the text output of the trace buffer (/sys/kernel/tracing/trace, or
+`trace-cmd report`) with the ishtp events enabled, pairs up the events of
+each message and prints latency statistics per client:
+
+  tx   ishtp_cl_send -> last IPC fragment written, or DMA_XFER_ACK
+  rx   first IPC fragment, or DMA_XFER -> ishtp_cl_rx_complete
+  rtt  ishtp_cl_send -> next ishtp_cl_rx_complete of the same client
+
+Messages of a client are sent and received in order, so they are matched
+first in, first out.
+"""
+
+import argparse
+import collections
+import re
+import sys
+
+IPC_PROTOCOL_ISHTP = 1
+
+EVENT_RE = re.compile(r'\s(\d+\.\d+):\s+(ishtp_\w+):\s*(.*)$')
+FIELD_RE = re.compile(r'(\w+)=(0x[0-9a-fA-F]+|\d+)')
+
+
+def parse(lines):
+    for line in lines:
+        m = EVENT_RE.search(line)
+        if not m:
+            continue
+        fields = {k: int(v, 0) for k, v in FIELD_RE.findall(m.group(3))}
+        yield float(m.group(1)), m.group(2), fields
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('trace', nargs='?', type=argparse.FileType('r'), default=sys.stdin,
+                        help='trace text (default: stdin)')
+    parser.add_argument('--csv', action='store_true',
+                        help='print one line per message instead of statistics')
+    args = parser.parse_args()
+
+    sends = collections.defaultdict(collections.deque)     # client -> send times
+    requests = collections.defaultdict(collections.deque)  # client -> send times
+    rx_start = collections.defaultdict(collections.deque)  # client -> first fragment times
+    in_rx = set()                                          # clients mid-message over IPC
+    dma_tx = {}                                            # (client, offset) -> send time
+    samples = collections.defaultdict(list)                # (client, kind) -> latencies
+
+    def record(client, kind, start, end):
+        samples[(client, kind)].append((end - start) * 1e6)
+        if args.csv:
+            print('%d,%d,%s,%.6f,%.1f' % (client + (kind, start, (end - start) * 1e6)))
+
+    if args.csv:
+        print('host,fw,kind,start_s,latency_us')
+
+    for ts, event, f in parse(args.trace):
+        if event in ('ishtp_ipc_tx', 'ishtp_ipc_rx'):
+            if f.get('proto') != IPC_PROTOCOL_ISHTP or not f.get('host'):
+                continue
+            client = (f['host'], f['fw'])
+            if event == 'ishtp_ipc_tx':
+                if f['complete'] and sends[client]:
+                    record(client, 'tx', sends[client].popleft(), ts)
+            else:
+                if client not in in_rx:
+                    rx_start[client].append(ts)
+                    in_rx.add(client)
+                if f['complete']:
+                    in_rx.discard(client)
+            continue
+
+        if 'host' not in f:
+            continue
+        client = (f['host'], f['fw'])
+
+        if event == 'ishtp_cl_send':
+            sends[client].append(ts)
+            requests[client].append(ts)
+        elif event == 'ishtp_dma_tx':
+            if sends[client]:
+                dma_tx[(client, f['offset'])] = sends[client].popleft()
+        elif event == 'ishtp_dma_tx_ack':
+            start = dma_tx.pop((client, f['offset']), None)
+            if start is not None:
+                record(client, 'tx', start, ts)
+        elif event == 'ishtp_dma_rx':
+            rx_start[client].append(ts)
+        elif event == 'ishtp_cl_rx_complete':
+            if rx_start[client]:
+                record(client, 'rx', rx_start[client].popleft(), ts)
+            if requests[client]:
+                record(client, 'rtt', requests[client].popleft(), ts)
+
+    if args.csv:
+        return
+
+    print('%4s %3s %-4s %7s %9s %9s %9s %9s %9s' %
+          ('host', 'fw', 'kind', 'count', 'min_us', 'avg_us', 'p50_us', 'p99_us', 'max_us'))
+    for (client, kind), values in sorted(samples.items()):
+        values.sort()
+        print('%4d %3d %-4s %7d %9.1f %9.1f %9.1f %9.1f %9.1f' %
+              (client + (kind, len(values), values[0], sum(values) / len(values),
+                         percentile(values, 50), percentile(values, 99), values[-1])))
+
+
+if __name__ == '__main__':
+    main()
@@ -13,6 +13,18 @@
 /// After it has been performed, future reads/writes will be attached to this new client
 #define IOCTL_ISHTP_CONNECT_CLIENT _IOWR('H', 0x01, struct ishtp_cc_data)
 
+/// Register a periodic standing query, issued by the driver on the caller's behalf
+#define IOCTL_PSE_ADD_QUERY _IOWR('H', 0x02, struct pse_query)
+
+/// Remove a standing query by id
+#define IOCTL_PSE_DEL_QUERY _IOW('H', 0x03, __u32)
+
+/// Block until the next standing query result is available
+#define IOCTL_PSE_READ_QUERY _IOR('H', 0x04, struct pse_query_result)
+
+/// Room for a complete heci_header_t + heci_body_t response
+#define PSE_QUERY_DATA_LEN 240
+
 /// ISHTP Client information returned by IOCTL_ISHTP_CONNECT_CLIENT
 struct ishtp_client {
     __u32 max_message_length;
@@ -28,6 +40,74 @@ struct ishtp_cc_data {
     };
 };
 
+/// Standing query registered by IOCTL_PSE_ADD_QUERY
+struct pse_query {
+    __u8  command;
+    __u8  reserved;
+    __u16 argument;
+    __u32 period_ms;
+    __u32 id;
+};
+
+/// Standing query result returned by IOCTL_PSE_READ_QUERY
+struct pse_query_result {
+    __u32 id;
+    __s32 status;
+    __u64 timestamp_ns;
+    __u32 length;
+    __u8  data[PSE_QUERY_DATA_LEN];
+};
+
+/// Layout version of the shared state page
+#define PSE_STATE_VERSION 1
+
+#define PSE_STATE_DIO   16
+#define PSE_STATE_PWM   8
+#define PSE_STATE_CAN   8
+
+/// Last known state of a single DI, DO or LED
+struct pse_state_dio {
+    __u8  valid;
+    __u8  state;
+    __u8  reserved[6];
+    __u64 count;
+    __u64 timestamp_ns;
+};
+
+/// Last known configuration of a single PWM device
+struct pse_state_pwm {
+    __u8  valid;
+    __u8  running;
+    __u8  reserved[6];
+    __u64 period_usec;
+    __u64 pulse_usec;
+    __u64 timestamp_ns;
+};
+
+/// Last known state of a single CAN device
+struct pse_state_can {
+    __u8  valid;
+    __u8  enabled;
+    __u16 baudrate;
+    __u32 reserved;
+    __u64 timestamp_ns;
+};
+
+/// Read-only state page, mapped by mmap() on /dev/pse
+///
+/// @seq: Odd while the driver is updating the page; re-read if it changed
+/// @version: PSE_STATE_VERSION
+/// @timestamp_ns: Per-entry CLOCK_MONOTONIC time of the last update
+struct pse_state_page {
+    __u32 seq;
+    __u32 version;
+    struct pse_state_dio din[PSE_STATE_DIO];
+    struct pse_state_dio dout[PSE_STATE_DIO];
+    struct pse_state_dio led[PSE_STATE_DIO];
+    struct pse_state_pwm pwm[PSE_STATE_PWM];
+    struct pse_state_can can[PSE_STATE_CAN];
+};
+
 /// Establish a connection to the PSE firmware client
 int pse_client_connect(void);
 
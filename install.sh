@@ -27,6 +27,11 @@ sudo dkms install -m pse -v 1.3
 # Check PSE v1.3 has been built and installed correctly
 sudo dkms status
 
+# Replace the running ISH drivers with the ones installed alongside PSE
+# (a reboot does the same if they are busy)
+sudo modprobe -r pse intel_ishtp_hid intel_ishtp_loader intel_ish_ipc intel_ishtp
+sudo modprobe intel_ish_ipc
+
 # Take AUTOINSTALL into effect
 cd /usr/lib/dkms
 sudo cp dkms_autoinstaller /etc/init.d/
@@ -9,9 +9,16 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/jiffies.h>
+#include <linux/iopoll.h>
 #include "client.h"
 #include "hw-ish.h"
 #include "hbm.h"
+#include "trace.h"
+
+/* Doorbells handled by the IRQ thread before it yields the CPU */
+#define ISH_IRQ_BUDGET		64
+/* How long the IRQ thread polls an idle doorbell under sustained traffic */
+#define ISH_IRQ_POLL_US		50
 
 /* For FW reset flow */
 static struct work_struct fw_reset_work;
@@ -257,17 +264,41 @@ static int _ishtp_read(struct ishtp_device *dev, unsigned char *buffer,
 	return 0;
 }
 
+/**
+ * ish_wr_lane() - Choose the IPC write queue lane of a message
+ * @msg: message, starting with its IPC header
+ *
+ * Return: ISHTP_WR_LANE_CTRL for management and HBM messages, else
+ * ISHTP_WR_LANE_BULK
+ */
+static enum ishtp_wr_lane ish_wr_lane(const unsigned char *msg)
+{
+	uint32_t doorbell_val = *(const uint32_t *)msg;
+	const struct ishtp_msg_hdr *hdr;
+
+	if (IPC_HEADER_GET_PROTOCOL(doorbell_val) != IPC_PROTOCOL_ISHTP)
+		return ISHTP_WR_LANE_CTRL;
+
+	/* Host and FW address 0 is the bus itself */
+	hdr = (const struct ishtp_msg_hdr *)(msg + sizeof(uint32_t));
+	if (!hdr->host_addr && !hdr->fw_addr)
+		return ISHTP_WR_LANE_CTRL;
+
+	return ISHTP_WR_LANE_BULK;
+}
+
 /**
  * write_ipc_from_queue() - try to write ipc msg from Tx queue to device
  * @dev: ishtp device pointer
  *
- * Check if DRBL is cleared. if it is - write the first IPC msg,  then call
- * the callback function (unless it's NULL)
+ * Check if DRBL is cleared. if it is - write the first IPC msg of the highest
+ * priority non-empty lane, then call the callback function (unless it's NULL)
  *
  * Return: 0 for success else failure code
  */
 static int write_ipc_from_queue(struct ishtp_device *dev)
 {
+	struct ishtp_wr_lane	*lane;
 	struct wr_msg_ctl_info	*ipc_link;
 	unsigned long	length;
 	unsigned long	rem;
@@ -276,6 +307,9 @@ static int write_ipc_from_queue(struct ishtp_device *dev)
 	uint32_t	*r_buf;
 	uint32_t	reg_addr;
 	int	i;
+	bool	clock_sync = false;
+	ktime_t	sync_start = 0;
+	uint64_t	usec_system = 0;
 	void	(*ipc_send_compl)(void *);
 	void	*ipc_send_compl_prm;
 
@@ -288,17 +322,20 @@ static int write_ipc_from_queue(struct ishtp_device *dev)
 		return -EBUSY;
 	}
 
+	for (lane = dev->wr_lanes; lane < dev->wr_lanes + ISHTP_WR_LANES; ++lane)
+		if (lane->head != lane->tail)
+			break;
+
 	/*
-	 * if tx send list is empty - return 0;
-	 * may happen, as RX_COMPLETE handler doesn't check list emptiness.
+	 * if all lanes are empty - return 0;
+	 * may happen, as RX_COMPLETE handler doesn't check queue emptiness.
 	 */
-	if (list_empty(&dev->wr_processing_list)) {
+	if (lane == dev->wr_lanes + ISHTP_WR_LANES) {
 		spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
 		return	0;
 	}
 
-	ipc_link = list_first_entry(&dev->wr_processing_list,
-				    struct wr_msg_ctl_info, link);
+	ipc_link = &lane->ring[lane->head & (lane->size - 1)];
 	/* first 4 bytes of the data is the doorbell value (IPC header) */
 	length = ipc_link->length - sizeof(uint32_t);
 	doorbell_val = *(uint32_t *)ipc_link->inline_data;
@@ -307,11 +344,15 @@ static int write_ipc_from_queue(struct ishtp_device *dev)
 	/* If sending MNG_SYNC_FW_CLOCK, update clock again */
 	if (IPC_HEADER_GET_PROTOCOL(doorbell_val) == IPC_PROTOCOL_MNG &&
 		IPC_HEADER_GET_MNG_CMD(doorbell_val) == MNG_SYNC_FW_CLOCK) {
-		uint64_t usec_system, usec_utc;
+		uint64_t usec_utc;
 		struct ipc_time_update_msg time_update;
 		struct time_sync_format ts_format;
 
-		usec_system = ktime_to_us(ktime_get_boottime());
+		/* Boottime of the same instant, for ishtp_fw_clock_sync() */
+		clock_sync = true;
+		sync_start = ktime_get();
+		usec_system = ktime_to_us(ktime_mono_to_any(sync_start,
+							    TK_OFFS_BOOT));
 		usec_utc = ktime_to_us(ktime_get_real());
 		ts_format.ts1_source = HOST_SYSTEM_TIME_USEC;
 		ts_format.ts2_source = HOST_UTC_TIME_USEC;
@@ -341,19 +382,26 @@ static int write_ipc_from_queue(struct ishtp_device *dev)
 	/* Flush writes to msg registers and doorbell */
 	ish_reg_read(dev, IPC_REG_ISH_HOST_FWSTS);
 
+	if (clock_sync)
+		ishtp_fw_clock_sync(dev, usec_system, sync_start, ktime_get());
+
+	trace_ishtp_ipc_tx(doorbell_val,
+			   IPC_HEADER_GET_PROTOCOL(doorbell_val) ==
+			   IPC_PROTOCOL_ISHTP ? r_buf[0] : 0);
+
 	/* Update IPC counters */
-	++dev->ipc_tx_cnt;
-	dev->ipc_tx_bytes_cnt += IPC_HEADER_GET_LENGTH(doorbell_val);
+	ishtp_stats_inc(dev->stats, ISHTP_DEV_STAT_IPC_TX);
+	ishtp_stats_add(dev->stats, ISHTP_DEV_STAT_IPC_TX_BYTES,
+			IPC_HEADER_GET_LENGTH(doorbell_val));
 
 	ipc_send_compl = ipc_link->ipc_send_compl;
 	ipc_send_compl_prm = ipc_link->ipc_send_compl_prm;
-	list_del_init(&ipc_link->link);
-	list_add(&ipc_link->link, &dev->wr_free_list);
+	++lane->head;
 	spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
 
 	/*
 	 * callback will be called out of spinlock,
-	 * after ipc_link returned to free list
+	 * after ipc_link returned to its lane
 	 */
 	if (ipc_send_compl)
 		ipc_send_compl(ipc_send_compl_prm);
@@ -369,11 +417,12 @@ static int write_ipc_from_queue(struct ishtp_device *dev)
  * @msg: Pointer to message
  * @length: Length of message
  *
- * Recived msg with IPC (and upper protocol) header  and add it to the device
- *  Tx-to-write list then try to send the first IPC waiting msg
+ * Recived msg with IPC (and upper protocol) header  and add it to its lane
+ *  of the device Tx queue then try to send the first IPC waiting msg
  *  (if DRBL is cleared)
- * This function returns negative value for failure (means free list
- *  is empty, or msg too long) and 0 for success.
+ * This function returns negative value for failure (-EAGAIN means the lane
+ *  is full and the caller should retry once the queue drains, -EMSGSIZE
+ *  that msg is too long) and 0 for success.
  *
  * Return: 0 for success else failure code
  */
@@ -381,27 +430,32 @@ static int write_ipc_to_queue(struct ishtp_device *dev,
 	void (*ipc_send_compl)(void *), void *ipc_send_compl_prm,
 	unsigned char *msg, int length)
 {
+	struct ishtp_wr_lane *lane;
 	struct wr_msg_ctl_info *ipc_link;
 	unsigned long flags;
+	unsigned int depth;
 
 	if (length > IPC_FULL_MSG_SIZE)
 		return -EMSGSIZE;
 
+	lane = &dev->wr_lanes[ish_wr_lane(msg)];
+
 	spin_lock_irqsave(&dev->wr_processing_spinlock, flags);
-	if (list_empty(&dev->wr_free_list)) {
+	if (lane->tail - lane->head >= lane->size) {
+		++lane->full_cnt;
 		spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
-		return -ENOMEM;
+		return -EAGAIN;
 	}
-	ipc_link = list_first_entry(&dev->wr_free_list,
-				    struct wr_msg_ctl_info, link);
-	list_del_init(&ipc_link->link);
+	ipc_link = &lane->ring[lane->tail & (lane->size - 1)];
 
 	ipc_link->ipc_send_compl = ipc_send_compl;
 	ipc_link->ipc_send_compl_prm = ipc_send_compl_prm;
 	ipc_link->length = length;
 	memcpy(ipc_link->inline_data, msg, length);
 
-	list_add_tail(&ipc_link->link, &dev->wr_processing_list);
+	depth = ++lane->tail - lane->head;
+	if (depth > lane->max_depth)
+		lane->max_depth = depth;
 	spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
 
 	write_ipc_from_queue(dev);
@@ -497,13 +551,15 @@ static int ish_fw_reset_handler(struct ishtp_device *dev)
 {
 	uint32_t	reset_id;
 	unsigned long	flags;
+	int	i;
 
 	/* Read reset ID */
 	reset_id = ish_reg_read(dev, IPC_REG_ISH2HOST_MSG) & 0xFFFF;
 
 	/* Clear IPC output queue */
 	spin_lock_irqsave(&dev->wr_processing_spinlock, flags);
-	list_splice_init(&dev->wr_processing_list, &dev->wr_free_list);
+	for (i = 0; i < ISHTP_WR_LANES; i++)
+		dev->wr_lanes[i].head = dev->wr_lanes[i].tail;
 	spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
 
 	/* ISHTP notification in IPC_RESET */
@@ -575,13 +631,13 @@ static void fw_reset_work_fn(struct work_struct *unused)
  */
 static void _ish_sync_fw_clock(struct ishtp_device *dev)
 {
-	static unsigned long	prev_sync;
+	unsigned long	prev_sync = READ_ONCE(dev->fw_clock.sync_jiffies);
 	uint64_t	usec;
 
 	if (prev_sync && jiffies - prev_sync < 20 * HZ)
 		return;
 
-	prev_sync = jiffies;
+	WRITE_ONCE(dev->fw_clock.sync_jiffies, jiffies ?: 1);
 	usec = ktime_to_us(ktime_get_boottime());
 	ipc_send_mng_msg(dev, MNG_SYNC_FW_CLOCK, &usec, sizeof(uint64_t));
 }
@@ -616,6 +672,7 @@ static void	recv_ipc(struct ishtp_device *dev, uint32_t doorbell_val)
 		}
 
 		write_ipc_from_queue(dev);
+		ishtp_cl_tx_resume(dev);
 		break;
 
 	case MNG_RESET_NOTIFY:
@@ -634,31 +691,24 @@ static void	recv_ipc(struct ishtp_device *dev, uint32_t doorbell_val)
 }
 
 /**
- * ish_irq_handler() - ISH IRQ handler
- * @irq: irq number
- * @dev_id: ishtp device pointer
+ * ish_process_doorbell() - Process a message from ISH
+ * @dev: ishtp device pointer
  *
- * ISH IRQ handler. If interrupt is generated and is for ISH it will process
- * the interrupt.
+ * If the ISH to host doorbell is busy, dispatch the message it announces
+ * and clear the doorbell for the next one.
+ *
+ * Return: true if a message was processed
  */
-irqreturn_t ish_irq_handler(int irq, void *dev_id)
+static bool ish_process_doorbell(struct ishtp_device *dev)
 {
-	struct ishtp_device	*dev = dev_id;
 	uint32_t	doorbell_val;
-	bool	interrupt_generated;
-
-	/* Check that it's interrupt from ISH (may be shared) */
-	interrupt_generated = check_generated_interrupt(dev);
-
-	if (!interrupt_generated)
-		return IRQ_NONE;
 
 	doorbell_val = ish_reg_read(dev, IPC_REG_ISH2HOST_DRBL);
 	if (!IPC_IS_BUSY(doorbell_val))
-		return IRQ_HANDLED;
+		return false;
 
 	if (dev->dev_state == ISHTP_DEV_DISABLED)
-		return	IRQ_HANDLED;
+		return false;
 
 	/* Sanity check: IPC dgram length in header */
 	if (IPC_HEADER_GET_LENGTH(doorbell_val) > IPC_PAYLOAD_SIZE) {
@@ -668,6 +718,13 @@ irqreturn_t ish_irq_handler(int irq, void *dev_id)
 		goto	eoi;
 	}
 
+	/* The fragment header is only read again if it's traced */
+	if (trace_ishtp_ipc_rx_enabled())
+		trace_ishtp_ipc_rx(doorbell_val,
+				   IPC_HEADER_GET_PROTOCOL(doorbell_val) ==
+				   IPC_PROTOCOL_ISHTP ?
+				   _ishtp_read_hdr(dev) : 0);
+
 	switch (IPC_HEADER_GET_PROTOCOL(doorbell_val)) {
 	default:
 		break;
@@ -681,13 +738,94 @@ irqreturn_t ish_irq_handler(int irq, void *dev_id)
 
 eoi:
 	/* Update IPC counters */
-	++dev->ipc_rx_cnt;
-	dev->ipc_rx_bytes_cnt += IPC_HEADER_GET_LENGTH(doorbell_val);
+	ishtp_stats_inc(dev->stats, ISHTP_DEV_STAT_IPC_RX);
+	ishtp_stats_add(dev->stats, ISHTP_DEV_STAT_IPC_RX_BYTES,
+			IPC_HEADER_GET_LENGTH(doorbell_val));
 
 	ish_reg_write(dev, IPC_REG_ISH2HOST_DRBL, 0);
 	/* Flush write to doorbell */
 	ish_reg_read(dev, IPC_REG_ISH_HOST_FWSTS);
 
+	return true;
+}
+
+/**
+ * ish_irq_handler() - ISH IRQ handler
+ * @irq: irq number
+ * @dev_id: ishtp device pointer
+ *
+ * ISH IRQ handler. If interrupt is generated and is for ISH it will process
+ * the interrupt.
+ */
+irqreturn_t ish_irq_handler(int irq, void *dev_id)
+{
+	struct ishtp_device	*dev = dev_id;
+
+	/* Check that it's interrupt from ISH (may be shared) */
+	if (!check_generated_interrupt(dev))
+		return IRQ_NONE;
+
+	ish_process_doorbell(dev);
+
+	return	IRQ_HANDLED;
+}
+
+/**
+ * ish_irq_quick_handler() - ISH hard IRQ handler in threaded mode
+ * @irq: irq number
+ * @dev_id: ishtp device pointer
+ *
+ * Only acknowledge the interrupt, messages are processed by ish_irq_thread().
+ */
+irqreturn_t ish_irq_quick_handler(int irq, void *dev_id)
+{
+	struct ishtp_device	*dev = dev_id;
+
+	/* Check that it's interrupt from ISH (may be shared) */
+	if (!check_generated_interrupt(dev))
+		return IRQ_NONE;
+
+	return IRQ_WAKE_THREAD;
+}
+
+/**
+ * ish_irq_thread() - ISH threaded IRQ handler
+ * @irq: irq number
+ * @dev_id: ishtp device pointer
+ *
+ * Process messages until the doorbell is idle, yielding the CPU after every
+ * ISH_IRQ_BUDGET of them. Once the budget has been used up the traffic is
+ * considered sustained, and an idle doorbell is polled for a while before
+ * going back to waiting for interrupts.
+ */
+irqreturn_t ish_irq_thread(int irq, void *dev_id)
+{
+	struct ishtp_device	*dev = dev_id;
+	unsigned int	budget = ISH_IRQ_BUDGET;
+	bool	polling = false;
+	uint32_t	doorbell_val;
+
+	for (;;) {
+		if (ish_process_doorbell(dev)) {
+			if (--budget == 0) {
+				cond_resched();
+				budget = ISH_IRQ_BUDGET;
+				polling = true;
+			}
+			continue;
+		}
+
+		if (!polling || dev->dev_state == ISHTP_DEV_DISABLED)
+			break;
+
+		/* Wait a little for the next message before sleeping */
+		if (read_poll_timeout_atomic(ish_reg_read, doorbell_val,
+					     IPC_IS_BUSY(doorbell_val), 1,
+					     ISH_IRQ_POLL_US, false, dev,
+					     IPC_REG_ISH2HOST_DRBL))
+			break;
+	}
+
 	return	IRQ_HANDLED;
 }
 
@@ -945,30 +1083,30 @@ struct ishtp_device *ish_dev_init(struct pci_dev *pdev)
 
 	ishtp_device_init(dev);
 
+	dev->stats = __devm_alloc_percpu(&pdev->dev,
+					 ishtp_stats_size(ISHTP_DEV_STATS),
+					 __alignof__(struct ishtp_stats));
+	if (!dev->stats)
+		return NULL;
+	ishtp_stats_init(dev->stats);
+
 	init_waitqueue_head(&dev->wait_hw_ready);
 
 	spin_lock_init(&dev->wr_processing_spinlock);
 
-	/* Init IPC processing and free lists */
-	INIT_LIST_HEAD(&dev->wr_processing_list);
-	INIT_LIST_HEAD(&dev->wr_free_list);
-	for (i = 0; i < IPC_TX_FIFO_SIZE; i++) {
-		struct wr_msg_ctl_info	*tx_buf;
-
-		tx_buf = devm_kzalloc(&pdev->dev,
-				      sizeof(struct wr_msg_ctl_info),
-				      GFP_KERNEL);
-		if (!tx_buf) {
-			/*
-			 * IPC buffers may be limited or not available
-			 * at all - although this shouldn't happen
-			 */
-			dev_err(dev->devc,
-				"[ishtp-ish]: failure in Tx FIFO allocations (%d)\n",
-				i);
-			break;
+	/* Init IPC write queue lanes */
+	dev->wr_lanes[ISHTP_WR_LANE_CTRL].size = IPC_TX_CTRL_FIFO_SIZE;
+	dev->wr_lanes[ISHTP_WR_LANE_BULK].size = IPC_TX_FIFO_SIZE;
+	for (i = 0; i < ISHTP_WR_LANES; i++) {
+		dev->wr_lanes[i].ring = devm_kcalloc(&pdev->dev,
+					dev->wr_lanes[i].size,
+					sizeof(struct wr_msg_ctl_info),
+					GFP_KERNEL);
+		if (!dev->wr_lanes[i].ring) {
+			dev_err(&pdev->dev,
+				"[ishtp-ish]: failure in Tx FIFO allocations\n");
+			return NULL;
 		}
-		list_add_tail(&tx_buf->link, &dev->wr_free_list);
 	}
 
 	dev->ops = &ish_hw_ops;
@@ -45,6 +45,11 @@ static const struct pci_device_id ish_pci_tbl[] = {
 };
 MODULE_DEVICE_TABLE(pci, ish_pci_tbl);
 
+static bool ish_threaded_irq;
+module_param(ish_threaded_irq, bool, 0444);
+MODULE_PARM_DESC(ish_threaded_irq,
+		 "Process ISH messages in an IRQ thread, polling under load");
+
 /**
  * ish_event_tracer() - Callback function to dump trace messages
  * @dev:	ishtp device
@@ -207,8 +212,21 @@ static int ish_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 	if (!pdev->msi_enabled && !pdev->msix_enabled)
 		irq_flag = IRQF_SHARED;
 
-	ret = devm_request_irq(dev, pdev->irq, ish_irq_handler,
-			       irq_flag, KBUILD_MODNAME, ishtp);
+	if (ish_threaded_irq) {
+		ret = devm_request_threaded_irq(dev, pdev->irq,
+						ish_irq_quick_handler,
+						ish_irq_thread,
+						irq_flag | IRQF_ONESHOT,
+						KBUILD_MODNAME, ishtp);
+		if (ret)
+			dev_warn(dev,
+				 "ISH: threaded IRQ %d failed, using hard IRQ\n",
+				 pdev->irq);
+	}
+
+	if (!ish_threaded_irq || ret)
+		ret = devm_request_irq(dev, pdev->irq, ish_irq_handler,
+				       irq_flag, KBUILD_MODNAME, ishtp);
 	if (ret) {
 		dev_err(dev, "ISH: request IRQ %d failed\n", pdev->irq);
 		return ret;
@@ -374,6 +392,9 @@ static int __maybe_unused ish_resume(struct device *device)
 	ish_resume_device = device;
 	dev->resume_flag = 1;
 
+	/* CLOCK_MONOTONIC stood still while suspended, the firmware's didn't */
+	ishtp_fw_clock_reset(dev);
+
 	schedule_work(&resume_work);
 
 	return 0;
@@ -10,6 +10,8 @@
 #include <linux/pci.h>
 #include <linux/intel-ish-client-if.h>
 #include <linux/property.h>
+#include <linux/version.h>
+#include <linux/zstd.h>
 #include <asm/cacheflush.h>
 
 /* Number of times we attempt to load the firmware before giving up */
@@ -92,6 +94,53 @@ static const guid_t loader_ishtp_guid =
  */
 static int dma_buf_size_limit = 4 * PAGE_SIZE;
 
+/*
+ * A zstd-compressed image ("<firmware-name>.zst") is preferred over the
+ * plain one: it is decompressed chunk by chunk into the transfer buffers,
+ * so only the compressed file and the decompression window are held in
+ * memory. The window bounds the workspace; compress with a small one,
+ * e.g. "zstd -19 --zstd=wlog=15". Built out of tree, Kconfig can't select
+ * ZSTD_DECOMPRESS; against a kernel without it, only plain images load.
+ */
+#define ISH_FW_ZSTD_MAX_WINDOW			(1 << 20)
+
+/* This tree also builds for 5.16 to 6.3, where the zstd API was renamed */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+typedef zstd_frame_header ish_fw_zstd_header;
+#define ish_fw_zstd_get_header		zstd_get_frame_header
+#define ish_fw_zstd_wksp_bound		zstd_dstream_workspace_bound
+#define ish_fw_zstd_init		zstd_init_dstream
+#define ish_fw_zstd_decompress		zstd_decompress_stream
+#define ish_fw_zstd_is_error		zstd_is_error
+#else
+typedef ZSTD_frameParams ish_fw_zstd_header;
+#define ish_fw_zstd_get_header		ZSTD_getFrameParams
+#define ish_fw_zstd_wksp_bound		ZSTD_DStreamWorkspaceBound
+#define ish_fw_zstd_init		ZSTD_initDStream
+#define ish_fw_zstd_decompress		ZSTD_decompressStream
+#define ish_fw_zstd_is_error		ZSTD_isError
+#endif
+
+/**
+ * struct ish_fw_image - ISH firmware image being transferred
+ * @fw:			Firmware file, zstd-compressed if @zstd is set
+ * @size:		Size of the image, decompressed
+ * @pos:		Bytes of the image read so far
+ * @zstd:		Decompression stream, or NULL
+ * @zstd_wksp:		Workspace of @zstd
+ * @zstd_in:		Compressed input of @zstd
+ *
+ * The image is read front to back, one chunk at a time.
+ */
+struct ish_fw_image {
+	const struct firmware *fw;
+	size_t size;
+	size_t pos;
+	ZSTD_DStream *zstd;
+	void *zstd_wksp;
+	ZSTD_inBuffer zstd_in;
+};
+
 /**
  * struct loader_msg_hdr - Header for ISH Loader commands.
  * @command:		LOADER_CMD* commands. Bit 7 is the response.
@@ -265,7 +314,8 @@ static int get_firmware_variant(struct ishtp_cl_data *client_data,
 }
 
 /**
- * loader_cl_send()	Send message from host to firmware
+ * loader_cl_send_start()	Send message from host to firmware, without
+ *			waiting for the response
  * @client_data:	Client data instance
  * @out_msg:		Message buffer to be sent to firmware
  * @out_size:		Size of out going message
@@ -273,12 +323,14 @@ static int get_firmware_variant(struct ishtp_cl_data *client_data,
  *			This buffer is allocated by calling
  * @in_size:		Max size of incoming message
  *
- * Return: Number of bytes copied in the in_msg on success, negative
- * error code on failure.
+ * The response must be collected with loader_cl_wait(). @in_msg has to
+ * stay valid until then.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
-static int loader_cl_send(struct ishtp_cl_data *client_data,
-			  u8 *out_msg, size_t out_size,
-			  u8 *in_msg, size_t in_size)
+static int loader_cl_send_start(struct ishtp_cl_data *client_data,
+				u8 *out_msg, size_t out_size,
+				u8 *in_msg, size_t in_size)
 {
 	int rv;
 	struct loader_msg_hdr *out_hdr = (struct loader_msg_hdr *)out_msg;
@@ -304,6 +356,22 @@ static int loader_cl_send(struct ishtp_cl_data *client_data,
 		return rv;
 	}
 
+	return 0;
+}
+
+/**
+ * loader_cl_wait()	Wait for the response to a message sent with
+ *			loader_cl_send_start()
+ * @client_data:	Client data instance
+ * @out_msg:		Message buffer that was sent to firmware
+ *
+ * Return: Number of bytes copied in the in_msg on success, negative
+ * error code on failure.
+ */
+static int loader_cl_wait(struct ishtp_cl_data *client_data, u8 *out_msg)
+{
+	struct loader_msg_hdr *out_hdr = (struct loader_msg_hdr *)out_msg;
+
 	wait_event_interruptible_timeout(client_data->response.wait_queue,
 					 client_data->response.received,
 					 ISHTP_SEND_TIMEOUT);
@@ -320,6 +388,32 @@ static int loader_cl_send(struct ishtp_cl_data *client_data,
 	return client_data->response.size;
 }
 
+/**
+ * loader_cl_send()	Send message from host to firmware
+ * @client_data:	Client data instance
+ * @out_msg:		Message buffer to be sent to firmware
+ * @out_size:		Size of out going message
+ * @in_msg:		Message buffer where the incoming data copied.
+ *			This buffer is allocated by calling
+ * @in_size:		Max size of incoming message
+ *
+ * Return: Number of bytes copied in the in_msg on success, negative
+ * error code on failure.
+ */
+static int loader_cl_send(struct ishtp_cl_data *client_data,
+			  u8 *out_msg, size_t out_size,
+			  u8 *in_msg, size_t in_size)
+{
+	int rv;
+
+	rv = loader_cl_send_start(client_data, out_msg, out_size,
+				  in_msg, in_size);
+	if (rv < 0)
+		return rv;
+
+	return loader_cl_wait(client_data, out_msg);
+}
+
 /**
  * process_recv() -	Receive and parse incoming packet
  * @loader_ishtp_cl:	Client instance to get stats
@@ -456,7 +550,7 @@ static void loader_cl_event_cb(struct ishtp_cl_device *cl_device)
 /**
  * ish_query_loader_prop() -  Query ISH Shim firmware loader
  * @client_data:	Client data instance
- * @fw:			Pointer to firmware data struct in host memory
+ * @fw:			Firmware image to be loaded
  * @fw_info:		Loader firmware properties
  *
  * This function queries the ISH Shim firmware loader for capabilities.
@@ -464,7 +558,7 @@ static void loader_cl_event_cb(struct ishtp_cl_device *cl_device)
  * Return: 0 for success, negative error code for failure.
  */
 static int ish_query_loader_prop(struct ishtp_cl_data *client_data,
-				 const struct firmware *fw,
+				 const struct ish_fw_image *fw,
 				 struct shim_fw_info *fw_info)
 {
 	int rv;
@@ -536,21 +630,154 @@ static int ish_query_loader_prop(struct ishtp_cl_data *client_data,
 	return 0;
 }
 
+/**
+ * ish_fw_image_init() - Prepare a firmware file for transfer
+ * @client_data:	Client data instance
+ * @img:		Firmware image to set up
+ * @fw:			Firmware file
+ * @compressed:		@fw is zstd-compressed
+ *
+ * Return: 0 for success, negative error code for failure.
+ */
+static int ish_fw_image_init(struct ishtp_cl_data *client_data,
+			     struct ish_fw_image *img,
+			     const struct firmware *fw, bool compressed)
+{
+	ish_fw_zstd_header header;
+	size_t wksp_size;
+
+	*img = (struct ish_fw_image){ .fw = fw, .size = fw->size };
+	if (!compressed || !IS_ENABLED(CONFIG_ZSTD_DECOMPRESS))
+		return 0;
+
+	if (ish_fw_zstd_get_header(&header, fw->data, fw->size)) {
+		dev_err(cl_data_to_dev(client_data),
+			"Bad zstd firmware image header\n");
+		return -EINVAL;
+	}
+
+	/* The loader is told the image size before the transfer */
+	if (!header.frameContentSize || header.frameContentSize > U32_MAX) {
+		dev_err(cl_data_to_dev(client_data),
+			"zstd firmware image doesn't record its size\n");
+		return -EINVAL;
+	}
+
+	if (header.windowSize > ISH_FW_ZSTD_MAX_WINDOW) {
+		dev_err(cl_data_to_dev(client_data),
+			"zstd firmware image window %llu is larger than %d\n",
+			(unsigned long long)header.windowSize,
+			ISH_FW_ZSTD_MAX_WINDOW);
+		return -EINVAL;
+	}
+
+	wksp_size = ish_fw_zstd_wksp_bound(header.windowSize);
+	img->zstd_wksp = kvmalloc(wksp_size, GFP_KERNEL);
+	if (!img->zstd_wksp)
+		return -ENOMEM;
+
+	img->zstd = ish_fw_zstd_init(header.windowSize, img->zstd_wksp,
+				     wksp_size);
+	if (!img->zstd) {
+		kvfree(img->zstd_wksp);
+		img->zstd_wksp = NULL;
+		return -EINVAL;
+	}
+
+	img->zstd_in.src = fw->data;
+	img->zstd_in.size = fw->size;
+	img->zstd_in.pos = 0;
+	img->size = header.frameContentSize;
+
+	return 0;
+}
+
+/**
+ * ish_fw_image_release() - Release the decompression state of an image
+ * @img:		Firmware image
+ */
+static void ish_fw_image_release(struct ish_fw_image *img)
+{
+	kvfree(img->zstd_wksp);
+	img->zstd_wksp = NULL;
+	img->zstd = NULL;
+}
+
+/**
+ * ish_fw_image_read() - Read the next chunk of a firmware image
+ * @img:		Firmware image
+ * @buf:		Destination
+ * @size:		Size of the chunk
+ *
+ * Return: 0 for success, negative error code for failure.
+ */
+static int ish_fw_image_read(struct ish_fw_image *img, void *buf, u32 size)
+{
+	ZSTD_outBuffer out = { .dst = buf, .size = size, .pos = 0 };
+	size_t in_pos, out_pos, ret;
+
+	if (!IS_ENABLED(CONFIG_ZSTD_DECOMPRESS) || !img->zstd) {
+		memcpy(buf, &img->fw->data[img->pos], size);
+		img->pos += size;
+		return 0;
+	}
+
+	while (out.pos < out.size) {
+		in_pos = img->zstd_in.pos;
+		out_pos = out.pos;
+		ret = ish_fw_zstd_decompress(img->zstd, &out, &img->zstd_in);
+		if (ish_fw_zstd_is_error(ret))
+			return -EBADMSG;
+
+		/* Truncated image */
+		if (in_pos == img->zstd_in.pos && out_pos == out.pos)
+			return -EBADMSG;
+	}
+	img->pos += size;
+
+	return 0;
+}
+
+/**
+ * ish_fw_ipc_stage() - Copy the next firmware chunk into an IPC fragment
+ * @frag:		IPC fragment to fill
+ * @fw:			Firmware image to be loaded
+ * @offset:		Offset of the chunk in the firmware image
+ * @payload_max_size:	Largest chunk that fits in a fragment
+ *
+ * Return: size of the chunk, negative error code for failure.
+ */
+static int ish_fw_ipc_stage(struct loader_xfer_ipc_fragment *frag,
+			    struct ish_fw_image *fw, u32 offset,
+			    u32 payload_max_size)
+{
+	u32 size = min_t(size_t, fw->size - offset, payload_max_size);
+	int rv;
+
+	frag->fragment.offset = offset;
+	frag->fragment.size = size;
+	frag->fragment.is_last = offset + size >= fw->size;
+	rv = ish_fw_image_read(fw, frag->data, size);
+
+	return rv < 0 ? rv : size;
+}
+
 /**
  * ish_fw_xfer_ishtp() - Loads ISH firmware using ishtp interface
  * @client_data:	Client data instance
- * @fw:			Pointer to firmware data struct in host memory
+ * @fw:			Firmware image to be loaded
  *
  * This function uses ISH-TP to transfer ISH firmware from host to
  * ISH SRAM. Lower layers may use IPC or DMA depending on firmware
- * support.
+ * support. The next fragment is prepared while the firmware processes
+ * the current one.
  *
  * Return: 0 for success, negative error code for failure.
  */
 static int ish_fw_xfer_ishtp(struct ishtp_cl_data *client_data,
-			     const struct firmware *fw)
+			     struct ish_fw_image *fw)
 {
-	int rv;
+	int rv, next_size;
 	u32 fragment_offset, fragment_size, payload_max_size;
 	struct loader_xfer_ipc_fragment *ldr_xfer_ipc_frag;
 	struct loader_msg_hdr ldr_xfer_ipc_ack;
@@ -569,38 +796,50 @@ static int ish_fw_xfer_ishtp(struct ishtp_cl_data *client_data,
 
 	/* Break the firmware image into fragments and send as ISH-TP payload */
 	fragment_offset = 0;
+	rv = ish_fw_ipc_stage(ldr_xfer_ipc_frag, fw, 0, payload_max_size);
+	if (rv < 0)
+		goto end_err_resp_buf_release;
+	fragment_size = rv;
 	while (fragment_offset < fw->size) {
-		if (fragment_offset + payload_max_size < fw->size) {
-			fragment_size = payload_max_size;
-			ldr_xfer_ipc_frag->fragment.is_last = 0;
-		} else {
-			fragment_size = fw->size - fragment_offset;
-			ldr_xfer_ipc_frag->fragment.is_last = 1;
-		}
-
-		ldr_xfer_ipc_frag->fragment.offset = fragment_offset;
-		ldr_xfer_ipc_frag->fragment.size = fragment_size;
-		memcpy(ldr_xfer_ipc_frag->data,
-		       &fw->data[fragment_offset],
-		       fragment_size);
-
 		dev_dbg(cl_data_to_dev(client_data),
 			"xfer_mode=ipc offset=0x%08x size=0x%08x is_last=%d\n",
 			ldr_xfer_ipc_frag->fragment.offset,
 			ldr_xfer_ipc_frag->fragment.size,
 			ldr_xfer_ipc_frag->fragment.is_last);
 
-		rv = loader_cl_send(client_data,
-				    (u8 *)ldr_xfer_ipc_frag,
-				    IPC_FRAGMENT_DATA_PREAMBLE + fragment_size,
-				    (u8 *)&ldr_xfer_ipc_ack,
-				    sizeof(ldr_xfer_ipc_ack));
+		rv = loader_cl_send_start(client_data,
+					  (u8 *)ldr_xfer_ipc_frag,
+					  IPC_FRAGMENT_DATA_PREAMBLE +
+					  fragment_size,
+					  (u8 *)&ldr_xfer_ipc_ack,
+					  sizeof(ldr_xfer_ipc_ack));
 		if (rv < 0) {
 			client_data->flag_retry = true;
 			goto end_err_resp_buf_release;
 		}
 
+		/*
+		 * ishtp_cl_send() took a copy, so the next fragment can be
+		 * prepared while the firmware processes this one
+		 */
 		fragment_offset += fragment_size;
+		next_size = 0;
+		if (fragment_offset < fw->size)
+			next_size = ish_fw_ipc_stage(ldr_xfer_ipc_frag, fw,
+						     fragment_offset,
+						     payload_max_size);
+
+		rv = loader_cl_wait(client_data, (u8 *)ldr_xfer_ipc_frag);
+		if (rv < 0) {
+			client_data->flag_retry = true;
+			goto end_err_resp_buf_release;
+		}
+
+		if (next_size < 0) {
+			rv = next_size;
+			goto end_err_resp_buf_release;
+		}
+		fragment_size = next_size;
 	}
 
 	kfree(ldr_xfer_ipc_frag);
@@ -612,10 +851,43 @@ end_err_resp_buf_release:
 	return rv;
 }
 
+/**
+ * ish_fw_dma_stage() - Copy the next firmware chunk into a DMA buffer
+ * @devc:		PCI device doing the DMA
+ * @dma_buf:		DMA buffer
+ * @dma_buf_phy:	DMA address of @dma_buf
+ * @fw:			Firmware image to be loaded
+ * @offset:		Offset of the chunk in the firmware image
+ * @payload_max_size:	Size of the DMA buffer
+ *
+ * Return: size of the chunk, negative error code for failure.
+ */
+static int ish_fw_dma_stage(struct device *devc, void *dma_buf,
+			    dma_addr_t dma_buf_phy, struct ish_fw_image *fw,
+			    u32 offset, u32 payload_max_size)
+{
+	u32 size = min_t(size_t, fw->size - offset, payload_max_size);
+	int rv;
+
+	rv = ish_fw_image_read(fw, dma_buf, size);
+	if (rv < 0)
+		return rv;
+
+	dma_sync_single_for_device(devc, dma_buf_phy, size, DMA_TO_DEVICE);
+
+	/*
+	 * Flush cache here because the dma_sync_single_for_device()
+	 * does not do for x86.
+	 */
+	clflush_cache_range(dma_buf, size);
+
+	return size;
+}
+
 /**
  * ish_fw_xfer_direct_dma() - Loads ISH firmware using direct dma
  * @client_data:	Client data instance
- * @fw:			Pointer to firmware data struct in host memory
+ * @fw:			Firmware image to be loaded
  * @fw_info:		Loader firmware properties
  *
  * Host firmware load is a unique case where we need to download
@@ -625,16 +897,22 @@ end_err_resp_buf_release:
  * directly to ISH UMA at location of choice.
  * Function depends on corresponding support in ISH firmware.
  *
+ * The Shim firmware loader takes one fragment at a time, so two DMA
+ * buffers are used: the next chunk is copied and flushed while the
+ * firmware consumes the current one.
+ *
  * Return: 0 for success, negative error code for failure.
  */
 static int ish_fw_xfer_direct_dma(struct ishtp_cl_data *client_data,
-				  const struct firmware *fw,
+				  struct ish_fw_image *fw,
 				  const struct shim_fw_info fw_info)
 {
 	int rv;
-	void *dma_buf;
-	dma_addr_t dma_buf_phy;
+	void *dma_buf[2];
+	dma_addr_t dma_buf_phy[2];
+	int nbufs, cur = 0, next_size;
 	u32 fragment_offset, fragment_size, payload_max_size;
+	u32 next_offset;
 	struct loader_msg_hdr ldr_xfer_dma_frag_ack;
 	struct loader_xfer_dma_fragment ldr_xfer_dma_frag;
 	struct device *devc = ishtp_get_pci_device(client_data->cl_device);
@@ -657,49 +935,45 @@ static int ish_fw_xfer_direct_dma(struct ishtp_cl_data *client_data,
 	 */
 	payload_max_size &= ~(L1_CACHE_BYTES - 1);
 
-	dma_buf = kmalloc(payload_max_size, GFP_KERNEL | GFP_DMA32);
-	if (!dma_buf) {
-		client_data->flag_retry = true;
-		return -ENOMEM;
+	/* A single buffer still works, only without the overlap */
+	for (nbufs = 0; nbufs < ARRAY_SIZE(dma_buf); nbufs++) {
+		dma_buf[nbufs] = kmalloc(payload_max_size,
+					 GFP_KERNEL | GFP_DMA32);
+		if (!dma_buf[nbufs])
+			break;
+
+		dma_buf_phy[nbufs] = dma_map_single(devc, dma_buf[nbufs],
+						    payload_max_size,
+						    DMA_TO_DEVICE);
+		if (dma_mapping_error(devc, dma_buf_phy[nbufs])) {
+			dev_err(cl_data_to_dev(client_data),
+				"DMA map failed\n");
+			kfree(dma_buf[nbufs]);
+			break;
+		}
 	}
-
-	dma_buf_phy = dma_map_single(devc, dma_buf, payload_max_size,
-				     DMA_TO_DEVICE);
-	if (dma_mapping_error(devc, dma_buf_phy)) {
-		dev_err(cl_data_to_dev(client_data), "DMA map failed\n");
+	if (!nbufs) {
 		client_data->flag_retry = true;
-		rv = -ENOMEM;
-		goto end_err_dma_buf_release;
+		return -ENOMEM;
 	}
 
 	ldr_xfer_dma_frag.fragment.hdr.command = LOADER_CMD_XFER_FRAGMENT;
 	ldr_xfer_dma_frag.fragment.xfer_mode = LOADER_XFER_MODE_DIRECT_DMA;
-	ldr_xfer_dma_frag.ddr_phys_addr = (u64)dma_buf_phy;
 
 	/* Send the firmware image in chucks of payload_max_size */
 	fragment_offset = 0;
+	rv = ish_fw_dma_stage(devc, dma_buf[0], dma_buf_phy[0], fw, 0,
+			      payload_max_size);
+	if (rv < 0)
+		goto end_err_resp_buf_release;
+	fragment_size = rv;
 	while (fragment_offset < fw->size) {
-		if (fragment_offset + payload_max_size < fw->size) {
-			fragment_size = payload_max_size;
-			ldr_xfer_dma_frag.fragment.is_last = 0;
-		} else {
-			fragment_size = fw->size - fragment_offset;
-			ldr_xfer_dma_frag.fragment.is_last = 1;
-		}
+		next_offset = fragment_offset + fragment_size;
 
 		ldr_xfer_dma_frag.fragment.offset = fragment_offset;
 		ldr_xfer_dma_frag.fragment.size = fragment_size;
-		memcpy(dma_buf, &fw->data[fragment_offset], fragment_size);
-
-		dma_sync_single_for_device(devc, dma_buf_phy,
-					   payload_max_size,
-					   DMA_TO_DEVICE);
-
-		/*
-		 * Flush cache here because the dma_sync_single_for_device()
-		 * does not do for x86.
-		 */
-		clflush_cache_range(dma_buf, payload_max_size);
+		ldr_xfer_dma_frag.fragment.is_last = next_offset >= fw->size;
+		ldr_xfer_dma_frag.ddr_phys_addr = (u64)dma_buf_phy[cur];
 
 		dev_dbg(cl_data_to_dev(client_data),
 			"xfer_mode=dma offset=0x%08x size=0x%x is_last=%d ddr_phys_addr=0x%016llx\n",
@@ -708,28 +982,52 @@ static int ish_fw_xfer_direct_dma(struct ishtp_cl_data *client_data,
 			ldr_xfer_dma_frag.fragment.is_last,
 			ldr_xfer_dma_frag.ddr_phys_addr);
 
-		rv = loader_cl_send(client_data,
-				    (u8 *)&ldr_xfer_dma_frag,
-				    sizeof(ldr_xfer_dma_frag),
-				    (u8 *)&ldr_xfer_dma_frag_ack,
-				    sizeof(ldr_xfer_dma_frag_ack));
+		rv = loader_cl_send_start(client_data,
+					  (u8 *)&ldr_xfer_dma_frag,
+					  sizeof(ldr_xfer_dma_frag),
+					  (u8 *)&ldr_xfer_dma_frag_ack,
+					  sizeof(ldr_xfer_dma_frag_ack));
 		if (rv < 0) {
 			client_data->flag_retry = true;
 			goto end_err_resp_buf_release;
 		}
 
-		fragment_offset += fragment_size;
-	}
+		/* Stage the next chunk while the firmware consumes this one */
+		cur = (cur + 1) % nbufs;
+		next_size = 0;
+		if (nbufs > 1 && next_offset < fw->size)
+			next_size = ish_fw_dma_stage(devc, dma_buf[cur],
+						     dma_buf_phy[cur], fw,
+						     next_offset,
+						     payload_max_size);
 
-	dma_unmap_single(devc, dma_buf_phy, payload_max_size, DMA_TO_DEVICE);
-	kfree(dma_buf);
-	return 0;
+		rv = loader_cl_wait(client_data, (u8 *)&ldr_xfer_dma_frag);
+		if (rv < 0) {
+			client_data->flag_retry = true;
+			goto end_err_resp_buf_release;
+		}
+
+		if (nbufs == 1 && next_offset < fw->size)
+			next_size = ish_fw_dma_stage(devc, dma_buf[cur],
+						     dma_buf_phy[cur], fw,
+						     next_offset,
+						     payload_max_size);
+
+		if (next_size < 0) {
+			rv = next_size;
+			goto end_err_resp_buf_release;
+		}
+
+		fragment_offset = next_offset;
+		fragment_size = next_size;
+	}
 
 end_err_resp_buf_release:
-	/* Free ISH buffer if not done already, in error case */
-	dma_unmap_single(devc, dma_buf_phy, payload_max_size, DMA_TO_DEVICE);
-end_err_dma_buf_release:
-	kfree(dma_buf);
+	while (nbufs--) {
+		dma_unmap_single(devc, dma_buf_phy[nbufs], payload_max_size,
+				 DMA_TO_DEVICE);
+		kfree(dma_buf[nbufs]);
+	}
 	return rv;
 }
 
@@ -768,8 +1066,12 @@ static int load_fw_from_host(struct ishtp_cl_data *client_data)
 {
 	int rv;
 	u32 xfer_mode;
+	ktime_t xfer_start;
 	char *filename;
+	char *zst_filename;
+	bool compressed;
 	const struct firmware *fw;
+	struct ish_fw_image fw_img;
 	struct shim_fw_info fw_info;
 	struct ishtp_cl *loader_ishtp_cl = client_data->loader_ishtp_cl;
 
@@ -787,23 +1089,40 @@ static int load_fw_from_host(struct ishtp_cl_data *client_data)
 	if (rv < 0)
 		goto end_err_filename_buf_release;
 
-	rv = request_firmware(&fw, filename, cl_data_to_dev(client_data));
+	/* Prefer a zstd-compressed image, fall back to the plain one */
+	compressed = false;
+	if (IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)) {
+		zst_filename = kasprintf(GFP_KERNEL, "%s.zst", filename);
+		compressed = zst_filename &&
+			!firmware_request_nowarn(&fw, zst_filename,
+						 cl_data_to_dev(client_data));
+		kfree(zst_filename);
+	}
+	if (!compressed) {
+		rv = request_firmware(&fw, filename,
+				      cl_data_to_dev(client_data));
+		if (rv < 0)
+			goto end_err_filename_buf_release;
+	}
+
+	rv = ish_fw_image_init(client_data, &fw_img, fw, compressed);
 	if (rv < 0)
-		goto end_err_filename_buf_release;
+		goto end_err_fw_release;
 
 	/* Step 1: Query Shim firmware loader properties */
 
-	rv = ish_query_loader_prop(client_data, fw, &fw_info);
+	rv = ish_query_loader_prop(client_data, &fw_img, &fw_info);
 	if (rv < 0)
 		goto end_err_fw_release;
 
 	/* Step 2: Send the main firmware image to be loaded, to ISH SRAM */
 
+	xfer_start = ktime_get();
 	xfer_mode = fw_info.ldr_capability.xfer_mode;
 	if (xfer_mode & LOADER_XFER_MODE_DIRECT_DMA) {
-		rv = ish_fw_xfer_direct_dma(client_data, fw, fw_info);
+		rv = ish_fw_xfer_direct_dma(client_data, &fw_img, fw_info);
 	} else if (xfer_mode & LOADER_XFER_MODE_ISHTP) {
-		rv = ish_fw_xfer_ishtp(client_data, fw);
+		rv = ish_fw_xfer_ishtp(client_data, &fw_img);
 	} else {
 		dev_err(cl_data_to_dev(client_data),
 			"No transfer mode selected in firmware\n");
@@ -812,19 +1131,26 @@ static int load_fw_from_host(struct ishtp_cl_data *client_data)
 	if (rv < 0)
 		goto end_err_fw_release;
 
+	dev_dbg(cl_data_to_dev(client_data),
+		"firmware transfer of %zu bytes (%zu in file) took %lld us\n",
+		fw_img.size, fw->size,
+		ktime_us_delta(ktime_get(), xfer_start));
+
 	/* Step 3: Start ISH main firmware exeuction */
 
 	rv = ish_fw_start(client_data);
 	if (rv < 0)
 		goto end_err_fw_release;
 
+	ish_fw_image_release(&fw_img);
 	release_firmware(fw);
-	dev_info(cl_data_to_dev(client_data), "ISH firmware %s loaded\n",
-		 filename);
+	dev_info(cl_data_to_dev(client_data), "ISH firmware %s%s loaded\n",
+		 filename, compressed ? ".zst" : "");
 	kfree(filename);
 	return 0;
 
 end_err_fw_release:
+	ish_fw_image_release(&fw_img);
 	release_firmware(fw);
 end_err_filename_buf_release:
 	kfree(filename);
@@ -11,15 +11,42 @@
 #include <linux/device.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/sizes.h>
 #include "bus.h"
 #include "ishtp-dev.h"
 #include "client.h"
 #include "hbm.h"
+#include "trace.h"
 
 static int ishtp_use_dma;
 module_param_named(ishtp_use_dma, ishtp_use_dma, int, 0600);
 MODULE_PARM_DESC(ishtp_use_dma, "Use DMA to send messages");
 
+static int ishtp_fc_creds_max = 8;
+module_param_named(ishtp_fc_creds_max, ishtp_fc_creds_max, int, 0600);
+MODULE_PARM_DESC(ishtp_fc_creds_max,
+		 "Flow control credits a client may accumulate (1 = stop-and-wait)");
+
+static int ishtp_dma_batch;
+module_param_named(ishtp_dma_batch, ishtp_dma_batch, int, 0600);
+MODULE_PARM_DESC(ishtp_dma_batch,
+		 "Most queued messages to announce in one DMA transfer (0/1 = no batching)");
+
+static int ishtp_prop_req_window = 4;
+module_param_named(ishtp_prop_req_window, ishtp_prop_req_window, int, 0600);
+MODULE_PARM_DESC(ishtp_prop_req_window,
+		 "Client property requests in flight at bring-up (1 = one at a time)");
+
+static int ishtp_dma_tx_buf_kb = 1024;
+module_param_named(ishtp_dma_tx_buf_kb, ishtp_dma_tx_buf_kb, int, 0600);
+MODULE_PARM_DESC(ishtp_dma_tx_buf_kb,
+		 "Largest DMA Tx buffer, in KiB");
+
+static int ishtp_dma_rx_buf_kb = 1024;
+module_param_named(ishtp_dma_rx_buf_kb, ishtp_dma_rx_buf_kb, int, 0600);
+MODULE_PARM_DESC(ishtp_dma_rx_buf_kb,
+		 "Largest DMA Rx buffer, in KiB");
+
 #define to_ishtp_cl_driver(d) container_of(d, struct ishtp_cl_driver, driver)
 #define to_ishtp_cl_device(d) container_of(d, struct ishtp_cl_device, dev)
 static bool ishtp_device_ready;
@@ -113,6 +140,9 @@ int ishtp_send_msg(struct ishtp_device *dev, struct ishtp_msg_hdr *hdr,
 int ishtp_write_message(struct ishtp_device *dev, struct ishtp_msg_hdr *hdr,
 			void *buf)
 {
+	if (!hdr->host_addr && !hdr->fw_addr)
+		trace_ishtp_hbm_tx(*(u8 *)buf, hdr->length);
+
 	return ishtp_send_msg(dev, hdr, buf, NULL, NULL);
 }
 
@@ -127,11 +157,12 @@ int ishtp_write_message(struct ishtp_device *dev, struct ishtp_msg_hdr *hdr,
  */
 int ishtp_fw_cl_by_uuid(struct ishtp_device *dev, const guid_t *uuid)
 {
-	unsigned int i;
+	struct ishtp_fw_client *fw_client;
 
-	for (i = 0; i < dev->fw_clients_num; ++i) {
-		if (guid_equal(uuid, &dev->fw_clients[i].props.protocol_name))
-			return i;
+	hash_for_each_possible(dev->fw_clients_uuid_hash, fw_client,
+			       uuid_node, ishtp_fw_cl_uuid_hash(uuid)) {
+		if (guid_equal(uuid, &fw_client->props.protocol_name))
+			return fw_client - dev->fw_clients;
 	}
 	return -ENOENT;
 }
@@ -191,11 +222,15 @@ int ishtp_fw_cl_by_id(struct ishtp_device *dev, uint8_t client_id)
 	unsigned long	flags;
 
 	spin_lock_irqsave(&dev->fw_clients_lock, flags);
-	for (i = 0; i < dev->fw_clients_num; i++) {
-		if (dev->fw_clients[i].client_id == client_id) {
+	/*
+	 * fw_clients[] is filled in fw_clients_map order, so the index of a
+	 * client is the number of clients with a lower id
+	 */
+	if (test_bit(client_id, dev->fw_clients_map)) {
+		i = bitmap_weight(dev->fw_clients_map, client_id);
+		if (i < dev->fw_clients_num &&
+		    dev->fw_clients[i].client_id == client_id)
 			res = i;
-			break;
-		}
 	}
 	spin_unlock_irqrestore(&dev->fw_clients_lock, flags);
 
@@ -400,16 +435,17 @@ static const struct device_type ishtp_cl_device_type = {
 /**
  * ishtp_bus_add_device() - Function to create device on bus
  * @dev:	ishtp device
- * @uuid:	uuid of the client
+ * @fw_client:	FW client of the device
  * @name:	Name of the client
  *
- * Allocate ISHTP bus client device, attach it to uuid
+ * Allocate ISHTP bus client device, attach it to the FW client
  * and register with ISHTP bus.
  *
  * Return: ishtp_cl_device pointer or NULL on failure
  */
 static struct ishtp_cl_device *ishtp_bus_add_device(struct ishtp_device *dev,
-						    guid_t uuid, char *name)
+					struct ishtp_fw_client *fw_client,
+					char *name)
 {
 	struct ishtp_cl_device *device;
 	int status;
@@ -418,8 +454,7 @@ static struct ishtp_cl_device *ishtp_bus_add_device(struct ishtp_device *dev,
 	spin_lock_irqsave(&dev->device_list_lock, flags);
 	list_for_each_entry(device, &dev->device_list, device_link) {
 		if (!strcmp(name, dev_name(&device->dev))) {
-			device->fw_client = &dev->fw_clients[
-				dev->fw_client_presentation_num - 1];
+			device->fw_client = fw_client;
 			spin_unlock_irqrestore(&dev->device_list_lock, flags);
 			ishtp_cl_device_reset(device);
 			return device;
@@ -436,8 +471,7 @@ static struct ishtp_cl_device *ishtp_bus_add_device(struct ishtp_device *dev,
 	device->dev.type = &ishtp_cl_device_type;
 	device->ishtp_dev = dev;
 
-	device->fw_client =
-		&dev->fw_clients[dev->fw_client_presentation_num - 1];
+	device->fw_client = fw_client;
 
 	dev_set_name(&device->dev, "%s", name);
 
@@ -634,15 +668,16 @@ EXPORT_SYMBOL(ishtp_dev_to_cl_device);
 /**
  * ishtp_bus_new_client() - Create a new client
  * @dev:	ISHTP device instance
+ * @fw_client:	FW client whose properties were received
  *
  * Once bus protocol enumerates a client, this is called
  * to add a device for the client.
  *
  * Return: 0 on success or error code on failure
  */
-int ishtp_bus_new_client(struct ishtp_device *dev)
+int ishtp_bus_new_client(struct ishtp_device *dev,
+			 struct ishtp_fw_client *fw_client)
 {
-	int	i;
 	char	*dev_name;
 	struct ishtp_cl_device	*cl_device;
 	guid_t	device_uuid;
@@ -653,13 +688,12 @@ int ishtp_bus_new_client(struct ishtp_device *dev)
 	 * If appropriate driver has loaded, this will trigger its probe().
 	 * Otherwise, probe() will be called when driver is loaded
 	 */
-	i = dev->fw_client_presentation_num - 1;
-	device_uuid = dev->fw_clients[i].props.protocol_name;
+	device_uuid = fw_client->props.protocol_name;
 	dev_name = kasprintf(GFP_KERNEL, "{%pUL}", &device_uuid);
 	if (!dev_name)
 		return	-ENOMEM;
 
-	cl_device = ishtp_bus_add_device(dev, device_uuid, dev_name);
+	cl_device = ishtp_bus_add_device(dev, fw_client, dev_name);
 	if (!cl_device) {
 		kfree(dev_name);
 		return	-ENOENT;
@@ -719,6 +753,10 @@ void ishtp_bus_remove_all_clients(struct ishtp_device *ishtp_dev,
 	struct ishtp_cl	*cl;
 	unsigned long	flags;
 
+	/* The device is going away */
+	if (!warm_reset)
+		ishtp_debugfs_dev_exit(ishtp_dev);
+
 	spin_lock_irqsave(&ishtp_dev->cl_list_lock, flags);
 	list_for_each_entry(cl, &ishtp_dev->cl_list, link) {
 		cl->state = ISHTP_CL_DISCONNECTED;
@@ -737,6 +775,9 @@ void ishtp_bus_remove_all_clients(struct ishtp_device *ishtp_dev,
 		ishtp_cl_free_rx_ring(cl);
 		ishtp_cl_free_tx_ring(cl);
 
+		/* The DMA Rx buffer goes away below; unlend it first */
+		ishtp_cl_dma_rx_drop_all(cl);
+
 		/*
 		 * Free client and ISHTP bus client device structures
 		 * don't free host client because it is part of the OS fd
@@ -765,12 +806,14 @@ void ishtp_bus_remove_all_clients(struct ishtp_device *ishtp_dev,
 
 	/* Free all client structures */
 	spin_lock_irqsave(&ishtp_dev->fw_clients_lock, flags);
+	hash_init(ishtp_dev->fw_clients_uuid_hash);
 	kfree(ishtp_dev->fw_clients);
 	ishtp_dev->fw_clients = NULL;
 	ishtp_dev->fw_clients_num = 0;
 	ishtp_dev->fw_client_presentation_num = 0;
 	ishtp_dev->fw_client_index = 0;
 	bitmap_zero(ishtp_dev->fw_clients_map, ISHTP_CLIENTS_MAX);
+	bitmap_zero(ishtp_dev->fw_clients_props_map, ISHTP_CLIENTS_MAX);
 	spin_unlock_irqrestore(&ishtp_dev->fw_clients_lock, flags);
 }
 EXPORT_SYMBOL(ishtp_bus_remove_all_clients);
@@ -787,10 +830,12 @@ void ishtp_reset_handler(struct ishtp_device *dev)
 
 	/* Handle FW-initiated reset */
 	dev->dev_state = ISHTP_DEV_RESETTING;
+	ishtp_fw_clock_reset(dev);
 
 	/* Clear BH processing queue - no further HBMs */
 	spin_lock_irqsave(&dev->rd_msg_spinlock, flags);
 	dev->rd_msg_fifo_head = dev->rd_msg_fifo_tail = 0;
+	++dev->rd_msg_fifo_resets;
 	spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
 
 	/* Handle ISH FW reset against upper layers */
@@ -825,6 +870,73 @@ int ishtp_use_dma_transfer(void)
 	return ishtp_use_dma;
 }
 
+/**
+ * ishtp_get_fc_creds_max() - Function to get the flow control credit limit
+ *
+ * This interface is used to cap the flow control credits a client will
+ * accumulate from the firmware
+ *
+ * Return the credit limit, between 1 and U8_MAX
+ */
+unsigned int ishtp_get_fc_creds_max(void)
+{
+	return clamp(ishtp_fc_creds_max, 1, U8_MAX);
+}
+
+/**
+ * ishtp_get_dma_batch_max() - Function to get the DMA batch size
+ *
+ * This interface is used to limit how many queued messages of a client
+ * are packed into a single DMA_XFER
+ *
+ * Return the batch size, between 1 and DMA_XFER_BATCH_MAX
+ */
+unsigned int ishtp_get_dma_batch_max(void)
+{
+	return clamp_t(int, ishtp_dma_batch, 1, DMA_XFER_BATCH_MAX);
+}
+
+/**
+ * ishtp_get_prop_req_window() - Function to get the property request window
+ *
+ * This interface is used to limit how many client property requests are
+ * outstanding at once while enumerating firmware clients
+ *
+ * Return the window size, at least 1
+ */
+unsigned int ishtp_get_prop_req_window(void)
+{
+	return max(ishtp_prop_req_window, 1);
+}
+
+/**
+ * ishtp_get_dma_tx_buf_max() - Function to get the DMA Tx buffer limit
+ *
+ * This interface is used to cap the DMA Tx buffer, however many clients
+ * are connected
+ *
+ * Return the limit in bytes, a multiple of DMA_SLOT_SIZE
+ */
+unsigned int ishtp_get_dma_tx_buf_max(void)
+{
+	return round_down(clamp(ishtp_dma_tx_buf_kb, 4, SZ_64K) * SZ_1K,
+			  DMA_SLOT_SIZE);
+}
+
+/**
+ * ishtp_get_dma_rx_buf_max() - Function to get the DMA Rx buffer limit
+ *
+ * This interface is used to cap the DMA Rx buffer, however many firmware
+ * clients there are
+ *
+ * Return the limit in bytes, a multiple of DMA_SLOT_SIZE
+ */
+unsigned int ishtp_get_dma_rx_buf_max(void)
+{
+	return round_down(clamp(ishtp_dma_rx_buf_kb, 4, SZ_64K) * SZ_1K,
+			  DMA_SLOT_SIZE);
+}
+
 /**
  * ishtp_device() - Return device pointer
  * @device: ISH-TP client device instance
@@ -913,7 +1025,15 @@ EXPORT_SYMBOL(ish_hw_reset);
  */
 static int  __init ishtp_bus_register(void)
 {
-	return bus_register(&ishtp_cl_bus_type);
+	int ret;
+
+	ishtp_debugfs_init();
+
+	ret = bus_register(&ishtp_cl_bus_type);
+	if (ret)
+		ishtp_debugfs_exit();
+
+	return ret;
 }
 
 /**
@@ -924,6 +1044,7 @@ static int  __init ishtp_bus_register(void)
 static void __exit ishtp_bus_unregister(void)
 {
 	bus_unregister(&ishtp_cl_bus_type);
+	ishtp_debugfs_exit();
 }
 
 module_init(ishtp_bus_register);
@@ -13,26 +13,178 @@
 #include <asm/cacheflush.h>
 #include "hbm.h"
 #include "client.h"
+#include "trace.h"
 
 int ishtp_cl_get_tx_free_buffer_size(struct ishtp_cl *cl)
 {
-	unsigned long tx_free_flags;
-	int size;
-
-	spin_lock_irqsave(&cl->tx_free_list_spinlock, tx_free_flags);
-	size = cl->tx_ring_free_size * cl->device->fw_client->props.max_msg_length;
-	spin_unlock_irqrestore(&cl->tx_free_list_spinlock, tx_free_flags);
-
-	return size;
+	return ishtp_cl_get_tx_free_rings(cl) *
+		cl->device->fw_client->props.max_msg_length;
 }
 EXPORT_SYMBOL(ishtp_cl_get_tx_free_buffer_size);
 
 int ishtp_cl_get_tx_free_rings(struct ishtp_cl *cl)
 {
-	return cl->tx_ring_free_size;
+	return cl->tx_ring_slots -
+		(READ_ONCE(cl->tx_tail) - READ_ONCE(cl->tx_head));
 }
 EXPORT_SYMBOL(ishtp_cl_get_tx_free_rings);
 
+/**
+ * ishtp_cl_tx_peek() - Get the message at the head of the Tx ring
+ * @cl: ishtp client instance
+ *
+ * Must be called with tx_list_spinlock held.
+ *
+ * Return: the head slot, or NULL if there is no message ready to send
+ */
+static struct ishtp_cl_tx_ring *ishtp_cl_tx_peek(struct ishtp_cl *cl)
+{
+	struct ishtp_cl_tx_ring	*cl_msg;
+	unsigned int	head = cl->tx_head;
+
+	if (!cl->tx_ring || head == READ_ONCE(cl->tx_tail))
+		return NULL;
+
+	cl_msg = &cl->tx_ring[head & (cl->tx_ring_slots - 1)];
+
+	/* Reserved, but the sender hasn't finished filling it yet */
+	if (!smp_load_acquire(&cl_msg->ready))
+		return NULL;
+
+	return cl_msg;
+}
+
+/**
+ * ishtp_cl_tx_pop() - Return the head slot of the Tx ring to senders
+ * @cl: ishtp client instance
+ * @cl_msg: the slot returned by ishtp_cl_tx_peek()
+ *
+ * Must be called with tx_list_spinlock held, once the message data has been
+ * copied out of the slot.
+ */
+static void ishtp_cl_tx_pop(struct ishtp_cl *cl,
+			    struct ishtp_cl_tx_ring *cl_msg)
+{
+	if (cl_msg->large >= 0) {
+		clear_bit_unlock(cl_msg->large, &cl->tx_large_map);
+		cl_msg->large = -1;
+	}
+	cl_msg->ready = 0;
+	smp_store_release(&cl->tx_head, cl->tx_head + 1);
+}
+
+/**
+ * ishtp_cl_tx_path() - Choose the Tx path of a message
+ * @cl: ishtp client instance
+ * @length: length of message
+ *
+ * Unless dev->transfer_path enforces a path, a message goes over DMA if it
+ * would take at least dma_worth_frags IPC fragments. One in
+ * CL_TX_PATH_PROBE_INTERVAL messages takes the other path, so that the
+ * latency of both keeps being sampled.
+ *
+ * Return: CL_TX_PATH_IPC or CL_TX_PATH_DMA
+ */
+static int ishtp_cl_tx_path(struct ishtp_cl *cl, size_t length)
+{
+	struct ishtp_device	*dev = cl->dev;
+	bool	dma;
+
+	if (dev->transfer_path != CL_TX_PATH_DEFAULT)
+		return dev->transfer_path;
+
+	if (!dev->ishtp_host_dma_enabled || !dev->ishtp_host_dma_tx_buf)
+		return CL_TX_PATH_IPC;
+
+	dma = DIV_ROUND_UP(length, dev->mtu) >= READ_ONCE(cl->dma_worth_frags);
+	if (++cl->tx_path_probe >= CL_TX_PATH_PROBE_INTERVAL) {
+		cl->tx_path_probe = 0;
+		dma = !dma;
+	}
+
+	return dma ? CL_TX_PATH_DMA : CL_TX_PATH_IPC;
+}
+
+/**
+ * ishtp_cl_tx_sample_start() - Start timing a Tx message
+ * @cl: ishtp client instance
+ * @path: path the message is sent over
+ * @size: length of message
+ *
+ * Only one message is timed at a time.
+ */
+static void ishtp_cl_tx_sample_start(struct ishtp_cl *cl, int path,
+				     size_t size)
+{
+	if (cl->ts_tx)
+		return;
+
+	cl->ts_tx_path = path;
+	cl->ts_tx_size = size;
+	cl->ts_tx = ktime_get();
+}
+
+/**
+ * ishtp_cl_tx_sample_end() - Complete timing a Tx message
+ * @cl: ishtp client instance
+ * @path: path the completion came from
+ *
+ * Called on FC for IPC and on DMA_XFER_ACK for DMA. Updates the latency
+ * averages and, once both paths have been sampled, dma_worth_frags.
+ */
+void ishtp_cl_tx_sample_end(struct ishtp_cl *cl, int path)
+{
+	unsigned long	ipc_ns, dma_ns;
+	size_t	frags;
+	s64	ns;
+
+	if (!cl->ts_tx || cl->ts_tx_path != path)
+		return;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), cl->ts_tx));
+	cl->ts_tx = 0;
+
+	/* Drop samples that spanned a stall, such as a reset */
+	if (ns <= 0 || ns > NSEC_PER_SEC)
+		return;
+
+	if (path == CL_TX_PATH_IPC) {
+		frags = max_t(size_t, DIV_ROUND_UP(cl->ts_tx_size, cl->dev->mtu),
+			      1);
+		ewma_cl_tx_lat_add(&cl->tx_ipc_frag_ns, div_u64(ns, frags));
+	} else {
+		ewma_cl_tx_lat_add(&cl->tx_dma_msg_ns, ns);
+	}
+
+	ipc_ns = ewma_cl_tx_lat_read(&cl->tx_ipc_frag_ns);
+	dma_ns = ewma_cl_tx_lat_read(&cl->tx_dma_msg_ns);
+	if (ipc_ns && dma_ns)
+		WRITE_ONCE(cl->dma_worth_frags,
+			   clamp_t(unsigned long, DIV_ROUND_UP(dma_ns, ipc_ns),
+				   1, DMA_WORTH_THRESHOLD_MAX));
+}
+
+/**
+ * ishtp_cl_tx_get_large() - Borrow a full-size Tx buffer
+ * @cl: ishtp client instance
+ *
+ * The buffer is given back by ishtp_cl_tx_pop() once it has been sent.
+ *
+ * Return: index of the buffer in tx_large_buf, or -1 if none is free
+ */
+static int ishtp_cl_tx_get_large(struct ishtp_cl *cl)
+{
+	unsigned int	i;
+
+	do {
+		i = find_first_zero_bit(&cl->tx_large_map, cl->tx_large_cnt);
+		if (i >= cl->tx_large_cnt)
+			return -1;
+	} while (test_and_set_bit_lock(i, &cl->tx_large_map));
+
+	return i;
+}
+
 /**
  * ishtp_read_list_flush() - Flush read queue
  * @cl: ishtp client instance
@@ -46,11 +198,10 @@ static void ishtp_read_list_flush(struct ishtp_cl *cl)
 	unsigned long	flags;
 
 	spin_lock_irqsave(&cl->dev->read_list_spinlock, flags);
-	list_for_each_entry_safe(rb, next, &cl->dev->read_list.list, list)
-		if (rb->cl && ishtp_cl_cmp_id(cl, rb->cl)) {
-			list_del(&rb->list);
-			ishtp_io_rb_free(rb);
-		}
+	list_for_each_entry_safe(rb, next, &cl->read_list.list, list) {
+		list_del(&rb->list);
+		ishtp_io_rb_free(rb);
+	}
 	spin_unlock_irqrestore(&cl->dev->read_list_spinlock, flags);
 }
 
@@ -89,25 +240,28 @@ static void ishtp_cl_init(struct ishtp_cl *cl, struct ishtp_device *dev)
 	spin_lock_init(&cl->free_list_spinlock);
 	spin_lock_init(&cl->in_process_spinlock);
 	spin_lock_init(&cl->tx_list_spinlock);
-	spin_lock_init(&cl->tx_free_list_spinlock);
 	spin_lock_init(&cl->fc_spinlock);
 	INIT_LIST_HEAD(&cl->link);
 	cl->dev = dev;
 
+	INIT_LIST_HEAD(&cl->read_list.list);
 	INIT_LIST_HEAD(&cl->free_rb_list.list);
-	INIT_LIST_HEAD(&cl->tx_list.list);
-	INIT_LIST_HEAD(&cl->tx_free_list.list);
 	INIT_LIST_HEAD(&cl->in_process_list.list);
 
 	cl->rx_ring_size = CL_DEF_RX_RING_SIZE;
 	cl->tx_ring_size = CL_DEF_TX_RING_SIZE;
-	cl->tx_ring_free_size = cl->tx_ring_size;
 
 	/* dma */
 	cl->last_tx_path = CL_TX_PATH_IPC;
 	cl->last_dma_acked = 1;
 	cl->last_dma_addr = NULL;
 	cl->last_ipc_acked = 1;
+	cl->dma_worth_frags = DMA_WORTH_THRESHOLD;
+	ewma_cl_tx_lat_init(&cl->tx_ipc_frag_ns);
+	ewma_cl_tx_lat_init(&cl->tx_dma_msg_ns);
+
+	/* counting flow control */
+	cl->ishtp_flow_ctrl_creds_max = ishtp_get_fc_creds_max();
 }
 
 /**
@@ -127,10 +281,40 @@ struct ishtp_cl *ishtp_cl_allocate(struct ishtp_cl_device *cl_device)
 		return NULL;
 
 	ishtp_cl_init(cl, cl_device->ishtp_dev);
+
+	cl->stats = __alloc_percpu(ishtp_stats_size(ISHTP_CL_STATS),
+				   __alignof__(struct ishtp_stats));
+	if (!cl->stats) {
+		kfree(cl);
+		return NULL;
+	}
+	ishtp_stats_init(cl->stats);
+
 	return cl;
 }
 EXPORT_SYMBOL(ishtp_cl_allocate);
 
+/**
+ * ishtp_check_layout() - Check a module's view of the ISHTP structures
+ * @dev_size: sizeof(struct ishtp_device) the module was built with
+ * @cl_size: sizeof(struct ishtp_cl) the module was built with
+ *
+ * Modules built against these headers, rather than the client interface,
+ * access the device and client structures directly. They call this at load
+ * to make sure they run against the intel-ishtp built from the same tree.
+ *
+ * Return: 0 if the layouts match else -EINVAL
+ */
+int ishtp_check_layout(size_t dev_size, size_t cl_size)
+{
+	if (dev_size != sizeof(struct ishtp_device) ||
+	    cl_size != sizeof(struct ishtp_cl))
+		return -EINVAL;
+
+	return 0;
+}
+EXPORT_SYMBOL(ishtp_check_layout);
+
 /**
  * ishtp_cl_free() - Frees a client device
  * @cl: client device instance
@@ -149,9 +333,15 @@ void	ishtp_cl_free(struct ishtp_cl *cl)
 	if (!dev)
 		return;
 
+	if (cl->dma_rx_held)
+		cancel_delayed_work_sync(&cl->dma_rx_work);
+
 	spin_lock_irqsave(&dev->cl_list_lock, flags);
 	ishtp_cl_free_rx_ring(cl);
+	ishtp_cl_dma_rx_drop_all(cl);
 	ishtp_cl_free_tx_ring(cl);
+	kfree(cl->dma_rx_held);
+	free_percpu(cl->stats);
 	kfree(cl);
 	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
 }
@@ -203,6 +393,9 @@ int ishtp_cl_link(struct ishtp_cl *cl)
 	}
 	list_add_tail(&cl->link, &dev->cl_list);
 	set_bit(id, dev->host_clients_map);
+	spin_lock(&dev->read_list_spinlock);
+	dev->host_clients[id] = cl;
+	spin_unlock(&dev->read_list_spinlock);
 	cl->state = ISHTP_CL_INITIALIZING;
 
 unlock_cl:
@@ -248,6 +441,10 @@ void ishtp_cl_unlink(struct ishtp_cl *cl)
 			list_del_init(&pos->link);
 			break;
 		}
+	spin_lock(&dev->read_list_spinlock);
+	if (dev->host_clients[cl->host_client_id] == cl)
+		dev->host_clients[cl->host_client_id] = NULL;
+	spin_unlock(&dev->read_list_spinlock);
 	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
 }
 EXPORT_SYMBOL(ishtp_cl_unlink);
@@ -422,6 +619,9 @@ int ishtp_cl_connect(struct ishtp_cl *cl)
 		return rets;
 	}
 
+	/* Make room for this client in the DMA Tx buffer, if DMA is used */
+	ishtp_cl_grow_dma_tx_buf(dev);
+
 	/* Upon successful connection and allocation, emit flow-control */
 	rets = ishtp_cl_read_start(cl);
 
@@ -493,7 +693,7 @@ int ishtp_cl_read_start(struct ishtp_cl *cl)
 	 * response in ISR may come too fast...
 	 */
 	spin_lock_irqsave(&dev->read_list_spinlock, dev_flags);
-	list_add_tail(&rb->list, &dev->read_list.list);
+	list_add_tail(&rb->list, &cl->read_list.list);
 	spin_unlock_irqrestore(&dev->read_list_spinlock, dev_flags);
 	if (ishtp_hbm_cl_flow_control_req(dev, cl)) {
 		rets = -ENODEV;
@@ -530,8 +730,8 @@ int ishtp_cl_send(struct ishtp_cl *cl, uint8_t *buf, size_t length)
 	struct ishtp_device	*dev;
 	int	id;
 	struct ishtp_cl_tx_ring	*cl_msg;
-	int	have_msg_to_send = 0;
-	unsigned long	tx_flags, tx_free_flags;
+	unsigned int	tail;
+	int	large = -1;
 
 	if (WARN_ON(!cl || !cl->dev))
 		return -ENODEV;
@@ -539,60 +739,81 @@ int ishtp_cl_send(struct ishtp_cl *cl, uint8_t *buf, size_t length)
 	dev = cl->dev;
 
 	if (cl->state != ISHTP_CL_CONNECTED) {
-		++cl->err_send_msg;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
 		return -EPIPE;
 	}
 
 	if (dev->dev_state != ISHTP_DEV_ENABLED) {
-		++cl->err_send_msg;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
 		return -ENODEV;
 	}
 
 	/* Check if we have fw client device */
 	id = ishtp_fw_cl_by_id(dev, cl->fw_client_id);
 	if (id < 0) {
-		++cl->err_send_msg;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
 		return -ENOENT;
 	}
 
 	if (length > dev->fw_clients[id].props.max_msg_length) {
-		++cl->err_send_msg;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
 		return -EMSGSIZE;
 	}
 
-	/* No free bufs */
-	spin_lock_irqsave(&cl->tx_free_list_spinlock, tx_free_flags);
-	if (list_empty(&cl->tx_free_list.list)) {
-		spin_unlock_irqrestore(&cl->tx_free_list_spinlock,
-			tx_free_flags);
-		++cl->err_send_msg;
-		return	-ENOMEM;
-	}
-
-	cl_msg = list_first_entry(&cl->tx_free_list.list,
-		struct ishtp_cl_tx_ring, list);
-	if (!cl_msg->send_buf.data) {
-		spin_unlock_irqrestore(&cl->tx_free_list_spinlock,
-			tx_free_flags);
+	/* Should not happen, as the ring is allocated on connect */
+	if (!cl->tx_ring)
 		return	-EIO;
-		/* Should not happen, as free list is pre-allocated */
+
+	/* Messages that don't fit a slot need a shared full-size buffer */
+	if (length > cl->tx_small_size) {
+		large = ishtp_cl_tx_get_large(cl);
+		if (large < 0) {
+			ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
+			return	-ENOMEM;
+		}
 	}
+
+	/*
+	 * Reserve a slot at the tail. Senders may race each other here, so
+	 * the slot is claimed with cmpxchg rather than under a lock. No free
+	 * slot if the Tx path hasn't released the one a ring length back.
+	 */
+	do {
+		tail = READ_ONCE(cl->tx_tail);
+		if (tail - smp_load_acquire(&cl->tx_head) >=
+		    cl->tx_ring_slots) {
+			if (large >= 0)
+				clear_bit_unlock(large, &cl->tx_large_map);
+			ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_MSG);
+			return	-ENOMEM;
+		}
+	} while (cmpxchg(&cl->tx_tail, tail, tail + 1) != tail);
+
+	cl_msg = &cl->tx_ring[tail & (cl->tx_ring_slots - 1)];
+	cl_msg->large = large;
+	cl_msg->send_buf.data = large < 0 ? cl_msg->small_buf :
+					    cl->tx_large_buf[large];
 	/*
 	 * This is safe, as 'length' is already checked for not exceeding
 	 * max ISHTP message size per client
 	 */
-	list_del_init(&cl_msg->list);
-	--cl->tx_ring_free_size;
-
-	spin_unlock_irqrestore(&cl->tx_free_list_spinlock, tx_free_flags);
 	memcpy(cl_msg->send_buf.data, buf, length);
 	cl_msg->send_buf.size = length;
-	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
-	have_msg_to_send = !list_empty(&cl->tx_list.list);
-	list_add_tail(&cl_msg->list, &cl->tx_list.list);
-	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+	cl_msg->path = ishtp_cl_tx_path(cl, length);
+	trace_ishtp_cl_send(cl->host_client_id, cl->fw_client_id, length);
+	/* Publish the message to the Tx path */
+	smp_store_release(&cl_msg->ready, 1);
 
-	if (!have_msg_to_send && cl->ishtp_flow_ctrl_creds > 0)
+	/*
+	 * The Tx path stops at a slot that is reserved but not yet ready,
+	 * so kick it whenever there are credits; it is serialized by
+	 * tx_list_spinlock and sends nothing if another sender got there
+	 * first. The barrier pairs with the one after the credit increment
+	 * in recv_hbm(): either this sees the credit or the FC handler sees
+	 * the slot, so a message is never left queued with a credit unused.
+	 */
+	smp_mb();
+	if (cl->ishtp_flow_ctrl_creds > 0)
 		ishtp_cl_send_msg(dev, cl);
 
 	return	0;
@@ -612,6 +833,9 @@ static void ishtp_cl_read_complete(struct ishtp_cl_rb *rb)
 	int	schedule_work_flag = 0;
 	struct ishtp_cl	*cl = rb->cl;
 
+	trace_ishtp_cl_rx_complete(cl->host_client_id, cl->fw_client_id,
+				   rb->buf_idx);
+
 	spin_lock_irqsave(&cl->in_process_spinlock, flags);
 	/*
 	 * if in-process list is empty, then need to schedule
@@ -626,44 +850,66 @@ static void ishtp_cl_read_complete(struct ishtp_cl_rb *rb)
 }
 
 /**
- * ipc_tx_callback() - IPC tx callback function
+ * ipc_tx_send() - IPC tx send function
  * @prm: Pointer to client device instance
  *
- * Send message over IPC either first time or on callback on previous message
- * completion
+ * Send message over IPC. Message will be split into fragments
+ * if message size is bigger than IPC FIFO size, and all
+ * fragments will be sent one by one.
+ *
+ * The message at the head of the Tx ring is claimed under tx_list_spinlock,
+ * and its fragments are then queued without the lock. If the IPC queue
+ * fills up, the rest of the message waits for ishtp_cl_tx_resume().
+ *
+ * Return: true if a message was sent
  */
-static void ipc_tx_callback(void *prm)
+static bool ipc_tx_send(void *prm)
 {
 	struct ishtp_cl	*cl = prm;
 	struct ishtp_cl_tx_ring	*cl_msg;
 	size_t	rem;
 	struct ishtp_device	*dev = (cl ? cl->dev : NULL);
 	struct ishtp_msg_hdr	ishtp_hdr;
-	unsigned long	tx_flags, tx_free_flags;
+	unsigned long	tx_flags;
 	unsigned char	*pmsg;
+	int	stalled;
 
 	if (!dev)
-		return;
+		return false;
 
 	/*
 	 * Other conditions if some critical error has
 	 * occurred before this callback is called
 	 */
 	if (dev->dev_state != ISHTP_DEV_ENABLED)
-		return;
+		return false;
 
 	if (cl->state != ISHTP_CL_CONNECTED)
-		return;
+		return false;
 
+claim:
 	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
-	if (list_empty(&cl->tx_list.list)) {
+	cl_msg = ishtp_cl_tx_peek(cl);
+	if (!cl_msg) {
 		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
-		return;
+		return false;
 	}
 
-	if (cl->ishtp_flow_ctrl_creds != 1 && !cl->sending) {
+	/* Another context is sending */
+	if (cl->tx_streaming) {
 		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
-		return;
+		return false;
+	}
+
+	/* The next message goes over DMA */
+	if (cl_msg->path != CL_TX_PATH_IPC) {
+		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+		return false;
+	}
+
+	if (!cl->ishtp_flow_ctrl_creds && !cl->sending) {
+		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+		return false;
 	}
 
 	if (!cl->sending) {
@@ -671,38 +917,71 @@ static void ipc_tx_callback(void *prm)
 		cl->last_ipc_acked = 0;
 		cl->last_tx_path = CL_TX_PATH_IPC;
 		cl->sending = 1;
+		ishtp_stats_add(cl->stats, ISHTP_CL_STAT_SEND_IPC_BYTES,
+				cl_msg->send_buf.size);
+		/*
+		 * The next FC only answers this message if it took the
+		 * last credit
+		 */
+		if (!cl->ishtp_flow_ctrl_creds)
+			ishtp_cl_tx_sample_start(cl, CL_TX_PATH_IPC,
+						 cl_msg->send_buf.size);
 	}
 
-	cl_msg = list_entry(cl->tx_list.list.next, struct ishtp_cl_tx_ring,
-			    list);
+	/* The slot and tx_offs are ours until tx_streaming is cleared */
+	cl->tx_streaming = 1;
+	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+
 	rem = cl_msg->send_buf.size - cl->tx_offs;
+	stalled = 0;
 
-	ishtp_hdr.host_addr = cl->host_client_id;
-	ishtp_hdr.fw_addr = cl->fw_client_id;
-	ishtp_hdr.reserved = 0;
-	pmsg = cl_msg->send_buf.data + cl->tx_offs;
+	while (rem > 0) {
+		ishtp_hdr.host_addr = cl->host_client_id;
+		ishtp_hdr.fw_addr = cl->fw_client_id;
+		ishtp_hdr.reserved = 0;
+		ishtp_hdr.length = min_t(size_t, rem, dev->mtu);
+		/* Last fragment or only one packet */
+		ishtp_hdr.msg_complete = rem <= dev->mtu;
+		pmsg = cl_msg->send_buf.data + cl->tx_offs;
 
-	if (rem <= dev->mtu) {
-		ishtp_hdr.length = rem;
-		ishtp_hdr.msg_complete = 1;
-		cl->sending = 0;
-		list_del_init(&cl_msg->list);	/* Must be before write */
-		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
 		/* Submit to IPC queue with no callback */
-		ishtp_write_message(dev, &ishtp_hdr, pmsg);
-		spin_lock_irqsave(&cl->tx_free_list_spinlock, tx_free_flags);
-		list_add_tail(&cl_msg->list, &cl->tx_free_list.list);
-		++cl->tx_ring_free_size;
-		spin_unlock_irqrestore(&cl->tx_free_list_spinlock,
-			tx_free_flags);
-	} else {
-		/* Send IPC fragment */
+		if (ishtp_write_message(dev, &ishtp_hdr, pmsg)) {
+			/*
+			 * IPC queue is full. Ask to be resumed, then retry
+			 * once, in case the queue drained before the request
+			 * was seen.
+			 */
+			if (!test_and_set_bit(cl->host_client_id,
+					      dev->ipc_tx_wait_map))
+				continue;
+			stalled = 1;
+			break;
+		}
+
+		cl->tx_offs += ishtp_hdr.length;
+		rem -= ishtp_hdr.length;
+	}
+
+	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
+	cl->tx_streaming = 0;
+	if (stalled) {
 		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
-		cl->tx_offs += dev->mtu;
-		ishtp_hdr.length = dev->mtu;
-		ishtp_hdr.msg_complete = 0;
-		ishtp_send_msg(dev, &ishtp_hdr, pmsg, ipc_tx_callback, cl);
+		/*
+		 * A resume that came in while tx_streaming was still set was
+		 * turned away, so carry on in its place
+		 */
+		if (!test_bit(cl->host_client_id, dev->ipc_tx_wait_map))
+			goto claim;
+		return false;
 	}
+
+	/* All fragments were copied to the IPC queue, release the slot */
+	cl->tx_offs = 0;
+	cl->sending = 0;
+	ishtp_cl_tx_pop(cl, cl_msg);
+	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+
+	return true;
 }
 
 /**
@@ -719,9 +998,12 @@ static void ishtp_cl_send_msg_ipc(struct ishtp_device *dev,
 	if (cl->last_tx_path == CL_TX_PATH_DMA && cl->last_dma_acked == 0)
 		return;
 
-	cl->tx_offs = 0;
-	ipc_tx_callback(cl);
-	++cl->send_msg_cnt_ipc;
+	/*
+	 * With counting flow control, send queued messages back-to-back
+	 * for as long as there are credits
+	 */
+	while (ipc_tx_send(cl))
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_SEND_IPC);
 }
 
 /**
@@ -729,74 +1011,126 @@ static void ishtp_cl_send_msg_ipc(struct ishtp_device *dev,
  * @dev: ISHTP device instance
  * @cl: Pointer to client device instance
  *
- * Send message using DMA
+ * Send queued messages using DMA, up to ishtp_get_dma_batch_max() of them
+ * per DMA_XFER. Batches are built and sent under the client's Tx claim, so
+ * they never interleave with another context's.
  */
 static void ishtp_cl_send_msg_dma(struct ishtp_device *dev,
 	struct ishtp_cl *cl)
 {
 	struct ishtp_msg_hdr	hdr;
-	struct dma_xfer_hbm	dma_xfer;
+	struct dma_xfer_hbm	dma_xfer[DMA_XFER_BATCH_MAX];
 	unsigned char	*msg_addr;
 	int off;
+	unsigned int	count, batch_max;
+	bool	no_dma_buf = false;
 	struct ishtp_cl_tx_ring	*cl_msg;
-	unsigned long tx_flags, tx_free_flags;
+	size_t	size;
+	unsigned long tx_flags;
+	bool	ipc_next;
 
 	/* If last IPC message wasn't acked yet, leave this one in Tx queue */
 	if (cl->last_tx_path == CL_TX_PATH_IPC && cl->last_ipc_acked == 0)
 		return;
 
+	batch_max = ishtp_get_dma_batch_max();
+
+	/* The batches are built and sent by one context at a time */
 	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
-	if (list_empty(&cl->tx_list.list)) {
+	if (cl->tx_streaming) {
 		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
 		return;
 	}
+	cl->tx_streaming = 1;
+	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+
+next_batch:
+	/*
+	 * Pack as many queued messages as credits allow into one DMA_XFER,
+	 * so a burst of small messages costs a single doorbell. A credit is
+	 * taken in the same critical section as the message it pays for.
+	 */
+	for (count = 0; count < batch_max; ++count) {
+		spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
+		cl_msg = ishtp_cl_tx_peek(cl);
+		if (!cl->ishtp_flow_ctrl_creds || !cl_msg ||
+		    cl_msg->path != CL_TX_PATH_DMA) {
+			spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+			break;
+		}
 
-	cl_msg = list_entry(cl->tx_list.list.next, struct ishtp_cl_tx_ring,
-		list);
+		size = cl_msg->send_buf.size;
+		msg_addr = ishtp_cl_get_dma_send_buf(dev, size);
+		if (!msg_addr) {
+			/* Unless DMA is enforced, send this one over IPC */
+			if (dev->transfer_path == CL_TX_PATH_DEFAULT)
+				cl_msg->path = CL_TX_PATH_IPC;
+			spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+			no_dma_buf = true;
+			break;
+		}
 
-	msg_addr = ishtp_cl_get_dma_send_buf(dev, cl_msg->send_buf.size);
-	if (!msg_addr) {
+		/* write msg to dma buf, then hand the slot back */
+		memcpy(msg_addr, cl_msg->send_buf.data, size);
+		ishtp_cl_tx_pop(cl, cl_msg);	/* Must be before write */
+		--cl->ishtp_flow_ctrl_creds;
+		cl->last_dma_acked = 0;
+		cl->last_dma_addr = msg_addr;
+		cl->last_tx_path = CL_TX_PATH_DMA;
 		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
-		if (dev->transfer_path == CL_TX_PATH_DEFAULT)
-			ishtp_cl_send_msg_ipc(dev, cl);
-		return;
-	}
 
-	list_del_init(&cl_msg->list);	/* Must be before write */
-	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+		/*
+		 * if current fw don't support cache snooping, driver have to
+		 * flush the cache manually.
+		 */
+		if (dev->ops->dma_no_cache_snooping &&
+			dev->ops->dma_no_cache_snooping(dev))
+			clflush_cache_range(msg_addr, size);
+
+		off = msg_addr - (unsigned char *)dev->ishtp_host_dma_tx_buf;
+		dma_xfer[count].hbm = DMA_XFER;
+		dma_xfer[count].fw_client_id = cl->fw_client_id;
+		dma_xfer[count].host_client_id = cl->host_client_id;
+		dma_xfer[count].reserved = 0;
+		dma_xfer[count].msg_addr = dev->ishtp_host_dma_tx_buf_phys + off;
+		dma_xfer[count].msg_length = size;
+		dma_xfer[count].reserved2 = 0;
+		trace_ishtp_dma_tx(cl->host_client_id, cl->fw_client_id, off,
+				   size);
+
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_SEND_DMA);
+		ishtp_stats_add(cl->stats, ISHTP_CL_STAT_SEND_DMA_BYTES, size);
+	}
 
-	--cl->ishtp_flow_ctrl_creds;
-	cl->last_dma_acked = 0;
-	cl->last_dma_addr = msg_addr;
-	cl->last_tx_path = CL_TX_PATH_DMA;
+	if (count) {
+		/* A lone message is acked on its own, so it can be timed */
+		if (count == 1)
+			ishtp_cl_tx_sample_start(cl, CL_TX_PATH_DMA, size);
 
-	/* write msg to dma buf */
-	memcpy(msg_addr, cl_msg->send_buf.data, cl_msg->send_buf.size);
+		/* send dma_xfer hbm msg */
+		ishtp_hbm_hdr(&hdr, count * sizeof(struct dma_xfer_hbm));
+		ishtp_write_message(dev, &hdr, (unsigned char *)dma_xfer);
+	}
 
 	/*
-	 * if current fw don't support cache snooping, driver have to
-	 * flush the cache manually.
+	 * Counting flow control: start another batch while a message is
+	 * ready and has a credit, including those left by senders turned
+	 * away while the claim was held. Otherwise release the claim, and
+	 * start the IPC path if the next message goes that way.
 	 */
-	if (dev->ops->dma_no_cache_snooping &&
-		dev->ops->dma_no_cache_snooping(dev))
-		clflush_cache_range(msg_addr, cl_msg->send_buf.size);
-
-	/* send dma_xfer hbm msg */
-	off = msg_addr - (unsigned char *)dev->ishtp_host_dma_tx_buf;
-	ishtp_hbm_hdr(&hdr, sizeof(struct dma_xfer_hbm));
-	dma_xfer.hbm = DMA_XFER;
-	dma_xfer.fw_client_id = cl->fw_client_id;
-	dma_xfer.host_client_id = cl->host_client_id;
-	dma_xfer.reserved = 0;
-	dma_xfer.msg_addr = dev->ishtp_host_dma_tx_buf_phys + off;
-	dma_xfer.msg_length = cl_msg->send_buf.size;
-	dma_xfer.reserved2 = 0;
-	ishtp_write_message(dev, &hdr, (unsigned char *)&dma_xfer);
-	spin_lock_irqsave(&cl->tx_free_list_spinlock, tx_free_flags);
-	list_add_tail(&cl_msg->list, &cl->tx_free_list.list);
-	++cl->tx_ring_free_size;
-	spin_unlock_irqrestore(&cl->tx_free_list_spinlock, tx_free_flags);
-	++cl->send_msg_cnt_dma;
+	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
+	cl_msg = ishtp_cl_tx_peek(cl);
+	if (!no_dma_buf && cl_msg && cl_msg->path == CL_TX_PATH_DMA &&
+	    cl->ishtp_flow_ctrl_creds) {
+		spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+		goto next_batch;
+	}
+	cl->tx_streaming = 0;
+	ipc_next = cl_msg && cl_msg->path == CL_TX_PATH_IPC;
+	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
+
+	if (ipc_next && dev->transfer_path != CL_TX_PATH_DMA)
+		ishtp_cl_send_msg_ipc(dev, cl);
 }
 
 /**
@@ -804,14 +1138,95 @@ static void ishtp_cl_send_msg_dma(struct ishtp_device *dev,
  * @dev: ISHTP device instance
  * @cl: Pointer to client device instance
  *
- * Send message using DMA or IPC based on transfer_path
+ * Send message using DMA or IPC based on transfer_path. By default each
+ * queued message carries the path chosen for it by ishtp_cl_tx_path(), and
+ * each path stops at the first message meant for the other one.
  */
 void ishtp_cl_send_msg(struct ishtp_device *dev, struct ishtp_cl *cl)
 {
-	if (dev->transfer_path == CL_TX_PATH_DMA)
+	if (dev->transfer_path == CL_TX_PATH_DMA) {
 		ishtp_cl_send_msg_dma(dev, cl);
-	else
+	} else if (dev->transfer_path == CL_TX_PATH_IPC) {
+		ishtp_cl_send_msg_ipc(dev, cl);
+	} else {
 		ishtp_cl_send_msg_ipc(dev, cl);
+		ishtp_cl_send_msg_dma(dev, cl);
+	}
+}
+
+/**
+ * ishtp_cl_tx_resume() - Resume clients waiting for IPC queue space
+ * @dev: ISHTP device instance
+ *
+ * Called once the firmware has taken a message off the IPC queue. Each
+ * client whose fragments didn't fit carries on from where it stopped.
+ */
+void ishtp_cl_tx_resume(struct ishtp_device *dev)
+{
+	struct ishtp_cl	*cl;
+	unsigned long	flags;
+	unsigned int	id;
+
+	if (bitmap_empty(dev->ipc_tx_wait_map, ISHTP_CLIENTS_MAX))
+		return;
+
+	spin_lock_irqsave(&dev->cl_list_lock, flags);
+	for_each_set_bit(id, dev->ipc_tx_wait_map, ISHTP_CLIENTS_MAX) {
+		if (!test_and_clear_bit(id, dev->ipc_tx_wait_map))
+			continue;
+
+		cl = dev->host_clients[id];
+		if (cl)
+			ishtp_cl_send_msg(dev, cl);
+	}
+	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
+}
+EXPORT_SYMBOL(ishtp_cl_tx_resume);
+
+/**
+ * ishtp_cl_by_id() - Find a linked client by its addresses
+ * @dev: ISHTP device instance
+ * @host_client_id: host client id of the message
+ * @fw_client_id: fw client id of the message
+ *
+ * Must be called with cl_list_lock or read_list_spinlock held.
+ *
+ * Return: the client, or NULL if no linked client has these addresses
+ */
+struct ishtp_cl *ishtp_cl_by_id(struct ishtp_device *dev,
+				uint8_t host_client_id, uint8_t fw_client_id)
+{
+	struct ishtp_cl *cl = dev->host_clients[host_client_id];
+
+	if (!cl || cl->fw_client_id != fw_client_id)
+		return NULL;
+
+	return cl;
+}
+
+/**
+ * ishtp_cl_rx_rb() - Find the request block for an incoming message
+ * @dev: ISHTP device instance
+ * @host_client_id: host client id of the message
+ * @fw_client_id: fw client id of the message
+ *
+ * A single input message can go only to a single request, the oldest one
+ * the client posted. Must be called with read_list_spinlock held.
+ *
+ * Return: the request block, or NULL if nobody is waiting for the message
+ */
+static struct ishtp_cl_rb *ishtp_cl_rx_rb(struct ishtp_device *dev,
+					  uint8_t host_client_id,
+					  uint8_t fw_client_id)
+{
+	struct ishtp_cl *cl = ishtp_cl_by_id(dev, host_client_id,
+					     fw_client_id);
+
+	if (!cl || cl->state != ISHTP_CL_CONNECTED)
+		return NULL;
+
+	return list_first_entry_or_null(&cl->read_list.list,
+					struct ishtp_cl_rb, list);
 }
 
 /**
@@ -831,7 +1246,6 @@ void recv_ishtp_cl_msg(struct ishtp_device *dev,
 	unsigned char *buffer = NULL;
 	struct ishtp_cl_rb *complete_rb = NULL;
 	unsigned long	flags;
-	int	rb_count;
 
 	if (ishtp_hdr->reserved) {
 		dev_err(dev->devc, "corrupted message header.\n");
@@ -845,14 +1259,9 @@ void recv_ishtp_cl_msg(struct ishtp_device *dev,
 	}
 
 	spin_lock_irqsave(&dev->read_list_spinlock, flags);
-	rb_count = -1;
-	list_for_each_entry(rb, &dev->read_list.list, list) {
-		++rb_count;
+	rb = ishtp_cl_rx_rb(dev, ishtp_hdr->host_addr, ishtp_hdr->fw_addr);
+	if (rb) {
 		cl = rb->cl;
-		if (!cl || !(cl->host_client_id == ishtp_hdr->host_addr &&
-				cl->fw_client_id == ishtp_hdr->fw_addr) ||
-				!(cl->state == ISHTP_CL_CONNECTED))
-			continue;
 
 		 /* If no Rx buffer is allocated, disband the rb */
 		if (rb->buffer.size == 0 || rb->buffer.data == NULL) {
@@ -909,7 +1318,7 @@ void recv_ishtp_cl_msg(struct ishtp_device *dev,
 				new_rb->buf_idx = 0;
 				INIT_LIST_HEAD(&new_rb->list);
 				list_add_tail(&new_rb->list,
-					&dev->read_list.list);
+					&cl->read_list.list);
 
 				ishtp_hbm_cl_flow_control_req(dev, cl);
 			} else {
@@ -918,12 +1327,6 @@ void recv_ishtp_cl_msg(struct ishtp_device *dev,
 		}
 		/* One more fragment in message (even if this was last) */
 		++cl->recv_msg_num_frags;
-
-		/*
-		 * We can safely break here (and in BH too),
-		 * a single input message can go only to a single request!
-		 */
-		break;
 	}
 
 	spin_unlock_irqrestore(&dev->read_list_spinlock, flags);
@@ -939,13 +1342,300 @@ void recv_ishtp_cl_msg(struct ishtp_device *dev,
 	if (complete_rb) {
 		cl = complete_rb->cl;
 		cl->ts_rx = ktime_get();
-		++cl->recv_msg_cnt_ipc;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_RECV_IPC);
 		ishtp_cl_read_complete(complete_rb);
 	}
 eoi:
 	return;
 }
 
+/**
+ * ishtp_cl_dma_rx_find() - Find the DMA Rx entry of an rb
+ * @cl: client device instance
+ * @rb: IO request block
+ *
+ * Called with free_list_spinlock held.
+ *
+ * Return: the entry, or NULL if @rb holds a copy
+ */
+static struct ishtp_cl_dma_rx *ishtp_cl_dma_rx_find(struct ishtp_cl *cl,
+						    struct ishtp_cl_rb *rb)
+{
+	int i;
+
+	for (i = 0; cl->dma_rx_held && i < CL_MAX_RX_RING_SIZE; i++) {
+		if (cl->dma_rx_held[i].rb == rb)
+			return &cl->dma_rx_held[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * ishtp_cl_dma_rx_unlend() - Point a lent rb back at its own buffer
+ * @held: DMA Rx entry of the rb
+ * @copy: copy the message into the rb's own buffer first
+ *
+ * Called with free_list_spinlock held. Sending the DMA_XFER_ACK is up to
+ * the caller.
+ */
+static void ishtp_cl_dma_rx_unlend(struct ishtp_cl_dma_rx *held, bool copy)
+{
+	struct ishtp_cl_rb *rb = held->rb;
+
+	if (copy)
+		memcpy(held->data, rb->buffer.data, held->xfer.msg_length);
+	WRITE_ONCE(rb->buffer.data, held->data);
+	held->rb = NULL;
+}
+
+/**
+ * ishtp_cl_dma_rx_ack() - Hand a DMA Rx region back to the firmware
+ * @cl: client device instance
+ * @xfer: DMA_XFER_ACK of the region
+ *
+ * Nothing is sent once the device is resetting: the firmware dropped all
+ * transfers, and the DMA Rx buffer is being freed.
+ */
+static void ishtp_cl_dma_rx_ack(struct ishtp_cl *cl, struct dma_xfer_hbm *xfer)
+{
+	struct ishtp_msg_hdr hdr;
+
+	if (cl->dev->dev_state != ISHTP_DEV_ENABLED)
+		return;
+
+	ishtp_hbm_hdr(&hdr, sizeof(*xfer));
+	ishtp_write_message(cl->dev, &hdr, (unsigned char *)xfer);
+}
+
+/**
+ * ishtp_cl_dma_rx_work_fn() - Copy DMA Rx messages held for too long
+ * @work: dma_rx_work of the client
+ *
+ * A message lent to an rb that is still queued for the client is copied
+ * into the rb's own buffer once it was held for CL_DMA_RX_HOLD_MS, and
+ * the region goes back to the firmware. Rbs the client has taken are
+ * its own to return, see ishtp_cl_dma_rx_unpin().
+ */
+static void ishtp_cl_dma_rx_work_fn(struct work_struct *work)
+{
+	struct ishtp_cl *cl = container_of(to_delayed_work(work),
+					   struct ishtp_cl, dma_rx_work);
+	unsigned long hold = msecs_to_jiffies(CL_DMA_RX_HOLD_MS);
+	struct ishtp_cl_dma_rx *held;
+	struct dma_xfer_hbm xfer;
+	struct ishtp_cl_rb *rb;
+	unsigned long next = 0;
+	unsigned long flags;
+	bool expired, pending;
+
+	do {
+		expired = false;
+		pending = false;
+
+		spin_lock_irqsave(&cl->in_process_spinlock, flags);
+		spin_lock(&cl->free_list_spinlock);
+		list_for_each_entry(rb, &cl->in_process_list.list, list) {
+			held = ishtp_cl_dma_rx_find(cl, rb);
+			if (!held)
+				continue;
+
+			if (time_before(jiffies, held->since + hold)) {
+				if (!pending || time_before(held->since, next))
+					next = held->since;
+				pending = true;
+				continue;
+			}
+
+			xfer = held->xfer;
+			ishtp_cl_dma_rx_unlend(held, true);
+			expired = true;
+			break;
+		}
+		spin_unlock(&cl->free_list_spinlock);
+		spin_unlock_irqrestore(&cl->in_process_spinlock, flags);
+
+		if (expired)
+			ishtp_cl_dma_rx_ack(cl, &xfer);
+	} while (expired);
+
+	if (pending)
+		schedule_delayed_work(&cl->dma_rx_work,
+				      next + hold - jiffies);
+}
+
+/**
+ * ishtp_cl_enable_dma_rx_zero_copy() - Receive DMA messages without copying
+ * @cl: client device instance
+ *
+ * Once enabled, an rb completed for a message received over DMA points into
+ * the DMA Rx buffer instead of holding a copy. The firmware may only reuse
+ * that region after the DMA_XFER_ACK, which is sent when the rb is recycled.
+ * Messages still queued after CL_DMA_RX_HOLD_MS are copied after all; a
+ * client that keeps an rb it has taken must call ishtp_cl_dma_rx_unpin().
+ *
+ * Return: 0 on success else -ENOMEM
+ */
+int ishtp_cl_enable_dma_rx_zero_copy(struct ishtp_cl *cl)
+{
+	struct ishtp_cl_dma_rx *dma_rx_held;
+	unsigned long flags;
+
+	if (cl->dma_rx_held)
+		return 0;
+
+	dma_rx_held = kcalloc(CL_MAX_RX_RING_SIZE, sizeof(*dma_rx_held),
+			      GFP_KERNEL);
+	if (!dma_rx_held)
+		return -ENOMEM;
+
+	INIT_DELAYED_WORK(&cl->dma_rx_work, ishtp_cl_dma_rx_work_fn);
+
+	spin_lock_irqsave(&cl->free_list_spinlock, flags);
+	cl->dma_rx_held = dma_rx_held;
+	spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL(ishtp_cl_enable_dma_rx_zero_copy);
+
+/**
+ * ishtp_cl_dma_rx_hold() - Lend a DMA Rx message to an rb
+ * @cl: client device instance
+ * @rb: IO request block the message completes
+ * @msg: message in the DMA Rx buffer
+ * @hbm: DMA_XFER entry of the message
+ *
+ * Return: true if @rb now points at @msg, false if it needs a copy
+ */
+static bool ishtp_cl_dma_rx_hold(struct ishtp_cl *cl, struct ishtp_cl_rb *rb,
+				 void *msg, struct dma_xfer_hbm *hbm)
+{
+	struct ishtp_cl_dma_rx *held;
+	bool ret = false;
+	int i;
+
+	spin_lock(&cl->free_list_spinlock);
+	for (i = 0; cl->dma_rx_held && i < CL_MAX_RX_RING_SIZE; i++) {
+		held = &cl->dma_rx_held[i];
+		if (held->rb)
+			continue;
+
+		held->rb = rb;
+		held->data = rb->buffer.data;
+		held->xfer = *hbm;
+		held->xfer.hbm = DMA_XFER_ACK;
+		held->since = jiffies;
+		rb->buffer.data = msg;
+		ret = true;
+		break;
+	}
+	spin_unlock(&cl->free_list_spinlock);
+
+	if (ret)
+		schedule_delayed_work(&cl->dma_rx_work,
+				      msecs_to_jiffies(CL_DMA_RX_HOLD_MS));
+
+	return ret;
+}
+
+/**
+ * ishtp_cl_dma_rx_return() - Return the DMA Rx memory lent to an rb
+ * @rb: IO request block
+ * @copy: keep the message in the rb's own buffer
+ * @ack: send the DMA_XFER_ACK of the message
+ *
+ * Nothing to do for rbs holding a copy.
+ */
+static void ishtp_cl_dma_rx_return(struct ishtp_cl_rb *rb, bool copy,
+				   bool ack)
+{
+	struct ishtp_cl *cl = rb->cl;
+	struct ishtp_cl_dma_rx *held;
+	struct dma_xfer_hbm xfer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cl->free_list_spinlock, flags);
+	held = ishtp_cl_dma_rx_find(cl, rb);
+	if (!held) {
+		spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
+		return;
+	}
+	xfer = held->xfer;
+	ishtp_cl_dma_rx_unlend(held, copy);
+	spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
+
+	if (ack)
+		ishtp_cl_dma_rx_ack(cl, &xfer);
+}
+
+/**
+ * ishtp_cl_dma_rx_unpin() - Copy a lent DMA Rx message into its rb
+ * @rb: IO request block taken by the client
+ *
+ * For clients that keep an rb for longer than CL_DMA_RX_HOLD_MS: the rb
+ * gets a copy of its message, and the firmware can reuse the region. The
+ * caller must not be reading the rb meanwhile.
+ *
+ * Return: 0 on success else -EFAULT
+ */
+int ishtp_cl_dma_rx_unpin(struct ishtp_cl_rb *rb)
+{
+	if (!rb || !rb->cl)
+		return -EFAULT;
+
+	ishtp_cl_dma_rx_return(rb, true, true);
+
+	return 0;
+}
+EXPORT_SYMBOL(ishtp_cl_dma_rx_unpin);
+
+/**
+ * ishtp_cl_dma_rx_release() - Return the DMA Rx memory lent to an rb
+ * @rb: IO request block
+ *
+ * Restore the rb's own buffer and send the DMA_XFER_ACK of the message it
+ * pointed at, so the firmware can reuse the region. Nothing to do for rbs
+ * holding a copy.
+ */
+void ishtp_cl_dma_rx_release(struct ishtp_cl_rb *rb)
+{
+	ishtp_cl_dma_rx_return(rb, false, true);
+}
+
+/**
+ * ishtp_cl_dma_rx_drop() - Restore the own buffer of an rb being freed
+ * @rb: IO request block
+ *
+ * Like ishtp_cl_dma_rx_release(), but without a DMA_XFER_ACK.
+ */
+void ishtp_cl_dma_rx_drop(struct ishtp_cl_rb *rb)
+{
+	ishtp_cl_dma_rx_return(rb, false, false);
+}
+
+/**
+ * ishtp_cl_dma_rx_drop_all() - Unlend all DMA Rx messages of a client
+ * @cl: client device instance
+ *
+ * Called on reset and when the client is freed. Rbs the client still has
+ * get a copy of their message, and no DMA_XFER_ACK is sent: a reset drops
+ * all transfers, and the ACK of a client being freed would be sent under
+ * cl_list_lock.
+ */
+void ishtp_cl_dma_rx_drop_all(struct ishtp_cl *cl)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&cl->free_list_spinlock, flags);
+	for (i = 0; cl->dma_rx_held && i < CL_MAX_RX_RING_SIZE; i++) {
+		if (cl->dma_rx_held[i].rb)
+			ishtp_cl_dma_rx_unlend(&cl->dma_rx_held[i], true);
+	}
+	spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
+}
+
 /**
  * recv_ishtp_cl_msg_dma() -Receive client message
  * @dev: ISHTP device instance
@@ -954,8 +1644,11 @@ eoi:
  *
  * Receive and dispatch ISHTP client messages using DMA. This function executes
  * in ISR or work queue context
+ *
+ * Return: true if the message was lent to the client, whose DMA_XFER_ACK is
+ * then sent by ishtp_cl_dma_rx_release()
  */
-void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
+bool recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 			   struct dma_xfer_hbm *hbm)
 {
 	struct ishtp_cl *cl;
@@ -964,15 +1657,13 @@ void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 	unsigned char *buffer = NULL;
 	struct ishtp_cl_rb *complete_rb = NULL;
 	unsigned long	flags;
+	bool	held = false;
 
 	spin_lock_irqsave(&dev->read_list_spinlock, flags);
 
-	list_for_each_entry(rb, &dev->read_list.list, list) {
+	rb = ishtp_cl_rx_rb(dev, hbm->host_client_id, hbm->fw_client_id);
+	if (rb) {
 		cl = rb->cl;
-		if (!cl || !(cl->host_client_id == hbm->host_client_id &&
-				cl->fw_client_id == hbm->fw_client_id) ||
-				!(cl->state == ISHTP_CL_CONNECTED))
-			continue;
 
 		/*
 		 * If no Rx buffer is allocated, disband the rb
@@ -1014,7 +1705,9 @@ void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 			dev->ops->dma_no_cache_snooping(dev))
 			clflush_cache_range(msg, hbm->msg_length);
 
-		memcpy(buffer, msg, hbm->msg_length);
+		held = ishtp_cl_dma_rx_hold(cl, rb, msg, hbm);
+		if (!held)
+			memcpy(buffer, msg, hbm->msg_length);
 		rb->buf_idx = hbm->msg_length;
 
 		/* Last fragment in message - it's complete */
@@ -1038,7 +1731,7 @@ void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 			new_rb->buf_idx = 0;
 			INIT_LIST_HEAD(&new_rb->list);
 			list_add_tail(&new_rb->list,
-				&dev->read_list.list);
+				&cl->read_list.list);
 
 			ishtp_hbm_cl_flow_control_req(dev, cl);
 		} else {
@@ -1047,12 +1740,6 @@ void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 
 		/* One more fragment in message (this is always last) */
 		++cl->recv_msg_num_frags;
-
-		/*
-		 * We can safely break here (and in BH too),
-		 * a single input message can go only to a single request!
-		 */
-		break;
 	}
 
 	spin_unlock_irqrestore(&dev->read_list_spinlock, flags);
@@ -1065,11 +1752,11 @@ void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 	if (complete_rb) {
 		cl = complete_rb->cl;
 		cl->ts_rx = ktime_get();
-		++cl->recv_msg_cnt_dma;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_RECV_DMA);
 		ishtp_cl_read_complete(complete_rb);
 	}
 eoi:
-	return;
+	return	held;
 }
 
 void *ishtp_get_client_data(struct ishtp_cl *cl)
@@ -6,6 +6,7 @@
  */
 
 #include <linux/slab.h>
+#include <linux/bitmap.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/delay.h>
@@ -14,45 +15,151 @@
 #include "client.h"
 
 /**
- * ishtp_cl_alloc_dma_buf() - Allocate DMA RX and TX buffer
+ * ishtp_dma_buf_size() - Size a DMA buffer
+ * @want: bytes the clients could have in flight at once
+ * @max: limit set by module parameter, a multiple of DMA_SLOT_SIZE
+ *
+ * Return: @want rounded up to whole slots, between one slot and @max
+ */
+static unsigned int ishtp_dma_buf_size(size_t want, unsigned int max)
+{
+	want = roundup(max_t(size_t, want, DMA_SLOT_SIZE), DMA_SLOT_SIZE);
+
+	return min_t(size_t, want, max);
+}
+
+/**
+ * ishtp_cl_alloc_dma_rx_buf() - Allocate DMA RX buffer
  * @dev: ishtp device
  *
- * Allocate RX and TX DMA buffer once during bus setup.
- * It allocates 1MB, RX and TX DMA buffer, which are divided
- * into slots.
+ * Allocate the RX DMA buffer once the FW clients are enumerated. The
+ * firmware lays out its messages in the buffer from then on, so it is
+ * sized up front: room for CL_DEF_RX_RING_SIZE messages of every FW
+ * client, up to the ishtp_dma_rx_buf_kb limit.
  */
-void	ishtp_cl_alloc_dma_buf(struct ishtp_device *dev)
+void	ishtp_cl_alloc_dma_rx_buf(struct ishtp_device *dev)
 {
 	dma_addr_t	h;
+	size_t	want = 0;
+	int	i;
 
-	if (dev->ishtp_host_dma_tx_buf)
+	if (dev->ishtp_host_dma_rx_buf)
 		return;
 
-	dev->ishtp_host_dma_tx_buf_size = 1024*1024;
-	dev->ishtp_host_dma_rx_buf_size = 1024*1024;
+	for (i = 0; i < dev->fw_clients_num; i++)
+		want += CL_DEF_RX_RING_SIZE *
+			roundup(dev->fw_clients[i].props.max_msg_length,
+				DMA_SLOT_SIZE);
 
-	/* Allocate Tx buffer and init usage bitmap */
-	dev->ishtp_host_dma_tx_buf = dma_alloc_coherent(dev->devc,
-					dev->ishtp_host_dma_tx_buf_size,
+	dev->ishtp_host_dma_rx_buf_size =
+		ishtp_dma_buf_size(want, ishtp_get_dma_rx_buf_max());
+	dev->ishtp_host_dma_rx_buf = dma_alloc_coherent(dev->devc,
+					dev->ishtp_host_dma_rx_buf_size,
 					&h, GFP_KERNEL);
-	if (dev->ishtp_host_dma_tx_buf)
-		dev->ishtp_host_dma_tx_buf_phys = h;
+	if (dev->ishtp_host_dma_rx_buf)
+		dev->ishtp_host_dma_rx_buf_phys = h;
+	else
+		dev->ishtp_host_dma_rx_buf_size = 0;
+}
+
+/**
+ * ishtp_cl_grow_dma_tx_buf() - Size DMA TX buffer for the connected clients
+ * @dev: ishtp device
+ *
+ * The TX DMA buffer is allocated when the first client connects, with room
+ * for the messages every connected client can have in flight. Later clients
+ * may need more, up to the ishtp_dma_tx_buf_kb limit: the buffer is then
+ * replaced by a larger one, which can only be done while no slot is in
+ * use. Otherwise this is retried once the last slot is acked.
+ *
+ * Must be called from process context.
+ */
+void	ishtp_cl_grow_dma_tx_buf(struct ishtp_device *dev)
+{
+	struct ishtp_cl	*cl;
+	struct ishtp_fw_client	*fw_client;
+	unsigned long	flags;
+	unsigned long	*map, *old_map;
+	unsigned int	size, old_size, slots;
+	size_t	want = 0;
+	void	*buf, *old_buf;
+	dma_addr_t	h, old_h;
 
-	dev->ishtp_dma_num_slots = dev->ishtp_host_dma_tx_buf_size /
-						DMA_SLOT_SIZE;
+	if (!ishtp_use_dma_transfer())
+		return;
 
-	dev->ishtp_dma_tx_map = kcalloc(dev->ishtp_dma_num_slots,
-					sizeof(uint8_t),
-					GFP_KERNEL);
-	spin_lock_init(&dev->ishtp_dma_tx_lock);
+	spin_lock_irqsave(&dev->cl_list_lock, flags);
+	list_for_each_entry(cl, &dev->cl_list, link) {
+		fw_client = cl->device ? cl->device->fw_client : NULL;
+		if (!cl->tx_ring_slots || !fw_client)
+			continue;
 
-	/* Allocate Rx buffer */
-	dev->ishtp_host_dma_rx_buf = dma_alloc_coherent(dev->devc,
-					dev->ishtp_host_dma_rx_buf_size,
-					 &h, GFP_KERNEL);
+		/* A client can't have more messages in flight than credits */
+		want += min(cl->tx_ring_slots, ishtp_get_fc_creds_max()) *
+			roundup(fw_client->props.max_msg_length, DMA_SLOT_SIZE);
+	}
+	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
 
-	if (dev->ishtp_host_dma_rx_buf)
-		dev->ishtp_host_dma_rx_buf_phys = h;
+	size = ishtp_dma_buf_size(want, ishtp_get_dma_tx_buf_max());
+	if (size <= READ_ONCE(dev->ishtp_host_dma_tx_buf_size))
+		return;
+
+	slots = size / DMA_SLOT_SIZE;
+	buf = dma_alloc_coherent(dev->devc, size, &h, GFP_KERNEL);
+	map = bitmap_zalloc(slots, GFP_KERNEL);
+	if (!buf || !map) {
+		dev_err(dev->devc, "Fail to allocate %u bytes DMA Tx buffer\n",
+			size);
+		goto out_free;
+	}
+
+	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
+	if (dev->ishtp_dma_tx_used ||
+	    size <= dev->ishtp_host_dma_tx_buf_size) {
+		dev->ishtp_dma_tx_grow = dev->ishtp_dma_tx_used != 0;
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		goto out_free;
+	}
+
+	old_buf = dev->ishtp_host_dma_tx_buf;
+	old_size = dev->ishtp_host_dma_tx_buf_size;
+	old_h = dev->ishtp_host_dma_tx_buf_phys;
+	old_map = dev->ishtp_dma_tx_map;
+
+	dev->ishtp_host_dma_tx_buf = buf;
+	dev->ishtp_host_dma_tx_buf_size = size;
+	dev->ishtp_host_dma_tx_buf_phys = h;
+	dev->ishtp_dma_num_slots = slots;
+	dev->ishtp_dma_tx_map = map;
+	dev->ishtp_dma_tx_hint = 0;
+	dev->ishtp_dma_tx_grow = false;
+	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+
+	dev_dbg(dev->devc, "DMA Tx buffer is %u bytes\n", size);
+
+	if (old_buf)
+		dma_free_coherent(dev->devc, old_size, old_buf, old_h);
+	bitmap_free(old_map);
+	return;
+
+out_free:
+	if (buf)
+		dma_free_coherent(dev->devc, size, buf, h);
+	bitmap_free(map);
+}
+
+/**
+ * ishtp_cl_dma_tx_grow_work_fn() - Retry growing DMA TX buffer
+ * @work: work struct
+ *
+ * Scheduled when the last TX slot is acked while a larger buffer is wanted.
+ */
+void	ishtp_cl_dma_tx_grow_work_fn(struct work_struct *work)
+{
+	struct ishtp_device *dev = container_of(work, struct ishtp_device,
+						ishtp_dma_tx_grow_work);
+
+	ishtp_cl_grow_dma_tx_buf(dev);
 }
 
 /**
@@ -65,13 +172,30 @@ void	ishtp_cl_alloc_dma_buf(struct ishtp_device *dev)
  */
 void	ishtp_cl_free_dma_buf(struct ishtp_device *dev)
 {
+	unsigned long	flags;
+	unsigned long	*map;
+	unsigned int	size;
+	void	*buf;
 	dma_addr_t	h;
 
-	if (dev->ishtp_host_dma_tx_buf) {
-		h = dev->ishtp_host_dma_tx_buf_phys;
-		dma_free_coherent(dev->devc, dev->ishtp_host_dma_tx_buf_size,
-				  dev->ishtp_host_dma_tx_buf, h);
-	}
+	cancel_work_sync(&dev->ishtp_dma_tx_grow_work);
+
+	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
+	buf = dev->ishtp_host_dma_tx_buf;
+	size = dev->ishtp_host_dma_tx_buf_size;
+	h = dev->ishtp_host_dma_tx_buf_phys;
+	map = dev->ishtp_dma_tx_map;
+	dev->ishtp_host_dma_tx_buf = NULL;
+	dev->ishtp_host_dma_tx_buf_size = 0;
+	dev->ishtp_dma_num_slots = 0;
+	dev->ishtp_dma_tx_map = NULL;
+	dev->ishtp_dma_tx_used = 0;
+	dev->ishtp_dma_tx_grow = false;
+	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+
+	if (buf)
+		dma_free_coherent(dev->devc, size, buf, h);
+	bitmap_free(map);
 
 	if (dev->ishtp_host_dma_rx_buf) {
 		h = dev->ishtp_host_dma_rx_buf_phys;
@@ -79,10 +203,8 @@ void	ishtp_cl_free_dma_buf(struct ishtp_device *dev)
 				  dev->ishtp_host_dma_rx_buf, h);
 	}
 
-	kfree(dev->ishtp_dma_tx_map);
-	dev->ishtp_host_dma_tx_buf = NULL;
 	dev->ishtp_host_dma_rx_buf = NULL;
-	dev->ishtp_dma_tx_map = NULL;
+	dev->ishtp_host_dma_rx_buf_size = 0;
 }
 
 /*
@@ -93,37 +215,62 @@ void	ishtp_cl_free_dma_buf(struct ishtp_device *dev)
  * Find and return free address of "size" bytes in dma tx buffer.
  * the function will mark this address as "in-used" memory.
  *
+ * The search is next-fit: it starts after the previous allocation and
+ * wraps around once, a word of the bitmap at a time. Since slots are
+ * acked roughly in the order they were sent, this usually finds free
+ * space at the hint immediately.
+ *
  * Return: NULL when no free buffer else a buffer to copy
  */
 void *ishtp_cl_get_dma_send_buf(struct ishtp_device *dev,
 				uint32_t size)
 {
 	unsigned long	flags;
-	int i, j, free;
+	unsigned long	start;
+	unsigned int	free_slots;
+	unsigned int	num_slots;
 	/* additional slot is needed if there is rem */
-	int required_slots = (size / DMA_SLOT_SIZE)
-		+ 1 * (size % DMA_SLOT_SIZE != 0);
+	unsigned int	required_slots = DIV_ROUND_UP(size, DMA_SLOT_SIZE);
 
 	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
-	for (i = 0; i <= (dev->ishtp_dma_num_slots - required_slots); i++) {
-		free = 1;
-		for (j = 0; j < required_slots; j++)
-			if (dev->ishtp_dma_tx_map[i+j]) {
-				free = 0;
-				i += j;
-				break;
-			}
-		if (free) {
-			/* mark memory as "caught" */
-			for (j = 0; j < required_slots; j++)
-				dev->ishtp_dma_tx_map[i+j] = 1;
-			spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
-			return (i * DMA_SLOT_SIZE) +
-				(unsigned char *)dev->ishtp_host_dma_tx_buf;
-		}
+
+	/* The buffer may not be allocated yet, or be replaced */
+	if (!dev->ishtp_dma_tx_map) {
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		return NULL;
 	}
+	num_slots = dev->ishtp_dma_num_slots;
+
+	start = bitmap_find_next_zero_area(dev->ishtp_dma_tx_map, num_slots,
+					   dev->ishtp_dma_tx_hint,
+					   required_slots, 0);
+	if (start >= num_slots)
+		start = bitmap_find_next_zero_area(dev->ishtp_dma_tx_map,
+						   num_slots, 0,
+						   required_slots, 0);
+
+	if (start < num_slots) {
+		/* mark memory as "caught" */
+		bitmap_set(dev->ishtp_dma_tx_map, start, required_slots);
+		dev->ishtp_dma_tx_hint = start + required_slots;
+		dev->ishtp_dma_tx_used += required_slots;
+		dev->ishtp_dma_tx_used_max = max(dev->ishtp_dma_tx_used_max,
+						 dev->ishtp_dma_tx_used);
+		++dev->dma_tx_alloc_cnt;
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		return (start * DMA_SLOT_SIZE) +
+			(unsigned char *)dev->ishtp_host_dma_tx_buf;
+	}
+
+	free_slots = num_slots - dev->ishtp_dma_tx_used;
+	++dev->dma_tx_alloc_fail_cnt;
+	if (free_slots >= required_slots)
+		++dev->dma_tx_frag_fail_cnt;
 	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
-	dev_err(dev->devc, "No free DMA buffer to send msg\n");
+
+	dev_err(dev->devc,
+		"No free DMA buffer to send msg (%u slots needed, %u free)\n",
+		required_slots, free_slots);
 	return NULL;
 }
 
@@ -138,29 +285,45 @@ void *ishtp_cl_get_dma_send_buf(struct ishtp_device *dev,
  */
 void ishtp_cl_release_dma_acked_mem(struct ishtp_device *dev,
 				    void *msg_addr,
-				    uint8_t size)
+				    uint32_t size)
 {
 	unsigned long	flags;
-	int acked_slots = (size / DMA_SLOT_SIZE)
-		+ 1 * (size % DMA_SLOT_SIZE != 0);
-	int i, j;
+	unsigned int	acked_slots = DIV_ROUND_UP(size, DMA_SLOT_SIZE);
+	unsigned int	i;
+
+	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
+	if (!dev->ishtp_dma_tx_map) {
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		dev_err(dev->devc, "DMA Tx ack without Tx buffer\n");
+		return;
+	}
 
 	if ((msg_addr - dev->ishtp_host_dma_tx_buf) % DMA_SLOT_SIZE) {
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
 		dev_err(dev->devc, "Bad DMA Tx ack address\n");
 		return;
 	}
 
 	i = (msg_addr - dev->ishtp_host_dma_tx_buf) / DMA_SLOT_SIZE;
-	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
-	for (j = 0; j < acked_slots; j++) {
-		if ((i + j) >= dev->ishtp_dma_num_slots ||
-					!dev->ishtp_dma_tx_map[i+j]) {
-			/* no such slot, or memory is already free */
-			spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
-			dev_err(dev->devc, "Bad DMA Tx ack address\n");
-			return;
-		}
-		dev->ishtp_dma_tx_map[i+j] = 0;
+	if (i + acked_slots > dev->ishtp_dma_num_slots) {
+		/* no such slot */
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		dev_err(dev->devc, "Bad DMA Tx ack address\n");
+		return;
+	}
+
+	if (find_next_zero_bit(dev->ishtp_dma_tx_map, i + acked_slots, i) <
+	    i + acked_slots) {
+		/* memory is already free */
+		spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+		dev_err(dev->devc, "Bad DMA Tx ack address\n");
+		return;
+	}
+	bitmap_clear(dev->ishtp_dma_tx_map, i, acked_slots);
+	dev->ishtp_dma_tx_used -= acked_slots;
+	if (!dev->ishtp_dma_tx_used && dev->ishtp_dma_tx_grow) {
+		dev->ishtp_dma_tx_grow = false;
+		schedule_work(&dev->ishtp_dma_tx_grow_work);
 	}
 	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
 }
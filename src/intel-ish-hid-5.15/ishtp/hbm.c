@@ -13,6 +13,7 @@
 #include "ishtp-dev.h"
 #include "hbm.h"
 #include "client.h"
+#include "trace.h"
 
 /**
  * ishtp_hbm_fw_cl_allocate() - Allocate FW clients
@@ -23,7 +24,7 @@
 static void ishtp_hbm_fw_cl_allocate(struct ishtp_device *dev)
 {
 	struct ishtp_fw_client *clients;
-	int b;
+	int b, i = 0;
 
 	/* count how many ISH clients we have */
 	for_each_set_bit(b, dev->fw_clients_map, ISHTP_CLIENTS_MAX)
@@ -40,9 +41,38 @@ static void ishtp_hbm_fw_cl_allocate(struct ishtp_device *dev)
 		ish_hw_reset(dev);
 		return;
 	}
+
+	/* fw_clients[] follows fw_clients_map order */
+	for_each_set_bit(b, dev->fw_clients_map, ISHTP_CLIENTS_MAX)
+		clients[i++].client_id = b;
 	dev->fw_clients = clients;
 }
 
+/**
+ * ishtp_hbm_phase_begin() - Start timing an HBM bring-up phase
+ * @dev: ISHTP device instance
+ * @phase: bring-up phase
+ */
+static void ishtp_hbm_phase_begin(struct ishtp_device *dev,
+				  enum ishtp_hbm_phase phase)
+{
+	dev->hbm_phase_start[phase] = ktime_get();
+}
+
+/**
+ * ishtp_hbm_phase_end() - Record the duration of an HBM bring-up phase
+ * @dev: ISHTP device instance
+ * @phase: bring-up phase
+ */
+static void ishtp_hbm_phase_end(struct ishtp_device *dev,
+				enum ishtp_hbm_phase phase)
+{
+	dev->hbm_phase_us[phase] = ktime_us_delta(ktime_get(),
+						  dev->hbm_phase_start[phase]);
+	dev_dbg(dev->devc, "HBM bring-up phase %d took %lld us\n", phase,
+		dev->hbm_phase_us[phase]);
+}
+
 /**
  * ishtp_hbm_cl_hdr() - construct client hbm header
  * @cl: client
@@ -142,6 +172,7 @@ int ishtp_hbm_start_req(struct ishtp_device *dev)
 	 * So set it at first, change back to ISHTP_HBM_IDLE upon failure
 	 */
 	dev->hbm_state = ISHTP_HBM_START;
+	ishtp_hbm_phase_begin(dev, ISHTP_HBM_PHASE_START);
 	if (ishtp_write_message(dev, &hdr, &start_req)) {
 		dev_err(dev->devc, "version message send failed\n");
 		dev->dev_state = ISHTP_DEV_RESETTING;
@@ -170,6 +201,7 @@ void ishtp_hbm_enum_clients_req(struct ishtp_device *dev)
 	ishtp_hbm_hdr(&hdr, sizeof(enum_req));
 	enum_req.hbm_cmd = HOST_ENUM_REQ_CMD;
 
+	ishtp_hbm_phase_begin(dev, ISHTP_HBM_PHASE_ENUM);
 	if (ishtp_write_message(dev, &hdr, &enum_req)) {
 		dev->dev_state = ISHTP_DEV_RESETTING;
 		dev_err(dev->devc, "enumeration request send failed\n");
@@ -182,7 +214,9 @@ void ishtp_hbm_enum_clients_req(struct ishtp_device *dev)
  * ishtp_hbm_prop_req() - Request property
  * @dev: ISHTP device instance
  *
- * Request property for a single client
+ * Request property for the next client not asked for yet, if any. Up to
+ * ishtp_get_prop_req_window() requests are kept in flight, and responses
+ * are matched by client address.
  *
  * Return: 0 if success else error code
  */
@@ -191,33 +225,23 @@ static int ishtp_hbm_prop_req(struct ishtp_device *dev)
 	struct ishtp_msg_hdr hdr;
 	struct hbm_props_request prop_req = { 0 };
 	unsigned long next_client_index;
-	uint8_t client_num;
-
-	client_num = dev->fw_client_presentation_num;
 
 	next_client_index = find_next_bit(dev->fw_clients_map,
 		ISHTP_CLIENTS_MAX, dev->fw_client_index);
 
-	/* We got all client properties */
-	if (next_client_index == ISHTP_CLIENTS_MAX) {
-		dev->hbm_state = ISHTP_HBM_WORKING;
-		dev->dev_state = ISHTP_DEV_ENABLED;
-
-		for (dev->fw_client_presentation_num = 1;
-			dev->fw_client_presentation_num < client_num + 1;
-				++dev->fw_client_presentation_num)
-			/* Add new client device */
-			ishtp_bus_new_client(dev);
+	/* All client properties were requested */
+	if (next_client_index == ISHTP_CLIENTS_MAX)
 		return 0;
-	}
-
-	dev->fw_clients[client_num].client_id = next_client_index;
 
 	ishtp_hbm_hdr(&hdr, sizeof(prop_req));
 
 	prop_req.hbm_cmd = HOST_CLIENT_PROPERTIES_REQ_CMD;
 	prop_req.address = next_client_index;
 
+	/* The response may arrive before ishtp_write_message() returns */
+	set_bit(next_client_index, dev->fw_clients_props_map);
+	dev->fw_client_index = next_client_index + 1;
+
 	if (ishtp_write_message(dev, &hdr, &prop_req)) {
 		dev->dev_state = ISHTP_DEV_RESETTING;
 		dev_err(dev->devc, "properties request send failed\n");
@@ -225,11 +249,45 @@ static int ishtp_hbm_prop_req(struct ishtp_device *dev)
 		return -EIO;
 	}
 
-	dev->fw_client_index = next_client_index;
-
 	return 0;
 }
 
+/**
+ * ishtp_hbm_props_done() - Finish client enumeration
+ * @dev: ISHTP device instance
+ *
+ * Called once the properties of every FW client were received. Tell the
+ * firmware about the DMA Rx buffer, if DMA is used.
+ */
+static void ishtp_hbm_props_done(struct ishtp_device *dev)
+{
+	struct ishtp_msg_hdr ishtp_hdr;
+	struct dma_alloc_notify	dma_alloc_notify;
+
+	dev->hbm_state = ISHTP_HBM_WORKING;
+	dev->dev_state = ISHTP_DEV_ENABLED;
+	ishtp_hbm_phase_end(dev, ISHTP_HBM_PHASE_PROPS);
+
+	if (!ishtp_use_dma_transfer())
+		return;
+
+	dev_dbg(dev->devc, "Requesting to use DMA\n");
+	ishtp_cl_alloc_dma_rx_buf(dev);
+	if (dev->ishtp_host_dma_rx_buf) {
+		const size_t len = sizeof(dma_alloc_notify);
+
+		memset(&dma_alloc_notify, 0, sizeof(dma_alloc_notify));
+		dma_alloc_notify.hbm = DMA_BUFFER_ALLOC_NOTIFY;
+		dma_alloc_notify.buf_size =
+				dev->ishtp_host_dma_rx_buf_size;
+		dma_alloc_notify.buf_address =
+				dev->ishtp_host_dma_rx_buf_phys;
+		ishtp_hbm_hdr(&ishtp_hdr, len);
+		ishtp_write_message(dev, &ishtp_hdr,
+			(unsigned char *)&dma_alloc_notify);
+	}
+}
+
 /**
  * ishtp_hbm_stop_req() - Send HBM stop
  * @dev: ISHTP device instance
@@ -286,7 +344,9 @@ int ishtp_hbm_cl_flow_control_req(struct ishtp_device *dev,
 	rv = ishtp_write_message(dev, &hdr, &flow_ctrl);
 	if (!rv) {
 		++cl->out_flow_ctrl_creds;
-		++cl->out_flow_ctrl_cnt;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_FC_OUT);
+		trace_ishtp_fc_out(cl->host_client_id, cl->fw_client_id,
+				   cl->out_flow_ctrl_creds);
 		cl->ts_out_fc = ktime_get();
 		if (cl->ts_rx) {
 			ktime_t ts_diff = ktime_sub(cl->ts_out_fc, cl->ts_rx);
@@ -294,7 +354,7 @@ int ishtp_hbm_cl_flow_control_req(struct ishtp_device *dev,
 				cl->ts_max_fc_delay = ts_diff;
 		}
 	} else {
-		++cl->err_send_fc;
+		ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_ERR_SEND_FC);
 	}
 
 	spin_unlock_irqrestore(&cl->fc_spinlock, flags);
@@ -445,6 +505,7 @@ static void ishtp_hbm_dma_xfer_ack(struct ishtp_device *dev,
 		(struct ishtp_msg_hdr *)&dev->ishtp_msg_hdr;
 	unsigned int	msg_offs;
 	struct ishtp_cl *cl;
+	unsigned long	flags;
 
 	for (msg_offs = 0; msg_offs < ishtp_hdr->length;
 		msg_offs += sizeof(struct dma_xfer_hbm)) {
@@ -462,32 +523,35 @@ static void ishtp_hbm_dma_xfer_ack(struct ishtp_device *dev,
 		/* logical address of the acked mem */
 		msg = (unsigned char *)dev->ishtp_host_dma_tx_buf + offs;
 		ishtp_cl_release_dma_acked_mem(dev, msg, dma_xfer->msg_length);
+		trace_ishtp_dma_tx_ack(dma_xfer->host_client_id,
+				       dma_xfer->fw_client_id, offs,
+				       dma_xfer->msg_length);
 
-		list_for_each_entry(cl, &dev->cl_list, link) {
-			if (cl->fw_client_id == dma_xfer->fw_client_id &&
-			    cl->host_client_id == dma_xfer->host_client_id)
+		/* The client can't be freed while its ack is handled */
+		spin_lock_irqsave(&dev->cl_list_lock, flags);
+		cl = ishtp_cl_by_id(dev, dma_xfer->host_client_id,
+				    dma_xfer->fw_client_id);
+		/*
+		 * in case that a single ack may be sent
+		 * over several dma transfers, and the last msg
+		 * addr was inside the acked memory, but not in
+		 * its start
+		 */
+		if (cl && cl->last_dma_addr >= (unsigned char *)msg &&
+		    cl->last_dma_addr <
+				(unsigned char *)msg + dma_xfer->msg_length) {
+			cl->last_dma_acked = 1;
+			ishtp_cl_tx_sample_end(cl, CL_TX_PATH_DMA);
+
+			if (!ishtp_cl_tx_empty(cl) &&
+				cl->ishtp_flow_ctrl_creds) {
 				/*
-				 * in case that a single ack may be sent
-				 * over several dma transfers, and the last msg
-				 * addr was inside the acked memory, but not in
-				 * its start
+				 * start sending the first msg
 				 */
-				if (cl->last_dma_addr >=
-							(unsigned char *)msg &&
-						cl->last_dma_addr <
-						(unsigned char *)msg +
-						dma_xfer->msg_length) {
-					cl->last_dma_acked = 1;
-
-					if (!list_empty(&cl->tx_list.list) &&
-						cl->ishtp_flow_ctrl_creds) {
-						/*
-						 * start sending the first msg
-						 */
-						ishtp_cl_send_msg(dev, cl);
-					}
-				}
+				ishtp_cl_send_msg(dev, cl);
+			}
 		}
+		spin_unlock_irqrestore(&dev->cl_list_lock, flags);
 		++dma_xfer;
 	}
 }
@@ -508,6 +572,7 @@ static void ishtp_hbm_dma_xfer(struct ishtp_device *dev,
 	struct ishtp_msg_hdr	*ishtp_hdr =
 		(struct ishtp_msg_hdr *) &dev->ishtp_msg_hdr;
 	struct dma_xfer_hbm	*prm = dma_xfer;
+	struct dma_xfer_hbm	*ack = dma_xfer;
 	unsigned int	msg_offs;
 
 	for (msg_offs = 0; msg_offs < ishtp_hdr->length;
@@ -524,13 +589,23 @@ static void ishtp_hbm_dma_xfer(struct ishtp_device *dev,
 			return;
 		}
 		msg = dev->ishtp_host_dma_rx_buf + offs;
-		recv_ishtp_cl_msg_dma(dev, msg, dma_xfer);
-		dma_xfer->hbm = DMA_XFER_ACK;	/* Prepare for response */
+		trace_ishtp_dma_rx(dma_xfer->host_client_id,
+				   dma_xfer->fw_client_id, offs,
+				   dma_xfer->msg_length);
+		/* Messages lent to their client are acked on release */
+		if (!recv_ishtp_cl_msg_dma(dev, msg, dma_xfer)) {
+			*ack = *dma_xfer;
+			ack->hbm = DMA_XFER_ACK;	/* Prepare for response */
+			++ack;
+		}
 		++dma_xfer;
 	}
 
+	if (ack == prm)
+		return;
+
 	/* Send DMA_XFER_ACK [...] */
-	ishtp_hbm_hdr(&hdr, ishtp_hdr->length);
+	ishtp_hbm_hdr(&hdr, (ack - prm) * sizeof(struct dma_xfer_hbm));
 	ishtp_write_message(dev, &hdr, (unsigned char *)prm);
 }
 
@@ -553,9 +628,9 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
 	struct hbm_client_connect_request *disconnect_req;
 	struct hbm_props_response *props_res;
 	struct hbm_host_enum_response *enum_res;
-	struct ishtp_msg_hdr ishtp_hdr;
-	struct dma_alloc_notify	dma_alloc_notify;
 	struct dma_xfer_hbm	*dma_xfer;
+	unsigned long	flags;
+	unsigned int	i;
 
 	ishtp_msg = hdr;
 
@@ -574,6 +649,7 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
 		dev->version.minor_version = HBM_MINOR_VERSION;
 		if (dev->dev_state == ISHTP_DEV_INIT_CLIENTS &&
 				dev->hbm_state == ISHTP_HBM_START) {
+			ishtp_hbm_phase_end(dev, ISHTP_HBM_PHASE_START);
 			dev->hbm_state = ISHTP_HBM_STARTED;
 			ishtp_hbm_enum_clients_req(dev);
 		} else {
@@ -600,7 +676,6 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
 
 	case HOST_CLIENT_PROPERTIES_RES_CMD:
 		props_res = (struct hbm_props_response *)ishtp_msg;
-		fw_client = &dev->fw_clients[dev->fw_client_presentation_num];
 
 		if (props_res->status || !dev->fw_clients) {
 			dev_err(dev->devc,
@@ -609,51 +684,39 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
 			return;
 		}
 
-		if (fw_client->client_id != props_res->address) {
-			dev_err(dev->devc,
-				"reset: host properties response address mismatch [%02X %02X]\n",
-				fw_client->client_id, props_res->address);
-			ish_hw_reset(dev);
-			return;
-		}
-
-		if (dev->dev_state != ISHTP_DEV_INIT_CLIENTS ||
-			dev->hbm_state != ISHTP_HBM_CLIENT_PROPERTIES) {
+		if (dev->hbm_state != ISHTP_HBM_CLIENT_PROPERTIES ||
+			props_res->address >= ISHTP_CLIENTS_MAX ||
+			!test_and_clear_bit(props_res->address,
+					    dev->fw_clients_props_map)) {
 			dev_err(dev->devc,
-				"reset: unexpected properties response\n");
+				"reset: unexpected properties response [%02X]\n",
+				props_res->address);
 			ish_hw_reset(dev);
 			return;
 		}
 
+		fw_client = &dev->fw_clients[bitmap_weight(dev->fw_clients_map,
+							   props_res->address)];
 		fw_client->props = props_res->client_properties;
-		dev->fw_client_index++;
+		spin_lock_irqsave(&dev->fw_clients_lock, flags);
+		hash_add(dev->fw_clients_uuid_hash, &fw_client->uuid_node,
+		    ishtp_fw_cl_uuid_hash(&fw_client->props.protocol_name));
+		spin_unlock_irqrestore(&dev->fw_clients_lock, flags);
 		dev->fw_client_presentation_num++;
 
-		/* request property for the next client */
-		ishtp_hbm_prop_req(dev);
-
-		if (dev->dev_state != ISHTP_DEV_ENABLED)
-			break;
-
-		if (!ishtp_use_dma_transfer())
-			break;
+		/* Keep the request window full */
+		if (ishtp_hbm_prop_req(dev))
+			return;
 
-		dev_dbg(dev->devc, "Requesting to use DMA\n");
-		ishtp_cl_alloc_dma_buf(dev);
-		if (dev->ishtp_host_dma_rx_buf) {
-			const size_t len = sizeof(dma_alloc_notify);
-
-			memset(&dma_alloc_notify, 0, sizeof(dma_alloc_notify));
-			dma_alloc_notify.hbm = DMA_BUFFER_ALLOC_NOTIFY;
-			dma_alloc_notify.buf_size =
-					dev->ishtp_host_dma_rx_buf_size;
-			dma_alloc_notify.buf_address =
-					dev->ishtp_host_dma_rx_buf_phys;
-			ishtp_hbm_hdr(&ishtp_hdr, len);
-			ishtp_write_message(dev, &ishtp_hdr,
-				(unsigned char *)&dma_alloc_notify);
-		}
+		/*
+		 * The client is usable as soon as its properties are known, so
+		 * add its device without waiting for the rest
+		 */
+		dev->dev_state = ISHTP_DEV_ENABLED;
+		ishtp_bus_new_client(dev, fw_client);
 
+		if (bitmap_empty(dev->fw_clients_props_map, ISHTP_CLIENTS_MAX))
+			ishtp_hbm_props_done(dev);
 		break;
 
 	case HOST_ENUM_RES_CMD:
@@ -661,14 +724,25 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
 		memcpy(dev->fw_clients_map, enum_res->valid_addresses, 32);
 		if (dev->dev_state == ISHTP_DEV_INIT_CLIENTS &&
 			dev->hbm_state == ISHTP_HBM_ENUM_CLIENTS) {
+			ishtp_hbm_phase_end(dev, ISHTP_HBM_PHASE_ENUM);
 			dev->fw_client_presentation_num = 0;
 			dev->fw_client_index = 0;
+			bitmap_zero(dev->fw_clients_props_map,
+				    ISHTP_CLIENTS_MAX);
 
 			ishtp_hbm_fw_cl_allocate(dev);
 			dev->hbm_state = ISHTP_HBM_CLIENT_PROPERTIES;
 
-			/* first property request */
-			ishtp_hbm_prop_req(dev);
+			/* first property requests */
+			ishtp_hbm_phase_begin(dev, ISHTP_HBM_PHASE_PROPS);
+			for (i = 0; i < ishtp_get_prop_req_window(); i++)
+				if (ishtp_hbm_prop_req(dev))
+					return;
+
+			/* No FW clients */
+			if (bitmap_empty(dev->fw_clients_props_map,
+					 ISHTP_CLIENTS_MAX))
+				ishtp_hbm_props_done(dev);
 		} else {
 			dev_err(dev->devc,
 			      "reset: unexpected enumeration response hbm\n");
@@ -735,27 +809,53 @@ void ishtp_hbm_dispatch(struct ishtp_device *dev,
  * @work: work struct
  *
  * Bottom half processing work function (instead of thread handler)
- * for processing hbm messages
+ * for processing hbm messages. Drains up to RD_BH_BUDGET queued messages
+ * per run, and reschedules itself if more are left.
  */
 void	bh_hbm_work_fn(struct work_struct *work)
 {
 	unsigned long	flags;
 	struct ishtp_device	*dev;
-	unsigned char	hbm[IPC_PAYLOAD_SIZE];
+	unsigned int	head, tail, next, resets;
+	unsigned int	budget = RD_BH_BUDGET;
 
 	dev = container_of(work, struct ishtp_device, bh_hbm_work);
 	spin_lock_irqsave(&dev->rd_msg_spinlock, flags);
-	if (dev->rd_msg_fifo_head != dev->rd_msg_fifo_tail) {
-		memcpy(hbm, dev->rd_msg_fifo + dev->rd_msg_fifo_head,
-			IPC_PAYLOAD_SIZE);
-		dev->rd_msg_fifo_head =
-			(dev->rd_msg_fifo_head + IPC_PAYLOAD_SIZE) %
+	head = dev->rd_msg_fifo_head;
+	tail = dev->rd_msg_fifo_tail;
+	resets = dev->rd_msg_fifo_resets;
+	spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
+
+	while (head != tail && budget) {
+		/*
+		 * The ISR never writes the entry at head until head moves
+		 * past it, so it can be processed in place
+		 */
+		ishtp_hbm_dispatch(dev,
+			(struct ishtp_bus_message *)(dev->rd_msg_fifo + head));
+		next = (head + IPC_PAYLOAD_SIZE) %
 			(RD_INT_FIFO_SIZE * IPC_PAYLOAD_SIZE);
-		spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
-		ishtp_hbm_dispatch(dev, (struct ishtp_bus_message *)hbm);
-	} else {
+		--budget;
+
+		spin_lock_irqsave(&dev->rd_msg_spinlock, flags);
+		if (dev->rd_msg_fifo_head != head ||
+		    dev->rd_msg_fifo_resets != resets) {
+			/*
+			 * A reset emptied the FIFO while the entry was being
+			 * processed: don't move its new head, start over
+			 */
+			head = dev->rd_msg_fifo_head;
+			tail = dev->rd_msg_fifo_tail;
+			spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
+			break;
+		}
+		dev->rd_msg_fifo_head = head = next;
+		tail = dev->rd_msg_fifo_tail;
 		spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
 	}
+
+	if (head != tail)
+		schedule_work(&dev->bh_hbm_work);
 }
 
 /**
@@ -772,56 +872,61 @@ void	recv_hbm(struct ishtp_device *dev, struct ishtp_msg_hdr *ishtp_hdr)
 	struct ishtp_bus_message	*ishtp_msg =
 		(struct ishtp_bus_message *)rd_msg_buf;
 	unsigned long	flags;
+	unsigned int	depth;
 
 	dev->ops->ishtp_read(dev, rd_msg_buf, ishtp_hdr->length);
+	trace_ishtp_hbm_rx(ishtp_msg->hbm_cmd, ishtp_hdr->length);
 
 	/* Flow control - handle in place */
 	if (ishtp_msg->hbm_cmd == ISHTP_FLOW_CONTROL_CMD) {
 		struct hbm_flow_control *flow_control =
 			(struct hbm_flow_control *)ishtp_msg;
 		struct ishtp_cl *cl = NULL;
-		unsigned long	flags, tx_flags;
+		unsigned long	flags;
+		int	creds;
 
 		spin_lock_irqsave(&dev->cl_list_lock, flags);
-		list_for_each_entry(cl, &dev->cl_list, link) {
-			if (cl->host_client_id == flow_control->host_addr &&
-					cl->fw_client_id ==
-					flow_control->fw_addr) {
-				/*
-				 * NOTE: It's valid only for counting
-				 * flow-control implementation to receive a
-				 * FC in the middle of sending. Meanwhile not
-				 * supported
-				 */
-				if (cl->ishtp_flow_ctrl_creds)
-					dev_err(dev->devc,
-					 "recv extra FC from FW client %u (host client %u) (FC count was %d)\n",
-					 (unsigned int)cl->fw_client_id,
-					 (unsigned int)cl->host_client_id,
-					 cl->ishtp_flow_ctrl_creds);
-				else {
-					++cl->ishtp_flow_ctrl_creds;
-					++cl->ishtp_flow_ctrl_cnt;
-					cl->last_ipc_acked = 1;
-					spin_lock_irqsave(
-							&cl->tx_list_spinlock,
-							tx_flags);
-					if (!list_empty(&cl->tx_list.list)) {
-						/*
-						 * start sending the first msg
-						 *	= the callback function
-						 */
-						spin_unlock_irqrestore(
-							&cl->tx_list_spinlock,
-							tx_flags);
-						ishtp_cl_send_msg(dev, cl);
-					} else {
-						spin_unlock_irqrestore(
-							&cl->tx_list_spinlock,
-							tx_flags);
-					}
+		cl = ishtp_cl_by_id(dev, flow_control->host_addr,
+				    flow_control->fw_addr);
+		if (cl) {
+			/*
+			 * NOTE: With counting flow-control a FC may arrive
+			 * in the middle of sending. Credits accumulate up to
+			 * the client's limit, and the Tx path drains queued
+			 * messages while there are any left. The Tx path
+			 * takes them under tx_list_spinlock, so count them
+			 * in under it too
+			 */
+			spin_lock(&cl->tx_list_spinlock);
+			creds = cl->ishtp_flow_ctrl_creds;
+			if (creds < cl->ishtp_flow_ctrl_creds_max)
+				cl->ishtp_flow_ctrl_creds = ++creds;
+			else
+				creds = -1;
+			spin_unlock(&cl->tx_list_spinlock);
+
+			if (creds < 0)
+				dev_err(dev->devc,
+				 "recv extra FC from FW client %u (host client %u) (FC count was %d)\n",
+				 (unsigned int)cl->fw_client_id,
+				 (unsigned int)cl->host_client_id,
+				 cl->ishtp_flow_ctrl_creds_max);
+			else {
+				ishtp_stats_inc(cl->stats,
+						ISHTP_CL_STAT_FC_IN);
+				trace_ishtp_fc_in(cl->host_client_id,
+						  cl->fw_client_id, creds);
+				cl->last_ipc_acked = 1;
+				ishtp_cl_tx_sample_end(cl, CL_TX_PATH_IPC);
+				/* Pairs with the barrier in ishtp_cl_send() */
+				smp_mb();
+				if (!ishtp_cl_tx_empty(cl) && !cl->sending) {
+					/*
+					 * start sending the first msg
+					 *	= the callback function
+					 */
+					ishtp_cl_send_msg(dev, cl);
 				}
-				break;
 			}
 		}
 		spin_unlock_irqrestore(&dev->cl_list_lock, flags);
@@ -858,6 +963,10 @@ void	recv_hbm(struct ishtp_device *dev, struct ishtp_msg_hdr *ishtp_hdr)
 		ishtp_hdr->length);
 	dev->rd_msg_fifo_tail = (dev->rd_msg_fifo_tail + IPC_PAYLOAD_SIZE) %
 		(RD_INT_FIFO_SIZE * IPC_PAYLOAD_SIZE);
+	depth = ((dev->rd_msg_fifo_tail - dev->rd_msg_fifo_head) /
+		IPC_PAYLOAD_SIZE) % RD_INT_FIFO_SIZE;
+	if (depth > dev->rd_msg_fifo_max_depth)
+		dev->rd_msg_fifo_max_depth = depth;
 	spin_unlock_irqrestore(&dev->rd_msg_spinlock, flags);
 	schedule_work(&dev->bh_hbm_work);
 eoi:
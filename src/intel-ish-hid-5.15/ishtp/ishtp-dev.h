@@ -10,6 +10,13 @@
 
 #include <linux/types.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/overflow.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/intel-ish-client-if.h>
 #include "bus.h"
 #include "hbm.h"
@@ -21,11 +28,16 @@
 /* Number of messages to be held in ISR->BH FIFO */
 #define	RD_INT_FIFO_SIZE	64
 
+/* Number of messages the BH processes before yielding to other work */
+#define	RD_BH_BUDGET		16
+
 /*
  * Number of IPC messages to be held in Tx FIFO, to be sent by ISR -
  * Tx complete interrupt or RX_COMPLETE handler
  */
 #define	IPC_TX_FIFO_SIZE	512
+/* Number of IPC write queue entries for HBM and management messages */
+#define	IPC_TX_CTRL_FIFO_SIZE	64
 
 /*
  * Number of Maximum ISHTP Clients
@@ -66,12 +78,17 @@ struct ishtp_cl;
  *
  * @props - client properties
  * @client_id - fw client id
+ * @uuid_node - link in the device's protocol name hash
  */
 struct ishtp_fw_client {
 	struct ishtp_client_properties props;
 	uint8_t client_id;
+	struct hlist_node uuid_node;
 };
 
+/* Buckets in the fw client protocol name hash */
+#define ISHTP_FW_CLIENTS_HASH_BITS	5
+
 /*
  * Control info for IPC messages ISHTP/IPC sending FIFO -
  * list with inline data buffer
@@ -98,10 +115,68 @@ struct wr_msg_ctl_info {
 
 	void *ipc_send_compl_prm;
 	size_t length;
-	struct list_head	link;
 	unsigned char	inline_data[IPC_FULL_MSG_SIZE];
 };
 
+/* IPC write queue lanes, in order of priority */
+enum ishtp_wr_lane {
+	ISHTP_WR_LANE_CTRL,	/* HBM and IPC management messages */
+	ISHTP_WR_LANE_BULK,	/* Client message fragments */
+	ISHTP_WR_LANES
+};
+
+/*
+ * IPC write queue lane: a ring of 'size' (power of 2) entries. 'head' and
+ * 'tail' run free and are masked with 'size' - 1.
+ */
+struct ishtp_wr_lane {
+	struct wr_msg_ctl_info	*ring;
+	unsigned int	size;
+	unsigned int	head;
+	unsigned int	tail;
+	/* Occupancy stats */
+	unsigned int	max_depth;
+	unsigned int	full_cnt;
+};
+
+/* HBM bring-up phases, each timed from its first request to last response */
+enum ishtp_hbm_phase {
+	ISHTP_HBM_PHASE_START,		/* HOST_START_REQ */
+	ISHTP_HBM_PHASE_ENUM,		/* HOST_ENUM_REQ */
+	ISHTP_HBM_PHASE_PROPS,		/* HOST_CLIENT_PROPERTIES_REQs */
+	ISHTP_HBM_PHASES
+};
+
+/*
+ * Firmware clock correlation. Each MNG_SYNC_FW_CLOCK sets the firmware
+ * clock to the host boottime in us; the host keeps the CLOCK_MONOTONIC
+ * time it was written at, and estimates how fast the firmware clock runs
+ * from the firmware timestamps clients observe until the next sync.
+ */
+struct ishtp_fw_clock {
+	seqlock_t	lock;
+	bool		valid;
+	/* Firmware time set by the last sync, and when it was written */
+	u64		fw_us;
+	ktime_t		host;
+	/* Half the time the sync took to write */
+	u32		sync_err_ns;
+	/* Firmware clock rate relative to the host, and its uncertainty */
+	s32		drift_ppb;
+	u32		drift_err_ppb;
+	bool		drift_valid;
+	/*
+	 * Lowest rx delay observed early and late in the sync period, and
+	 * the firmware clock age it was observed at
+	 */
+	s64		min_delay_ns[2];
+	s64		min_delay_age_ns[2];
+	/* jiffies of the last sync request, 0 to sync on the next message */
+	unsigned long	sync_jiffies;
+	unsigned int	sync_cnt;
+	unsigned int	observe_cnt;
+};
+
 /*
  * The ISHTP layer talks to hardware IPC message using the following
  * callbacks
@@ -147,12 +222,26 @@ struct ishtp_device {
 	struct hbm_version version;
 	int transfer_path; /* Choice of transfer path: IPC or DMA */
 
+	/* debugfs directory of this device */
+	struct dentry *debugfs_dir;
+
 	/* ishtp device states */
 	enum ishtp_dev_state dev_state;
 	enum ishtp_hbm_state hbm_state;
 
-	/* driver read queue */
-	struct ishtp_cl_rb read_list;
+	/* HBM bring-up timing of the last reset, in us */
+	ktime_t hbm_phase_start[ISHTP_HBM_PHASES];
+	s64 hbm_phase_us[ISHTP_HBM_PHASES];
+
+	/*
+	 * Linked clients by host client id; each holds its own read queue.
+	 * Updated with both cl_list_lock and read_list_spinlock held, so
+	 * either lock is enough for a lookup
+	 */
+	struct ishtp_cl *host_clients[ISHTP_CLIENTS_MAX];
+
+	/* Host clients waiting for room in the IPC Tx queue */
+	DECLARE_BITMAP(ipc_tx_wait_map, ISHTP_CLIENTS_MAX);
 	spinlock_t read_list_spinlock;
 
 	/* list of ishtp_cl's */
@@ -171,31 +260,52 @@ struct ishtp_device {
 	/* FIFO for input messages for BH processing */
 	unsigned char rd_msg_fifo[RD_INT_FIFO_SIZE * IPC_PAYLOAD_SIZE];
 	unsigned int rd_msg_fifo_head, rd_msg_fifo_tail;
+	/* Bumped whenever the FIFO is emptied by a reset */
+	unsigned int rd_msg_fifo_resets;
+	/* Most messages ever waiting in the FIFO */
+	unsigned int rd_msg_fifo_max_depth;
 	spinlock_t rd_msg_spinlock;
 	struct work_struct bh_hbm_work;
 
-	/* IPC write queue */
-	struct list_head wr_processing_list, wr_free_list;
-	/* For both processing list  and free list */
+	/*
+	 * IPC write queue. Control messages are written ahead of client
+	 * fragments, and can't be crowded out by them.
+	 */
+	struct ishtp_wr_lane wr_lanes[ISHTP_WR_LANES];
+	/* For all lanes */
 	spinlock_t wr_processing_spinlock;
 
 	struct ishtp_fw_client *fw_clients; /*Note:memory has to be allocated*/
 	DECLARE_BITMAP(fw_clients_map, ISHTP_CLIENTS_MAX);
+	/* FW clients whose properties were requested, but not received yet */
+	DECLARE_BITMAP(fw_clients_props_map, ISHTP_CLIENTS_MAX);
 	DECLARE_BITMAP(host_clients_map, ISHTP_CLIENTS_MAX);
+	DECLARE_HASHTABLE(fw_clients_uuid_hash, ISHTP_FW_CLIENTS_HASH_BITS);
 	uint8_t fw_clients_num;
 	uint8_t fw_client_presentation_num;
 	uint8_t fw_client_index;
 	spinlock_t fw_clients_lock;
 
-	/* TX DMA buffers and slots */
+	/*
+	 * TX DMA buffers and slots. The buffer is sized for the connected
+	 * clients, and replaced by a larger one when it's idle.
+	 */
 	int ishtp_host_dma_enabled;
 	void *ishtp_host_dma_tx_buf;
 	unsigned int ishtp_host_dma_tx_buf_size;
 	uint64_t ishtp_host_dma_tx_buf_phys;
 	int ishtp_dma_num_slots;
-
-	/* map of 4k blocks in Tx dma buf: 0-free, 1-used */
-	uint8_t *ishtp_dma_tx_map;
+	/* A larger buffer is wanted once no slot is in use */
+	bool ishtp_dma_tx_grow;
+	struct work_struct ishtp_dma_tx_grow_work;
+
+	/* bitmap of 4k blocks in Tx dma buf: 0-free, 1-used */
+	unsigned long *ishtp_dma_tx_map;
+	/* Slot to start the next search from */
+	unsigned int ishtp_dma_tx_hint;
+	/* Slots currently in use, and the most ever in use */
+	unsigned int ishtp_dma_tx_used;
+	unsigned int ishtp_dma_tx_used_max;
 	spinlock_t ishtp_dma_tx_lock;
 
 	/* RX DMA buffers and slots */
@@ -206,11 +316,16 @@ struct ishtp_device {
 	/* Dump to trace buffers if enabled*/
 	ishtp_print_log print_log;
 
-	/* Debug stats */
-	unsigned int	ipc_rx_cnt;
-	unsigned long long	ipc_rx_bytes_cnt;
-	unsigned int	ipc_tx_cnt;
-	unsigned long long	ipc_tx_bytes_cnt;
+	/* Firmware clock correlation */
+	struct ishtp_fw_clock	fw_clock;
+
+	/* Debug stats, ISHTP_DEV_STAT_* */
+	struct ishtp_stats __percpu	*stats;
+	/* DMA Tx slot allocations, under ishtp_dma_tx_lock */
+	unsigned int	dma_tx_alloc_cnt;
+	unsigned int	dma_tx_alloc_fail_cnt;
+	/* Failures with enough free slots, but none contiguous */
+	unsigned int	dma_tx_frag_fail_cnt;
 
 	const struct ishtp_hw_ops *ops;
 	size_t	mtu;
@@ -218,6 +333,58 @@ struct ishtp_device {
 	char hw[] __aligned(sizeof(void *));
 };
 
+/* Device statistics */
+enum ishtp_dev_stat {
+	ISHTP_DEV_STAT_IPC_RX,
+	ISHTP_DEV_STAT_IPC_RX_BYTES,
+	ISHTP_DEV_STAT_IPC_TX,
+	ISHTP_DEV_STAT_IPC_TX_BYTES,
+	ISHTP_DEV_STATS
+};
+
+/*
+ * Statistics counters. Each CPU updates its own copy, so counting needs
+ * neither a lock nor an atomic operation from any context; readers sum
+ * the copies up. Allocate with ishtp_stats_size() bytes per CPU.
+ */
+struct ishtp_stats {
+	struct u64_stats_sync	syncp;
+	u64_stats_t		cnt[];
+};
+
+#define ishtp_stats_size(n)	struct_size((struct ishtp_stats *)NULL, cnt, n)
+
+static inline void ishtp_stats_init(struct ishtp_stats __percpu *stats)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(stats, cpu)->syncp);
+}
+
+static inline void ishtp_stats_add(struct ishtp_stats __percpu *stats,
+				   int idx, u64 n)
+{
+	struct ishtp_stats *s = get_cpu_ptr(stats);
+	unsigned long flags;
+
+	flags = u64_stats_update_begin_irqsave(&s->syncp);
+	u64_stats_add(&s->cnt[idx], n);
+	u64_stats_update_end_irqrestore(&s->syncp, flags);
+	put_cpu_ptr(stats);
+}
+
+static inline void ishtp_stats_inc(struct ishtp_stats __percpu *stats,
+				   int idx)
+{
+	ishtp_stats_add(stats, idx, 1);
+}
+
+static inline u32 ishtp_fw_cl_uuid_hash(const guid_t *uuid)
+{
+	return jhash(uuid, sizeof(*uuid), 0);
+}
+
 static inline unsigned long ishtp_secs_to_jiffies(unsigned long sec)
 {
 	return msecs_to_jiffies(sec * MSEC_PER_SEC);
@@ -235,4 +402,14 @@ static inline int ish_ipc_reset(struct ishtp_device *dev)
 void	ishtp_device_init(struct ishtp_device *dev);
 int	ishtp_start(struct ishtp_device *dev);
 
+/* Firmware clock correlation */
+void	ishtp_fw_clock_init(struct ishtp_device *dev);
+void	ishtp_fw_clock_reset(struct ishtp_device *dev);
+void	ishtp_fw_clock_sync(struct ishtp_device *dev, u64 fw_us,
+			    ktime_t start, ktime_t end);
+void	ishtp_fw_clock_observe(struct ishtp_device *dev, u64 fw_us,
+			       ktime_t rx);
+int	ishtp_fw_clock_to_host(struct ishtp_device *dev, u64 fw_us,
+			       ktime_t *host, u32 *err_ns);
+
 #endif /*_ISHTP_DEV_H_*/
@@ -84,6 +84,8 @@ enum {
 #define to_ish_hw(dev) (struct ish_hw *)((dev)->hw)
 
 irqreturn_t ish_irq_handler(int irq, void *dev_id);
+irqreturn_t ish_irq_quick_handler(int irq, void *dev_id);
+irqreturn_t ish_irq_thread(int irq, void *dev_id);
 struct ishtp_device *ish_dev_init(struct pci_dev *pdev);
 int ish_hw_start(struct ishtp_device *dev);
 void ish_device_disable(struct ishtp_device *dev);
@@ -9,6 +9,7 @@
 #include <linux/hid.h>
 #include <linux/intel-ish-client-if.h>
 #include <linux/sched.h>
+#include "bus.h"
 #include "ishtp-hid.h"
 
 /* ISH Transport protocol (ISHTP in short) GUID */
@@ -331,28 +332,30 @@ do_get_report:
  * @device:	Pointer to the ishtp client device for which this message
  *		is targeted
  *
- * Remove the packet from the list and process the message by calling
- * process_recv
+ * Take the packets received so far off the list, process each message by
+ * calling process_recv, then recycle the whole batch at once
  */
 static void ish_cl_event_cb(struct ishtp_cl_device *device)
 {
 	struct ishtp_cl	*hid_ishtp_cl = ishtp_get_drvdata(device);
 	struct ishtp_cl_rb *rb_in_proc;
-	size_t r_length;
+	LIST_HEAD(batch);
 
 	if (!hid_ishtp_cl)
 		return;
 
-	while ((rb_in_proc = ishtp_cl_rx_get_rb(hid_ishtp_cl)) != NULL) {
-		if (!rb_in_proc->buffer.data)
-			return;
+	while (ishtp_cl_rx_get_batch(hid_ishtp_cl, &batch,
+				     HID_CL_RX_RING_SIZE)) {
+		list_for_each_entry(rb_in_proc, &batch, list) {
+			if (!rb_in_proc->buffer.data)
+				continue;
 
-		r_length = rb_in_proc->buf_idx;
-
-		/* decide what to do with received data */
-		process_recv(hid_ishtp_cl, rb_in_proc->buffer.data, r_length);
+			/* decide what to do with received data */
+			process_recv(hid_ishtp_cl, rb_in_proc->buffer.data,
+				     rb_in_proc->buf_idx);
+		}
 
-		ishtp_cl_io_rb_recycle(rb_in_proc);
+		ishtp_cl_io_rb_recycle_batch(hid_ishtp_cl, &batch);
 	}
 }
 
@@ -45,7 +45,8 @@ struct ishtp_cl_device {
 	void (*event_cb)(struct ishtp_cl_device *device);
 };
 
-int	ishtp_bus_new_client(struct ishtp_device *dev);
+int	ishtp_bus_new_client(struct ishtp_device *dev,
+			     struct ishtp_fw_client *fw_client);
 void	ishtp_remove_all_clients(struct ishtp_device *dev);
 int	ishtp_cl_device_bind(struct ishtp_cl *cl);
 void	ishtp_cl_bus_rx_event(struct ishtp_cl_device *device);
@@ -64,6 +65,25 @@ int	ishtp_write_message(struct ishtp_device *dev,
 /* Use DMA to send/receive messages */
 int ishtp_use_dma_transfer(void);
 
+/* Flow control credits a client may hold */
+unsigned int ishtp_get_fc_creds_max(void);
+
+/* Messages a client may announce in one DMA_XFER */
+unsigned int ishtp_get_dma_batch_max(void);
+
+/* Client property requests in flight at bring-up */
+unsigned int ishtp_get_prop_req_window(void);
+
+/* DMA buffer size limits */
+unsigned int ishtp_get_dma_tx_buf_max(void);
+unsigned int ishtp_get_dma_rx_buf_max(void);
+
+/* debugfs */
+void	ishtp_debugfs_init(void);
+void	ishtp_debugfs_exit(void);
+void	ishtp_debugfs_dev_init(struct ishtp_device *dev);
+void	ishtp_debugfs_dev_exit(struct ishtp_device *dev);
+
 /* Exported functions */
 void	ishtp_bus_remove_all_clients(struct ishtp_device *ishtp_dev,
 				     bool warm_reset);
@@ -73,4 +93,11 @@ void	ishtp_reset_handler(struct ishtp_device *dev);
 void	ishtp_reset_compl_handler(struct ishtp_device *dev);
 
 int	ishtp_fw_cl_by_uuid(struct ishtp_device *dev, const guid_t *cuuid);
+
+/* Rx batches, for clients that process several messages per event */
+unsigned int	ishtp_cl_rx_get_batch(struct ishtp_cl *cl,
+				      struct list_head *batch,
+				      unsigned int budget);
+int	ishtp_cl_io_rb_recycle_batch(struct ishtp_cl *cl,
+				     struct list_head *batch);
 #endif /* _LINUX_ISHTP_CL_BUS_H */
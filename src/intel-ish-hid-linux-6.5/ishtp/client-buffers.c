@@ -5,6 +5,7 @@
  * Copyright (c) 2003-2016, Intel Corporation.
  */
 
+#include <linux/log2.h>
 #include <linux/slab.h>
 #include "client.h"
 
@@ -50,37 +51,63 @@ out:
  * ishtp_cl_alloc_tx_ring() - Allocate TX ring buffers
  * @cl: client device instance
  *
- * Allocate and initialize TX ring buffers
+ * Allocate and initialize TX ring buffers. Most messages are far smaller
+ * than max_msg_length, so each slot only gets a small buffer, and a few
+ * full-size buffers are shared by all slots for larger messages.
  *
  * Return: 0 on success else -ENOMEM
  */
 int ishtp_cl_alloc_tx_ring(struct ishtp_cl *cl)
 {
 	size_t	len = cl->device->fw_client->props.max_msg_length;
+	unsigned int	slots, large;
 	int	j;
-	unsigned long	flags;
 
-	cl->tx_ring_free_size = 0;
+	/* Drop the ring of a previous connection */
+	ishtp_cl_free_tx_ring(cl);
 
-	/* Allocate pool to free Tx bufs */
-	for (j = 0; j < cl->tx_ring_size; ++j) {
-		struct ishtp_cl_tx_ring	*tx_buf;
+	/* Slot count is a power of 2, so that indices can be masked */
+	slots = roundup_pow_of_two(max_t(unsigned int, cl->tx_ring_size, 1));
+
+	cl->tx_small_size = min_t(size_t, len, CL_TX_SMALL_MSG_SIZE);
+	large = 0;
+	if (len > cl->tx_small_size)
+		large = min_t(unsigned int,
+			      DIV_ROUND_UP(slots, CL_TX_LARGE_RATIO),
+			      BITS_PER_LONG);
+
+	cl->tx_ring = kcalloc(slots, sizeof(struct ishtp_cl_tx_ring),
+			      GFP_KERNEL);
+	cl->tx_small_arena = kcalloc(slots, cl->tx_small_size, GFP_KERNEL);
+	if (!cl->tx_ring || !cl->tx_small_arena)
+		goto	out;
+
+	cl->tx_ring_slots = slots;
+	cl->tx_head = 0;
+	cl->tx_tail = 0;
+
+	for (j = 0; j < slots; ++j) {
+		cl->tx_ring[j].small_buf = cl->tx_small_arena +
+					   j * cl->tx_small_size;
+		cl->tx_ring[j].send_buf.data = cl->tx_ring[j].small_buf;
+		cl->tx_ring[j].large = -1;
+	}
 
-		tx_buf = kzalloc(sizeof(struct ishtp_cl_tx_ring), GFP_KERNEL);
-		if (!tx_buf)
+	/* Allocate the shared full-size Tx bufs */
+	if (large) {
+		cl->tx_large_buf = kcalloc(large, sizeof(unsigned char *),
+					   GFP_KERNEL);
+		if (!cl->tx_large_buf)
 			goto	out;
 
-		tx_buf->send_buf.data = kmalloc(len, GFP_KERNEL);
-		if (!tx_buf->send_buf.data) {
-			kfree(tx_buf);
-			goto	out;
+		cl->tx_large_cnt = large;
+		for (j = 0; j < large; ++j) {
+			cl->tx_large_buf[j] = kmalloc(len, GFP_KERNEL);
+			if (!cl->tx_large_buf[j])
+				goto	out;
 		}
-
-		spin_lock_irqsave(&cl->tx_free_list_spinlock, flags);
-		list_add_tail(&tx_buf->list, &cl->tx_free_list.list);
-		++cl->tx_ring_free_size;
-		spin_unlock_irqrestore(&cl->tx_free_list_spinlock, flags);
 	}
+	cl->tx_large_map = 0;
 	return	0;
 out:
 	dev_err(&cl->device->dev, "error in allocating Tx pool\n");
@@ -115,6 +142,7 @@ void ishtp_cl_free_rx_ring(struct ishtp_cl *cl)
 		rb = list_entry(cl->in_process_list.list.next,
 				struct ishtp_cl_rb, list);
 		list_del(&rb->list);
+		ishtp_cl_dma_rx_drop(rb);
 		kfree(rb->buffer.data);
 		kfree(rb);
 	}
@@ -129,31 +157,37 @@ void ishtp_cl_free_rx_ring(struct ishtp_cl *cl)
  */
 void ishtp_cl_free_tx_ring(struct ishtp_cl *cl)
 {
-	struct ishtp_cl_tx_ring	*tx_buf;
+	struct ishtp_cl_tx_ring	*tx_ring;
+	unsigned char	*tx_small_arena;
+	unsigned char	**tx_large_buf;
+	unsigned int	large, j;
 	unsigned long	flags;
 
-	spin_lock_irqsave(&cl->tx_free_list_spinlock, flags);
-	/* release allocated memory - pass over tx_free_list */
-	while (!list_empty(&cl->tx_free_list.list)) {
-		tx_buf = list_entry(cl->tx_free_list.list.next,
-				    struct ishtp_cl_tx_ring, list);
-		list_del(&tx_buf->list);
-		--cl->tx_ring_free_size;
-		kfree(tx_buf->send_buf.data);
-		kfree(tx_buf);
-	}
-	spin_unlock_irqrestore(&cl->tx_free_list_spinlock, flags);
-
 	spin_lock_irqsave(&cl->tx_list_spinlock, flags);
-	/* release allocated memory - pass over tx_list */
-	while (!list_empty(&cl->tx_list.list)) {
-		tx_buf = list_entry(cl->tx_list.list.next,
-				    struct ishtp_cl_tx_ring, list);
-		list_del(&tx_buf->list);
-		kfree(tx_buf->send_buf.data);
-		kfree(tx_buf);
-	}
+	tx_ring = cl->tx_ring;
+	tx_small_arena = cl->tx_small_arena;
+	tx_large_buf = cl->tx_large_buf;
+	large = cl->tx_large_cnt;
+	cl->tx_ring = NULL;
+	cl->tx_ring_slots = 0;
+	cl->tx_head = 0;
+	cl->tx_tail = 0;
+	cl->tx_offs = 0;
+	cl->sending = 0;
+	cl->tx_small_arena = NULL;
+	cl->tx_large_buf = NULL;
+	cl->tx_large_cnt = 0;
+	cl->tx_large_map = 0;
 	spin_unlock_irqrestore(&cl->tx_list_spinlock, flags);
+
+	/* release allocated memory - slots, then both size classes */
+	kfree(tx_ring);
+	kfree(tx_small_arena);
+	if (tx_large_buf) {
+		for (j = 0; j < large; ++j)
+			kfree(tx_large_buf[j]);
+		kfree(tx_large_buf);
+	}
 }
 
 /**
@@ -222,7 +256,9 @@ int ishtp_io_rb_alloc_buf(struct ishtp_cl_rb *rb, size_t length)
  * ishtp_cl_io_rb_recycle() - Recycle IO request blocks
  * @rb: IO request block
  *
- * Re-append rb to its client's free list and send flow control if needed
+ * Re-append rb to its client's free list and send flow control if needed.
+ * If the rb points into the DMA Rx buffer, the region is handed back to the
+ * firmware first.
  *
  * Return: 0 on success else -EFAULT
  */
@@ -236,6 +272,7 @@ int ishtp_cl_io_rb_recycle(struct ishtp_cl_rb *rb)
 		return	-EFAULT;
 
 	cl = rb->cl;
+	ishtp_cl_dma_rx_release(rb);
 	spin_lock_irqsave(&cl->free_list_spinlock, flags);
 	list_add_tail(&rb->list, &cl->free_rb_list.list);
 	spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
@@ -251,24 +288,60 @@ int ishtp_cl_io_rb_recycle(struct ishtp_cl_rb *rb)
 }
 EXPORT_SYMBOL(ishtp_cl_io_rb_recycle);
 
+/**
+ * ishtp_cl_io_rb_recycle_batch() - Recycle a batch of IO request blocks
+ * @cl: client the rbs belong to
+ * @batch: rbs taken with ishtp_cl_rx_get_batch()
+ *
+ * Like ishtp_cl_io_rb_recycle() for every rb of @batch, but they're put on
+ * the free list at once, and flow control is sent at most once per batch.
+ *
+ * Return: 0 on success else error from sending flow control
+ */
+int ishtp_cl_io_rb_recycle_batch(struct ishtp_cl *cl, struct list_head *batch)
+{
+	struct ishtp_cl_rb *rb;
+	unsigned int	n = 0;
+	unsigned long	flags;
+	int	rets = 0;
+
+	if (list_empty(batch))
+		return	0;
+
+	list_for_each_entry(rb, batch, list) {
+		ishtp_cl_dma_rx_release(rb);
+		++n;
+	}
+
+	spin_lock_irqsave(&cl->free_list_spinlock, flags);
+	list_splice_tail_init(batch, &cl->free_rb_list.list);
+	spin_unlock_irqrestore(&cl->free_list_spinlock, flags);
+
+	ishtp_stats_inc(cl->stats, ISHTP_CL_STAT_RX_BATCH);
+	ishtp_stats_add(cl->stats, ISHTP_CL_STAT_RX_BATCH_MSGS, n);
+	ishtp_stats_add(cl->stats, ISHTP_CL_STAT_RX_BATCH_NS,
+			ktime_to_ns(ktime_sub(ktime_get(),
+					      cl->rx_batch_start)));
+
+	if (!cl->out_flow_ctrl_creds)
+		rets = ishtp_cl_read_start(cl);
+
+	return	rets;
+}
+EXPORT_SYMBOL(ishtp_cl_io_rb_recycle_batch);
+
 /**
  * ishtp_cl_tx_empty() -test whether client device tx buffer is empty
  * @cl: Pointer to client device instance
  *
- * Look client device tx buffer list, and check whether this list is empty
+ * Look client device tx ring, and check whether it has no queued messages.
+ * Slots reserved by a sender that is still copying count as queued.
  *
- * Return: true if client tx buffer list is empty else false
+ * Return: true if client tx ring is empty else false
  */
 bool ishtp_cl_tx_empty(struct ishtp_cl *cl)
 {
-	int tx_list_empty;
-	unsigned long tx_flags;
-
-	spin_lock_irqsave(&cl->tx_list_spinlock, tx_flags);
-	tx_list_empty = list_empty(&cl->tx_list.list);
-	spin_unlock_irqrestore(&cl->tx_list_spinlock, tx_flags);
-
-	return !!tx_list_empty;
+	return READ_ONCE(cl->tx_head) == READ_ONCE(cl->tx_tail);
 }
 EXPORT_SYMBOL(ishtp_cl_tx_empty);
 
@@ -295,3 +368,39 @@ struct ishtp_cl_rb *ishtp_cl_rx_get_rb(struct ishtp_cl *cl)
 	return rb;
 }
 EXPORT_SYMBOL(ishtp_cl_rx_get_rb);
+
+/**
+ * ishtp_cl_rx_get_batch() - Get rbs from client device rx buffer list
+ * @cl: Pointer to client device instance
+ * @batch: Empty list to move the rbs to
+ * @budget: Most rbs to get
+ *
+ * Take the rbs completed so far off the in-processing list in one go, in
+ * order, to be processed and handed back with
+ * ishtp_cl_io_rb_recycle_batch().
+ *
+ * Return: number of rbs moved to @batch
+ */
+unsigned int ishtp_cl_rx_get_batch(struct ishtp_cl *cl,
+				   struct list_head *batch,
+				   unsigned int budget)
+{
+	struct ishtp_cl_rb *rb, *next;
+	unsigned long rx_flags;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&cl->in_process_spinlock, rx_flags);
+	list_for_each_entry_safe(rb, next, &cl->in_process_list.list, list) {
+		if (n == budget)
+			break;
+		list_move_tail(&rb->list, batch);
+		++n;
+	}
+	spin_unlock_irqrestore(&cl->in_process_spinlock, rx_flags);
+
+	if (n)
+		cl->rx_batch_start = ktime_get();
+
+	return n;
+}
+EXPORT_SYMBOL(ishtp_cl_rx_get_batch);
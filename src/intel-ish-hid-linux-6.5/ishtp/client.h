@@ -9,6 +9,7 @@
 #define _ISHTP_CLIENT_H_
 
 #include <linux/types.h>
+#include <linux/average.h>
 #include "ishtp-dev.h"
 
 /* Tx and Rx ring size */
@@ -17,19 +18,69 @@
 #define	CL_MAX_RX_RING_SIZE	32
 #define	CL_MAX_TX_RING_SIZE	32
 
+/* Tx messages up to this size are copied into the slot's own buffer */
+#define	CL_TX_SMALL_MSG_SIZE	256
+/* Number of Tx slots per shared full-size Tx buffer */
+#define	CL_TX_LARGE_RATIO	4
+/* Longest a DMA Rx message is lent to a queued rb before it's copied */
+#define	CL_DMA_RX_HOLD_MS	100
+
 #define DMA_SLOT_SIZE		4096
 /* Number of IPC fragments after which it's worth sending via DMA */
 #define	DMA_WORTH_THRESHOLD	3
+/* Upper bound of the measured DMA_WORTH_THRESHOLD */
+#define	DMA_WORTH_THRESHOLD_MAX	16
+/* One in this many messages is sent over the path it wouldn't take */
+#define	CL_TX_PATH_PROBE_INTERVAL	64
+/* Most DMA_XFER entries that fit in a single HBM message */
+#define	DMA_XFER_BATCH_MAX	(IPC_PAYLOAD_SIZE / sizeof(struct dma_xfer_hbm))
 
 /* DMA/IPC Tx paths. Other the default means enforcement */
 #define	CL_TX_PATH_DEFAULT	0
 #define	CL_TX_PATH_IPC		1
 #define	CL_TX_PATH_DMA		2
 
-/* Client Tx buffer list entry */
+/* Client statistics */
+enum ishtp_cl_stat {
+	ISHTP_CL_STAT_SEND_IPC,
+	ISHTP_CL_STAT_SEND_IPC_BYTES,
+	ISHTP_CL_STAT_SEND_DMA,
+	ISHTP_CL_STAT_SEND_DMA_BYTES,
+	ISHTP_CL_STAT_RECV_IPC,
+	ISHTP_CL_STAT_RECV_DMA,
+	ISHTP_CL_STAT_FC_IN,
+	ISHTP_CL_STAT_FC_OUT,
+	ISHTP_CL_STAT_ERR_SEND_MSG,
+	ISHTP_CL_STAT_ERR_SEND_FC,
+	/* Rx batches, their messages, and ns from taking to recycling them */
+	ISHTP_CL_STAT_RX_BATCH,
+	ISHTP_CL_STAT_RX_BATCH_MSGS,
+	ISHTP_CL_STAT_RX_BATCH_NS,
+	ISHTP_CL_STATS
+};
+
+/* Running average of Tx completion latency, in ns */
+DECLARE_EWMA(cl_tx_lat, 0, 8)
+
+/* Client Tx ring slot */
 struct ishtp_cl_tx_ring {
-	struct list_head	list;
 	struct ishtp_msg_data	send_buf;
+	/* Set by ishtp_cl_send() once send_buf is filled */
+	int			ready;
+	/* CL_TX_PATH_IPC or CL_TX_PATH_DMA */
+	int			path;
+	/* Index of the large buffer borrowed for this message, or -1 */
+	int			large;
+	/* The slot's own buffer, for messages up to tx_small_size */
+	unsigned char		*small_buf;
+};
+
+/* Rx rb lent a region of the DMA Rx buffer */
+struct ishtp_cl_dma_rx {
+	struct ishtp_cl_rb	*rb;	/* NULL if the entry is unused */
+	unsigned char		*data;	/* The rb's own buffer */
+	struct dma_xfer_hbm	xfer;	/* Acked when the rb is recycled */
+	unsigned long		since;	/* jiffies the message was lent at */
 };
 
 /* ISHTP client instance */
@@ -46,6 +97,7 @@ struct ishtp_cl {
 	uint8_t	host_client_id;
 	uint8_t	fw_client_id;
 	uint8_t	ishtp_flow_ctrl_creds;
+	uint8_t	ishtp_flow_ctrl_creds_max;
 	uint8_t	out_flow_ctrl_creds;
 
 	/* dma */
@@ -56,6 +108,23 @@ struct ishtp_cl {
 	/* 0: ack wasn't received,1:ack was received */
 	int	last_ipc_acked;
 
+	/*
+	 * Adaptive Tx path: messages of at least 'dma_worth_frags' IPC
+	 * fragments go over DMA. The threshold follows the average
+	 * completion latency of an IPC fragment and of a DMA message, each
+	 * sampled from one message at a time.
+	 */
+	unsigned int	dma_worth_frags;
+	unsigned int	tx_path_probe;
+	ktime_t		ts_tx;
+	int		ts_tx_path;
+	size_t		ts_tx_size;
+	struct ewma_cl_tx_lat	tx_ipc_frag_ns;
+	struct ewma_cl_tx_lat	tx_dma_msg_ns;
+
+	/* Rx buffers posted for firmware messages */
+	struct ishtp_cl_rb	read_list;
+
 	/* Rx ring buffer pool */
 	unsigned int	rx_ring_size;
 	struct ishtp_cl_rb	free_rb_list;
@@ -63,14 +132,42 @@ struct ishtp_cl {
 	/* Rx in-process list */
 	struct ishtp_cl_rb	in_process_list;
 	spinlock_t	in_process_spinlock;
+	/*
+	 * Zero-copy DMA Rx, CL_MAX_RX_RING_SIZE entries if enabled. Protected
+	 * by 'free_list_spinlock'.
+	 */
+	struct ishtp_cl_dma_rx	*dma_rx_held;
+	/* Copies messages held past CL_DMA_RX_HOLD_MS */
+	struct delayed_work	dma_rx_work;
 
-	/* Client Tx buffers list */
+	/*
+	 * Client Tx ring. Senders reserve slots at 'tx_tail' without locking;
+	 * the Tx path consumes them at 'tx_head' under 'tx_list_spinlock'.
+	 * Both indices run free and are masked with 'tx_ring_slots' - 1.
+	 */
 	unsigned int	tx_ring_size;
-	struct ishtp_cl_tx_ring	tx_list, tx_free_list;
-	int		tx_ring_free_size;
+	struct ishtp_cl_tx_ring	*tx_ring;
+	unsigned int	tx_ring_slots;
+	unsigned int	tx_head;
+	unsigned int	tx_tail;
 	spinlock_t	tx_list_spinlock;
-	spinlock_t	tx_free_list_spinlock;
-	size_t	tx_offs;	/* Offset in buffer at head of 'tx_list' */
+	size_t	tx_offs;	/* Offset in buffer at 'tx_head' */
+	/*
+	 * A context owns the Tx path: it queues IPC fragments or builds DMA
+	 * batches without the lock, so messages go out in ring order
+	 */
+	int	tx_streaming;
+
+	/*
+	 * Tx buffers by size class: every slot has a small buffer carved out
+	 * of 'tx_small_arena', and larger messages borrow one of the
+	 * 'tx_large_cnt' max_msg_length buffers tracked in 'tx_large_map'.
+	 */
+	unsigned char	*tx_small_arena;
+	size_t		tx_small_size;
+	unsigned char	**tx_large_buf;
+	unsigned int	tx_large_cnt;
+	unsigned long	tx_large_map;
 
 	/**
 	 * if we get a FC, and the list is not empty, we must know whether we
@@ -88,30 +185,31 @@ struct ishtp_cl {
 	/* wait queue for connect and disconnect response from FW */
 	wait_queue_head_t	wait_ctrl_res;
 
-	/* Error stats */
-	unsigned int	err_send_msg;
-	unsigned int	err_send_fc;
-
-	/* Send/recv stats */
-	unsigned int	send_msg_cnt_ipc;
-	unsigned int	send_msg_cnt_dma;
-	unsigned int	recv_msg_cnt_ipc;
-	unsigned int	recv_msg_cnt_dma;
+	/* Send/recv and error stats, ISHTP_CL_STAT_* */
+	struct ishtp_stats __percpu	*stats;
+	/* Fragments of the message being received */
 	unsigned int	recv_msg_num_frags;
-	unsigned int	ishtp_flow_ctrl_cnt;
-	unsigned int	out_flow_ctrl_cnt;
 
 	/* Rx msg ... out FC timing */
 	ktime_t ts_rx;
+	/* When the Rx batch being processed was taken */
+	ktime_t rx_batch_start;
 	ktime_t ts_out_fc;
 	ktime_t ts_max_fc_delay;
 	void *client_data;
 };
 
+/* Structure layout check for modules built against these headers */
+int ishtp_check_layout(size_t dev_size, size_t cl_size);
+
 /* Client connection managenment internal functions */
 int ishtp_can_client_connect(struct ishtp_device *ishtp_dev, guid_t *uuid);
 int ishtp_fw_cl_by_id(struct ishtp_device *dev, uint8_t client_id);
 void ishtp_cl_send_msg(struct ishtp_device *dev, struct ishtp_cl *cl);
+void ishtp_cl_tx_resume(struct ishtp_device *dev);
+void ishtp_cl_tx_sample_end(struct ishtp_cl *cl, int path);
+struct ishtp_cl *ishtp_cl_by_id(struct ishtp_device *dev,
+				uint8_t host_client_id, uint8_t fw_client_id);
 void recv_ishtp_cl_msg(struct ishtp_device *dev,
 		       struct ishtp_msg_hdr *ishtp_hdr);
 int ishtp_cl_read_start(struct ishtp_cl *cl);
@@ -125,15 +223,22 @@ int ishtp_cl_get_tx_free_buffer_size(struct ishtp_cl *cl);
 int ishtp_cl_get_tx_free_rings(struct ishtp_cl *cl);
 
 /* DMA I/F functions */
-void recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
+bool recv_ishtp_cl_msg_dma(struct ishtp_device *dev, void *msg,
 			   struct dma_xfer_hbm *hbm);
-void ishtp_cl_alloc_dma_buf(struct ishtp_device *dev);
+int ishtp_cl_enable_dma_rx_zero_copy(struct ishtp_cl *cl);
+int ishtp_cl_dma_rx_unpin(struct ishtp_cl_rb *rb);
+void ishtp_cl_dma_rx_release(struct ishtp_cl_rb *rb);
+void ishtp_cl_dma_rx_drop(struct ishtp_cl_rb *rb);
+void ishtp_cl_dma_rx_drop_all(struct ishtp_cl *cl);
+void ishtp_cl_alloc_dma_rx_buf(struct ishtp_device *dev);
+void ishtp_cl_grow_dma_tx_buf(struct ishtp_device *dev);
+void ishtp_cl_dma_tx_grow_work_fn(struct work_struct *work);
 void ishtp_cl_free_dma_buf(struct ishtp_device *dev);
 void *ishtp_cl_get_dma_send_buf(struct ishtp_device *dev,
 				uint32_t size);
 void ishtp_cl_release_dma_acked_mem(struct ishtp_device *dev,
 				    void *msg_addr,
-				    uint8_t size);
+				    uint32_t size);
 
 /* Request blocks alloc/free I/F */
 struct ishtp_cl_rb *ishtp_io_rb_init(struct ishtp_cl *cl);
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ISHTP debugfs interface
+ *
+ * Exposes per-device Tx path, statistics, IPC write queue, bring-up state
+ * and firmware clock correlation under /sys/kernel/debug/ishtp/<device>/
+ */
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "bus.h"
+#include "client.h"
+
+static struct dentry *ishtp_debugfs_root;
+
+/**
+ * ishtp_stats_read() - Sum up a statistics counter over all CPUs
+ * @stats: per-CPU statistics
+ * @idx: counter
+ *
+ * Return: the counter value
+ */
+static u64 ishtp_stats_read(struct ishtp_stats __percpu *stats, int idx)
+{
+	const struct ishtp_stats *s;
+	unsigned int start;
+	u64 sum = 0, val;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&s->syncp);
+			val = u64_stats_read(&s->cnt[idx]);
+		} while (u64_stats_fetch_retry(&s->syncp, start));
+		sum += val;
+	}
+
+	return sum;
+}
+
+static const char *ishtp_tx_path_str(int path)
+{
+	switch (path) {
+	case CL_TX_PATH_IPC:
+		return "ipc";
+	case CL_TX_PATH_DMA:
+		return "dma";
+	default:
+		return "adaptive";
+	}
+}
+
+/**
+ * tx_path_show() - Show the Tx path state of every linked client
+ * @s: seq_file
+ * @unused: unused
+ *
+ * Return: 0
+ */
+static int tx_path_show(struct seq_file *s, void *unused)
+{
+	struct ishtp_device *dev = s->private;
+	struct ishtp_cl *cl;
+	unsigned long flags;
+
+	seq_printf(s, "transfer_path: %s\n",
+		   ishtp_tx_path_str(dev->transfer_path));
+	seq_printf(s, "dma: %s\n",
+		   dev->ishtp_host_dma_enabled && dev->ishtp_host_dma_tx_buf ?
+		   "enabled" : "disabled");
+	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
+	seq_printf(s, "dma_tx_buf: %u bytes, %u/%d slots used, max %u\n",
+		   dev->ishtp_host_dma_tx_buf_size, dev->ishtp_dma_tx_used,
+		   dev->ishtp_dma_num_slots, dev->ishtp_dma_tx_used_max);
+	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+	seq_printf(s, "dma_rx_buf: %u bytes\n",
+		   dev->ishtp_host_dma_rx_buf_size);
+	seq_puts(s, "host fw worth_frags ipc_frag_ns dma_msg_ns ipc_msgs ipc_bytes dma_msgs dma_bytes\n");
+
+	spin_lock_irqsave(&dev->cl_list_lock, flags);
+	list_for_each_entry(cl, &dev->cl_list, link)
+		seq_printf(s, "%4u %2u %11u %11lu %10lu %8llu %9llu %8llu %9llu\n",
+			   cl->host_client_id, cl->fw_client_id,
+			   READ_ONCE(cl->dma_worth_frags),
+			   ewma_cl_tx_lat_read(&cl->tx_ipc_frag_ns),
+			   ewma_cl_tx_lat_read(&cl->tx_dma_msg_ns),
+			   ishtp_stats_read(cl->stats, ISHTP_CL_STAT_SEND_IPC),
+			   ishtp_stats_read(cl->stats,
+					    ISHTP_CL_STAT_SEND_IPC_BYTES),
+			   ishtp_stats_read(cl->stats, ISHTP_CL_STAT_SEND_DMA),
+			   ishtp_stats_read(cl->stats,
+					    ISHTP_CL_STAT_SEND_DMA_BYTES));
+	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tx_path);
+
+/**
+ * stats_show() - Show the device counters, and those of every linked client
+ * @s: seq_file
+ * @unused: unused
+ *
+ * Return: 0
+ */
+static int stats_show(struct seq_file *s, void *unused)
+{
+	static const char * const dev_names[ISHTP_DEV_STATS] = {
+		"ipc_rx", "ipc_rx_bytes", "ipc_tx", "ipc_tx_bytes"
+	};
+	struct ishtp_device *dev = s->private;
+	struct ishtp_cl *cl;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < ISHTP_DEV_STATS; i++)
+		seq_printf(s, "%s: %llu\n", dev_names[i],
+			   ishtp_stats_read(dev->stats, i));
+
+	spin_lock_irqsave(&dev->ishtp_dma_tx_lock, flags);
+	seq_printf(s, "dma_tx_alloc: %u\ndma_tx_alloc_fail: %u\ndma_tx_frag_fail: %u\n",
+		   dev->dma_tx_alloc_cnt, dev->dma_tx_alloc_fail_cnt,
+		   dev->dma_tx_frag_fail_cnt);
+	spin_unlock_irqrestore(&dev->ishtp_dma_tx_lock, flags);
+
+	seq_puts(s, "host fw send_ipc ipc_bytes send_dma dma_bytes recv_ipc recv_dma fc_in fc_out err_msg err_fc rx_batch rx_batch_msgs rx_batch_ns\n");
+
+	spin_lock_irqsave(&dev->cl_list_lock, flags);
+	list_for_each_entry(cl, &dev->cl_list, link) {
+		seq_printf(s, "%4u %2u", cl->host_client_id,
+			   cl->fw_client_id);
+		for (i = 0; i < ISHTP_CL_STATS; i++)
+			seq_printf(s, " %llu", ishtp_stats_read(cl->stats, i));
+		seq_putc(s, '\n');
+	}
+	spin_unlock_irqrestore(&dev->cl_list_lock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/**
+ * ipc_queue_show() - Show the occupancy of the IPC write queue lanes
+ * @s: seq_file
+ * @unused: unused
+ *
+ * Return: 0
+ */
+static int ipc_queue_show(struct seq_file *s, void *unused)
+{
+	static const char * const names[ISHTP_WR_LANES] = { "ctrl", "bulk" };
+	struct ishtp_device *dev = s->private;
+	struct ishtp_wr_lane *lane;
+	unsigned long flags;
+	int i;
+
+	seq_puts(s, "lane size depth max_depth full\n");
+
+	spin_lock_irqsave(&dev->wr_processing_spinlock, flags);
+	for (i = 0; i < ISHTP_WR_LANES; i++) {
+		lane = &dev->wr_lanes[i];
+		seq_printf(s, "%-4s %4u %5u %9u %4u\n", names[i], lane->size,
+			   lane->tail - lane->head, lane->max_depth,
+			   lane->full_cnt);
+	}
+	spin_unlock_irqrestore(&dev->wr_processing_spinlock, flags);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ipc_queue);
+
+/**
+ * hbm_bringup_show() - Show how long each HBM bring-up phase took
+ * @s: seq_file
+ * @unused: unused
+ *
+ * Return: 0
+ */
+static int hbm_bringup_show(struct seq_file *s, void *unused)
+{
+	static const char * const names[ISHTP_HBM_PHASES] = {
+		"start", "enum", "props"
+	};
+	struct ishtp_device *dev = s->private;
+	int i;
+
+	seq_printf(s, "clients: %u\n", dev->fw_client_presentation_num);
+	for (i = 0; i < ISHTP_HBM_PHASES; i++)
+		seq_printf(s, "%s_us: %lld\n", names[i], dev->hbm_phase_us[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hbm_bringup);
+
+/**
+ * fw_clock_show() - Show the firmware clock correlation
+ * @s: seq_file
+ * @unused: unused
+ *
+ * Return: 0
+ */
+static int fw_clock_show(struct seq_file *s, void *unused)
+{
+	struct ishtp_device *dev = s->private;
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+	unsigned int seq, syncs, observations;
+	u32 sync_err, drift_err, err_ns;
+	bool valid, drift_valid;
+	ktime_t anchor, host;
+	s32 drift;
+	u64 fw_us;
+
+	do {
+		seq = read_seqbegin(&clk->lock);
+		valid = clk->valid;
+		fw_us = clk->fw_us;
+		anchor = clk->host;
+		sync_err = clk->sync_err_ns;
+		drift = clk->drift_ppb;
+		drift_err = clk->drift_err_ppb;
+		drift_valid = clk->drift_valid;
+		syncs = clk->sync_cnt;
+		observations = clk->observe_cnt;
+	} while (read_seqretry(&clk->lock, seq));
+
+	seq_printf(s, "synced: %s\nsyncs: %u\nobservations: %u\n",
+		   valid ? "yes" : "no", syncs, observations);
+	seq_printf(s, "fw_us: %llu\nhost_ns: %lld\nsync_err_ns: %u\n",
+		   fw_us, ktime_to_ns(anchor), sync_err);
+	seq_printf(s, "drift_ppb: %d%s\ndrift_err_ppb: %u\n", drift,
+		   drift_valid ? "" : " (assumed)", drift_err);
+
+	/* Error bound of converting a firmware time of now */
+	if (!ishtp_fw_clock_to_host(dev, ktime_to_us(ktime_get_boottime()),
+				    &host, &err_ns))
+		seq_printf(s, "err_now_ns: %u\n", err_ns);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fw_clock);
+
+/**
+ * ishtp_debugfs_dev_init() - Create the debugfs entries of a device
+ * @dev: ishtp device
+ */
+void ishtp_debugfs_dev_init(struct ishtp_device *dev)
+{
+	dev->debugfs_dir = debugfs_create_dir(dev_name(dev->devc),
+					      ishtp_debugfs_root);
+	debugfs_create_file("tx_path", 0444, dev->debugfs_dir, dev,
+			    &tx_path_fops);
+	debugfs_create_file("ipc_queue", 0444, dev->debugfs_dir, dev,
+			    &ipc_queue_fops);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev,
+			    &stats_fops);
+	debugfs_create_file("hbm_bringup", 0444, dev->debugfs_dir, dev,
+			    &hbm_bringup_fops);
+	debugfs_create_file("fw_clock", 0444, dev->debugfs_dir, dev,
+			    &fw_clock_fops);
+}
+
+/**
+ * ishtp_debugfs_dev_exit() - Remove the debugfs entries of a device
+ * @dev: ishtp device
+ */
+void ishtp_debugfs_dev_exit(struct ishtp_device *dev)
+{
+	debugfs_remove_recursive(dev->debugfs_dir);
+	dev->debugfs_dir = NULL;
+}
+
+/**
+ * ishtp_debugfs_init() - Create the ishtp debugfs directory
+ */
+void ishtp_debugfs_init(void)
+{
+	ishtp_debugfs_root = debugfs_create_dir("ishtp", NULL);
+}
+
+/**
+ * ishtp_debugfs_exit() - Remove the ishtp debugfs directory
+ */
+void ishtp_debugfs_exit(void)
+{
+	debugfs_remove_recursive(ishtp_debugfs_root);
+	ishtp_debugfs_root = NULL;
+}
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ISHTP firmware clock correlation
+ *
+ * Maps firmware timestamps to CLOCK_MONOTONIC. The firmware clock is set
+ * to the host boottime at every MNG_SYNC_FW_CLOCK and runs free until the
+ * next one, so a firmware time converts from the last sync, corrected by
+ * the estimated rate difference of the two clocks.
+ *
+ * The rate is estimated from firmware timestamps that clients observe
+ * together with the time they were received. A message can't be received
+ * before it was stamped, and the lowest delay over a window is close to
+ * the fixed part of the delivery latency; the rate follows from how the
+ * lowest delay moves between early and late in a sync period.
+ */
+
+#include <linux/export.h>
+#include <linux/math64.h>
+#include "ishtp-dev.h"
+
+/* Crystal tolerance assumed until the rate is measured */
+#define FW_CLOCK_DRIFT_MAX_PPB		100000
+/* Lower bound of the measured rate uncertainty */
+#define FW_CLOCK_DRIFT_ERR_MIN_PPB	1000
+/* Observations before this firmware clock age are "early" */
+#define FW_CLOCK_SPLIT_NS		(10 * NSEC_PER_SEC)
+/* Least time between the early and late observation to measure the rate */
+#define FW_CLOCK_MIN_SPAN_NS		(5 * NSEC_PER_SEC)
+/* Firmware times further than this from the last sync aren't converted */
+#define FW_CLOCK_MAX_AGE_US		(3600ULL * USEC_PER_SEC)
+
+static void fw_clock_clear_delays(struct ishtp_fw_clock *clk)
+{
+	clk->min_delay_ns[0] = S64_MAX;
+	clk->min_delay_ns[1] = S64_MAX;
+}
+
+/**
+ * fw_clock_update_drift() - Update the rate estimate at the end of a period
+ * @clk: firmware clock, write locked
+ *
+ * A firmware clock that runs fast makes messages look delivered sooner the
+ * longer ago the sync was, by the rate difference times the age.
+ */
+static void fw_clock_update_drift(struct ishtp_fw_clock *clk)
+{
+	s64 span = clk->min_delay_age_ns[1] - clk->min_delay_age_ns[0];
+	s64 diff, ppb;
+	u32 dev_ppb;
+
+	if (clk->min_delay_ns[0] == S64_MAX ||
+	    clk->min_delay_ns[1] == S64_MAX || span < FW_CLOCK_MIN_SPAN_NS)
+		return;
+
+	diff = clamp_t(s64, clk->min_delay_ns[0] - clk->min_delay_ns[1],
+		       S32_MIN, S32_MAX);
+	ppb = div64_s64(diff * NSEC_PER_SEC, span);
+	ppb = clamp_t(s64, ppb, -FW_CLOCK_DRIFT_MAX_PPB,
+		      FW_CLOCK_DRIFT_MAX_PPB);
+
+	if (!clk->drift_valid) {
+		clk->drift_ppb = ppb;
+		clk->drift_valid = true;
+		return;
+	}
+
+	/* The spread of consecutive estimates gives their uncertainty */
+	dev_ppb = abs(ppb - clk->drift_ppb);
+	clk->drift_ppb += div_s64(ppb - clk->drift_ppb, 4);
+	clk->drift_err_ppb = clamp_t(u32, (3 * clk->drift_err_ppb +
+					   2 * dev_ppb) / 4,
+				     FW_CLOCK_DRIFT_ERR_MIN_PPB,
+				     FW_CLOCK_DRIFT_MAX_PPB);
+}
+
+/**
+ * ishtp_fw_clock_init() - Initialize the firmware clock correlation
+ * @dev: ishtp device
+ */
+void ishtp_fw_clock_init(struct ishtp_device *dev)
+{
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+
+	seqlock_init(&clk->lock);
+	clk->drift_err_ppb = FW_CLOCK_DRIFT_MAX_PPB;
+	fw_clock_clear_delays(clk);
+}
+
+/**
+ * ishtp_fw_clock_reset() - Forget the last sync
+ * @dev: ishtp device
+ *
+ * Called when the firmware clock, or CLOCK_MONOTONIC against boottime,
+ * may have moved since the last sync: on firmware reset and on resume.
+ * Firmware times can't be converted until the next sync, which is sent
+ * with the next message received. The rate estimate is kept.
+ */
+void ishtp_fw_clock_reset(struct ishtp_device *dev)
+{
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+	unsigned long flags;
+
+	write_seqlock_irqsave(&clk->lock, flags);
+	clk->valid = false;
+	clk->sync_jiffies = 0;
+	fw_clock_clear_delays(clk);
+	write_sequnlock_irqrestore(&clk->lock, flags);
+}
+EXPORT_SYMBOL(ishtp_fw_clock_reset);
+
+/**
+ * ishtp_fw_clock_sync() - Record a firmware clock sync
+ * @dev: ishtp device
+ * @fw_us: boottime the firmware clock was set to, in us
+ * @start: CLOCK_MONOTONIC at the same instant as @fw_us
+ * @end: CLOCK_MONOTONIC once the sync message was written
+ *
+ * The firmware sets its clock while the message is written; the middle
+ * of the write is taken as the time it did, give or take half of it.
+ */
+void ishtp_fw_clock_sync(struct ishtp_device *dev, u64 fw_us,
+			 ktime_t start, ktime_t end)
+{
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+	s64 half = ktime_to_ns(ktime_sub(end, start)) / 2;
+	unsigned long flags;
+
+	write_seqlock_irqsave(&clk->lock, flags);
+	if (clk->valid)
+		fw_clock_update_drift(clk);
+	fw_clock_clear_delays(clk);
+	clk->fw_us = fw_us;
+	clk->host = ktime_add_ns(start, half);
+	clk->sync_err_ns = min_t(s64, half, U32_MAX);
+	clk->valid = true;
+	clk->sync_cnt++;
+	write_sequnlock_irqrestore(&clk->lock, flags);
+}
+EXPORT_SYMBOL(ishtp_fw_clock_sync);
+
+/**
+ * ishtp_fw_clock_observe() - Feed a received firmware timestamp
+ * @dev: ishtp device
+ * @fw_us: firmware timestamp carried by a message
+ * @rx: CLOCK_MONOTONIC the message was received at
+ *
+ * Clients call this for messages stamped by the firmware, as early in
+ * their Rx path as they can, so the rate of the firmware clock can be
+ * measured.
+ */
+void ishtp_fw_clock_observe(struct ishtp_device *dev, u64 fw_us, ktime_t rx)
+{
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+	unsigned long flags;
+	s64 age, delay;
+	int i;
+
+	write_seqlock_irqsave(&clk->lock, flags);
+	if (!clk->valid || fw_us < clk->fw_us ||
+	    fw_us - clk->fw_us > FW_CLOCK_MAX_AGE_US)
+		goto out;
+
+	age = (fw_us - clk->fw_us) * NSEC_PER_USEC;
+	delay = ktime_to_ns(ktime_sub(rx, clk->host)) - age;
+	i = age >= FW_CLOCK_SPLIT_NS;
+	if (delay < clk->min_delay_ns[i]) {
+		clk->min_delay_ns[i] = delay;
+		clk->min_delay_age_ns[i] = age;
+	}
+	clk->observe_cnt++;
+out:
+	write_sequnlock_irqrestore(&clk->lock, flags);
+}
+EXPORT_SYMBOL(ishtp_fw_clock_observe);
+
+/**
+ * ishtp_fw_clock_to_host() - Convert a firmware timestamp to host time
+ * @dev: ishtp device
+ * @fw_us: firmware timestamp
+ * @host: CLOCK_MONOTONIC time of @fw_us
+ * @err_ns: if not NULL, bound of the conversion error
+ *
+ * The error bound covers the sync write, the us resolution of both clocks
+ * and the rate uncertainty over the time since the sync. It doesn't cover
+ * the firmware's own latency in applying a sync.
+ *
+ * Return: 0 on success, -EAGAIN if the clock wasn't synced since the last
+ * reset or resume, -ERANGE if @fw_us is too far from the last sync
+ */
+int ishtp_fw_clock_to_host(struct ishtp_device *dev, u64 fw_us,
+			   ktime_t *host, u32 *err_ns)
+{
+	struct ishtp_fw_clock *clk = &dev->fw_clock;
+	u32 sync_err, drift_err;
+	unsigned int seq;
+	ktime_t anchor;
+	s64 age, drift;
+	bool valid;
+
+	do {
+		seq = read_seqbegin(&clk->lock);
+		valid = clk->valid;
+		age = fw_us - clk->fw_us;
+		anchor = clk->host;
+		sync_err = clk->sync_err_ns;
+		drift = clk->drift_ppb;
+		drift_err = clk->drift_err_ppb;
+	} while (read_seqretry(&clk->lock, seq));
+
+	if (!valid)
+		return -EAGAIN;
+	if (abs(age) > FW_CLOCK_MAX_AGE_US)
+		return -ERANGE;
+
+	age *= NSEC_PER_USEC;
+	*host = ktime_add(anchor,
+			  ns_to_ktime(age - div_s64(age * drift, NSEC_PER_SEC)));
+	if (err_ns)
+		*err_ns = sync_err + 2 * NSEC_PER_USEC +
+			  div_u64(abs(age) * drift_err, NSEC_PER_SEC);
+
+	return 0;
+}
+EXPORT_SYMBOL(ishtp_fw_clock_to_host);
@@ -65,8 +65,12 @@ void ishtp_device_init(struct ishtp_device *dev)
 	spin_lock_init(&dev->cl_list_lock);
 	spin_lock_init(&dev->fw_clients_lock);
 	INIT_WORK(&dev->bh_hbm_work, bh_hbm_work_fn);
+	spin_lock_init(&dev->ishtp_dma_tx_lock);
+	INIT_WORK(&dev->ishtp_dma_tx_grow_work, ishtp_cl_dma_tx_grow_work_fn);
+	ishtp_fw_clock_init(dev);
 
 	bitmap_zero(dev->host_clients_map, ISHTP_CLIENTS_MAX);
+	bitmap_zero(dev->ipc_tx_wait_map, ISHTP_CLIENTS_MAX);
 	dev->open_handle_count = 0;
 
 	/*
@@ -74,7 +78,7 @@ void ishtp_device_init(struct ishtp_device *dev)
 	 */
 	bitmap_set(dev->host_clients_map, 0, 1);
 
-	INIT_LIST_HEAD(&dev->read_list.list);
+	hash_init(dev->fw_clients_uuid_hash);
 
 }
 EXPORT_SYMBOL(ishtp_device_init);
@@ -97,6 +101,8 @@ int ishtp_start(struct ishtp_device *dev)
 	/* suspend & resume notification - send QUERY_SUBSCRIBERS msg */
 	ishtp_query_subscribers(dev);
 
+	ishtp_debugfs_dev_init(dev);
+
 	return 0;
 err:
 	dev_err(dev->devc, "link layer initialization failed.\n");
@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ISHTP tracepoints
+ */
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/* Emitted by the IPC driver */
+EXPORT_TRACEPOINT_SYMBOL_GPL(ishtp_ipc_tx);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ishtp_ipc_rx);
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * ISHTP tracepoints
+ *
+ * Binary records of the IPC, HBM, flow control, DMA and client message
+ * events, cheap enough to leave on while measuring latency. Every record
+ * is timestamped by the trace clock; examples/ishtp-latency.py in the PSE
+ * driver pairs them up into per-message latencies.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ishtp
+
+#if !defined(_ISHTP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _ISHTP_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* IPC doorbell, and the ISHTP fragment header for ISHTP protocol messages */
+DECLARE_EVENT_CLASS(ishtp_ipc_class,
+	TP_PROTO(u32 doorbell, u32 hdr),
+	TP_ARGS(doorbell, hdr),
+
+	TP_STRUCT__entry(
+		__field(u32, doorbell)
+		__field(u32, hdr)
+	),
+
+	TP_fast_assign(
+		__entry->doorbell = doorbell;
+		__entry->hdr = hdr;
+	),
+
+	TP_printk("proto=%u len=%u fw=%u host=%u frag_len=%u complete=%u",
+		  (__entry->doorbell >> 10) & 0xf, __entry->doorbell & 0x3ff,
+		  __entry->hdr & 0xff, (__entry->hdr >> 8) & 0xff,
+		  (__entry->hdr >> 16) & 0x1ff, __entry->hdr >> 31)
+);
+
+DEFINE_EVENT(ishtp_ipc_class, ishtp_ipc_tx,
+	TP_PROTO(u32 doorbell, u32 hdr),
+	TP_ARGS(doorbell, hdr)
+);
+
+DEFINE_EVENT(ishtp_ipc_class, ishtp_ipc_rx,
+	TP_PROTO(u32 doorbell, u32 hdr),
+	TP_ARGS(doorbell, hdr)
+);
+
+/* HBM (bus message) command */
+DECLARE_EVENT_CLASS(ishtp_hbm_class,
+	TP_PROTO(u8 cmd, u16 length),
+	TP_ARGS(cmd, length),
+
+	TP_STRUCT__entry(
+		__field(u8, cmd)
+		__field(u16, length)
+	),
+
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->length = length;
+	),
+
+	TP_printk("cmd=0x%02x len=%u", __entry->cmd, __entry->length)
+);
+
+DEFINE_EVENT(ishtp_hbm_class, ishtp_hbm_tx,
+	TP_PROTO(u8 cmd, u16 length),
+	TP_ARGS(cmd, length)
+);
+
+DEFINE_EVENT(ishtp_hbm_class, ishtp_hbm_rx,
+	TP_PROTO(u8 cmd, u16 length),
+	TP_ARGS(cmd, length)
+);
+
+/* Flow control credit, and the credits the client holds afterwards */
+DECLARE_EVENT_CLASS(ishtp_fc_class,
+	TP_PROTO(u8 host, u8 fw, u8 creds),
+	TP_ARGS(host, fw, creds),
+
+	TP_STRUCT__entry(
+		__field(u8, host)
+		__field(u8, fw)
+		__field(u8, creds)
+	),
+
+	TP_fast_assign(
+		__entry->host = host;
+		__entry->fw = fw;
+		__entry->creds = creds;
+	),
+
+	TP_printk("host=%u fw=%u creds=%u",
+		  __entry->host, __entry->fw, __entry->creds)
+);
+
+DEFINE_EVENT(ishtp_fc_class, ishtp_fc_in,
+	TP_PROTO(u8 host, u8 fw, u8 creds),
+	TP_ARGS(host, fw, creds)
+);
+
+DEFINE_EVENT(ishtp_fc_class, ishtp_fc_out,
+	TP_PROTO(u8 host, u8 fw, u8 creds),
+	TP_ARGS(host, fw, creds)
+);
+
+/* Message in a DMA buffer, at an offset from its start */
+DECLARE_EVENT_CLASS(ishtp_dma_class,
+	TP_PROTO(u8 host, u8 fw, u32 offset, u32 length),
+	TP_ARGS(host, fw, offset, length),
+
+	TP_STRUCT__entry(
+		__field(u8, host)
+		__field(u8, fw)
+		__field(u32, offset)
+		__field(u32, length)
+	),
+
+	TP_fast_assign(
+		__entry->host = host;
+		__entry->fw = fw;
+		__entry->offset = offset;
+		__entry->length = length;
+	),
+
+	TP_printk("host=%u fw=%u offset=0x%x len=%u", __entry->host,
+		  __entry->fw, __entry->offset, __entry->length)
+);
+
+/* Tx slots were allocated, and the message announced */
+DEFINE_EVENT(ishtp_dma_class, ishtp_dma_tx,
+	TP_PROTO(u8 host, u8 fw, u32 offset, u32 length),
+	TP_ARGS(host, fw, offset, length)
+);
+
+/* The firmware acked a message, and its Tx slots were freed */
+DEFINE_EVENT(ishtp_dma_class, ishtp_dma_tx_ack,
+	TP_PROTO(u8 host, u8 fw, u32 offset, u32 length),
+	TP_ARGS(host, fw, offset, length)
+);
+
+DEFINE_EVENT(ishtp_dma_class, ishtp_dma_rx,
+	TP_PROTO(u8 host, u8 fw, u32 offset, u32 length),
+	TP_ARGS(host, fw, offset, length)
+);
+
+/* Client message, as queued by or completed to the client driver */
+DECLARE_EVENT_CLASS(ishtp_cl_msg_class,
+	TP_PROTO(u8 host, u8 fw, u32 length),
+	TP_ARGS(host, fw, length),
+
+	TP_STRUCT__entry(
+		__field(u8, host)
+		__field(u8, fw)
+		__field(u32, length)
+	),
+
+	TP_fast_assign(
+		__entry->host = host;
+		__entry->fw = fw;
+		__entry->length = length;
+	),
+
+	TP_printk("host=%u fw=%u len=%u",
+		  __entry->host, __entry->fw, __entry->length)
+);
+
+DEFINE_EVENT(ishtp_cl_msg_class, ishtp_cl_send,
+	TP_PROTO(u8 host, u8 fw, u32 length),
+	TP_ARGS(host, fw, length)
+);
+
+DEFINE_EVENT(ishtp_cl_msg_class, ishtp_cl_rx_complete,
+	TP_PROTO(u8 host, u8 fw, u32 length),
+	TP_ARGS(host, fw, length)
+);
+
+#endif /* _ISHTP_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
@@ -7,6 +7,8 @@
 #include <linux/delay.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/intel-ish-client-if.h>
 #include <linux/mod_devicetable.h>
@@ -20,6 +22,7 @@ MODULE_LICENSE("GPL");
 #define WAIT_FOR_SEND_COUNT 10
 #define WAIT_FOR_SEND_MS 100
 #define WAIT_FOR_READ_MS 1000
+#define WAIT_FOR_RESPONSE_MS 1000
 
 /// HECI CLIENT IDENTIFIER
 /// SMHI client UUID: bb579a2e-cc54-4450-b1d0-5e7520dcad25
@@ -37,14 +40,49 @@ static const uuid_le pse_smhi_guid = UUID_LE(
 /// @wait_exception: Set if an error occurs while waiting for a read event
 /// @wq_head: The wait queue head; used while waiting for a read interrupt
 /// @rb: Actual data buffer for the read
+/// @unpin_work: Copies @rb out of the DMA Rx buffer if it isn't read in time
 struct pse_read_buffer {
     struct mutex lock;
     bool wait_exception;
     struct work_struct work;
+    struct delayed_work unpin_work;
     wait_queue_head_t wq_head;
     struct ishtp_cl_rb *rb;
 };
 
+/// Registered handler for unsolicited firmware messages
+struct pse_notifier {
+    pse_notify_fn fn;
+    void *priv;
+};
+
+/// In-kernel connection used by the PSE peripheral drivers
+///
+/// @cl: Dedicated ISHTP client, connected alongside the /dev/pse client
+/// @lock: Serializes commands; only one request may be outstanding
+/// @rx_lock: Held while the Rx path drains @cl, so it can't be freed under it
+/// @resp_lock: Protects the pending request and response storage
+/// @done: Signalled once the response to @pending arrives
+/// @pending: Command id of the outstanding request (0 when idle)
+/// @aborted: Set when the connection is torn down under a waiting command
+/// @resp_header: The last matched response header
+/// @resp_body: The last matched response body (valid if has_next)
+/// @notifiers: Per-command handlers for unsolicited messages
+/// @work: Connects @cl outside of the bus probe/reset path
+struct pse_kclient {
+    struct ishtp_cl *cl;
+    struct mutex lock;
+    struct mutex rx_lock;
+    spinlock_t resp_lock;
+    struct completion done;
+    u8 pending;
+    bool aborted;
+    struct heci_header resp_header;
+    struct heci_body resp_body;
+    struct pse_notifier notifiers[kHECI_COMMAND_LAST];
+    struct work_struct work;
+};
+
 /// Struct that manages the state of the pse device
 ///
 /// @chrdev: Tracks the chardev MAJOR/MINOR
@@ -53,6 +91,7 @@ struct pse_read_buffer {
 /// @ishtp_cl: Client transaction state management, allocated during chardev open
 /// @ishtp_cl_device: The core ishtp device pointer, captured during probing
 /// @pse_rb: The buffer for handling read requests and interrupts
+/// @kclient: The in-kernel connection shared by the peripheral drivers
 struct pse_device {
     dev_t chrdev;
     struct cdev cdev;
@@ -60,6 +99,7 @@ struct pse_device {
     struct ishtp_cl *cl;
     struct ishtp_cl_device *cl_device;
     struct pse_read_buffer pse_rb;
+    struct pse_kclient kclient;
 };
 
 static struct pse_device pse_dev;
@@ -85,6 +125,25 @@ static inline int uuid_le_cmp_g(const guid_t u1, const guid_t u2)
 	return memcmp(&u1, &u2, sizeof(guid_t));
 }
 
+/// Give the parked read buffer back to its cl; pse_rb.lock must be held
+static void pse_rb_drop(void) {
+    if (pse_dev.pse_rb.rb) {
+        ishtp_cl_io_rb_recycle(pse_dev.pse_rb.rb);
+        pse_dev.pse_rb.rb = NULL;
+    }
+}
+
+/// Copy a response userspace hasn't read in time out of the DMA Rx buffer
+static void pse_rb_unpin_work(struct work_struct *work) {
+    mutex_lock(&pse_dev.pse_rb.lock);
+
+    if (pse_dev.pse_rb.rb) {
+        ishtp_cl_dma_rx_unpin(pse_dev.pse_rb.rb);
+    }
+
+    mutex_unlock(&pse_dev.pse_rb.lock);
+}
+
 /// Manage a userspace request to open the pse chardev
 static int ishtp_pse_open(struct inode *inode, struct file *file) {
     int ret;
@@ -107,10 +166,29 @@ static int ishtp_pse_open(struct inode *inode, struct file *file) {
         return -ENOMEM;
     }
 
+    // Let read() copy DMA-received responses straight to userspace
+    ret = ishtp_cl_enable_dma_rx_zero_copy(pse_dev.cl);
+    if (ret) {
+        pr_err("Failed to enable zero-copy DMA Rx\n");
+        ishtp_cl_free(pse_dev.cl);
+        pse_dev.cl = NULL;
+        return ret;
+    }
+
     ret = ishtp_cl_link(pse_dev.cl);
     if (ret) {
         pr_err("Failed to the link the ishtp cl\n");
-        kfree(pse_dev.cl);
+        ishtp_cl_free(pse_dev.cl);
+        pse_dev.cl = NULL;
+        return ret;
+    }
+
+    ret = pse_poll_open(file);
+    if (ret) {
+        pr_err("Failed to allocate the standing query session\n");
+        ishtp_cl_unlink(pse_dev.cl);
+        ishtp_cl_free(pse_dev.cl);
+        pse_dev.cl = NULL;
         return ret;
     }
 
@@ -214,6 +292,9 @@ static ssize_t ishtp_pse_write(struct file *file, const char __user *ubuf, size_
         return PTR_ERR(write_buf);
     }
 
+    // Remember the request so its response can update the state page
+    pse_state_user_request(write_buf, length);
+
     ret = ishtp_cl_send(pse_dev.cl, write_buf, length);
 
     kfree(write_buf);
@@ -226,6 +307,9 @@ static int ishtp_pse_release(struct inode *inode, struct file *file) {
     int ret = 0;
     int send_timeout = WAIT_FOR_SEND_COUNT;
 
+    // Standing queries are owned by the file, not the cl
+    pse_poll_release(file);
+
     CHECK_ISHTP_ALLOC();
 
     // Cancel any ongoing read events
@@ -254,6 +338,9 @@ static int ishtp_pse_release(struct inode *inode, struct file *file) {
         ret = ishtp_cl_disconnect(pse_dev.cl);
     }
 
+    // Clean the read buffer while its cl is still around
+    pse_rb_drop();
+
     // Unlink and flush the connection
     ishtp_cl_unlink(pse_dev.cl);
     ishtp_cl_flush_queues(pse_dev.cl);
@@ -261,12 +348,6 @@ static int ishtp_pse_release(struct inode *inode, struct file *file) {
 
     pse_dev.cl = NULL;
 
-    // Clean the read buffer
-    if(pse_dev.pse_rb.rb) {
-        ishtp_cl_io_rb_recycle(pse_dev.pse_rb.rb);
-        pse_dev.pse_rb.rb = NULL;
-    }
-
     mutex_unlock(&pse_dev.pse_rb.lock);
     return ret;
 }
@@ -348,6 +429,10 @@ static long ishtp_pse_ioctl(struct file * file, unsigned int cmd, unsigned long
 
         break;
     }
+    case IOCTL_PSE_ADD_QUERY:
+    case IOCTL_PSE_DEL_QUERY:
+    case IOCTL_PSE_READ_QUERY:
+        return pse_poll_ioctl(file, cmd, data);
     default:
     {
         pr_warn("Invalid IOCTL received\n");
@@ -366,33 +451,416 @@ static const struct file_operations ishtp_pse_fops = {
     .write = ishtp_pse_write,
     .release = ishtp_pse_release,
     .unlocked_ioctl = ishtp_pse_ioctl,
+    .mmap = pse_state_mmap,
     .llseek = no_llseek
 };
 
+/// Publish or retract the in-kernel client, with the command lock held
+///
+/// The Rx path uses @cl under rx_lock, and resp_lock covers short reads of it
+/// from notifiers, so it only changes with both held. Returns the old client.
+static struct ishtp_cl *pse_kclient_swap(struct ishtp_cl *cl) {
+    unsigned long flags;
+    struct ishtp_cl *old;
+
+    mutex_lock(&pse_dev.kclient.rx_lock);
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    old = pse_dev.kclient.cl;
+    pse_dev.kclient.cl = cl;
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+    mutex_unlock(&pse_dev.kclient.rx_lock);
+
+    return old;
+}
+
+/// Tear down the in-kernel client connection
+static void pse_kclient_release(void) {
+    unsigned long flags;
+    struct ishtp_cl *cl;
+
+    if (!pse_dev.kclient.cl) {
+        return;
+    }
+
+    // Fail any command that is still waiting on the firmware
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    pse_dev.kclient.aborted = true;
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+    complete(&pse_dev.kclient.done);
+
+    mutex_lock(&pse_dev.kclient.lock);
+    cl = pse_kclient_swap(NULL);
+    pse_dev.kclient.aborted = false;
+    mutex_unlock(&pse_dev.kclient.lock);
+
+    if (!cl) {
+        return;
+    }
+
+    if (cl->dev->dev_state == ISHTP_DEV_ENABLED && cl->state == ISHTP_CL_CONNECTED) {
+        cl->state = ISHTP_CL_DISCONNECTING;
+        ishtp_cl_disconnect(cl);
+    }
+
+    ishtp_cl_unlink(cl);
+    ishtp_cl_flush_queues(cl);
+    ishtp_cl_free(cl);
+}
+
+/// Connect the in-kernel client to the same firmware client as /dev/pse
+static int pse_kclient_connect(void) {
+    int ret;
+    struct ishtp_cl *cl;
+    struct ishtp_fw_client *fw_client;
+
+    cl = ishtp_cl_allocate(pse_dev.cl_device);
+    if (!cl) {
+        pr_err("Failed to allocate the kernel ishtp cl\n");
+        return -ENOMEM;
+    }
+
+    ret = ishtp_cl_link(cl);
+    if (ret) {
+        pr_err("Failed to link the kernel ishtp cl\n");
+        ishtp_cl_free(cl);
+        return ret;
+    }
+
+    fw_client = ishtp_fw_cl_get_client(pse_dev.cl_device->ishtp_dev,
+        &pse_dev.cl_device->fw_client->props.protocol_name);
+
+    if (!fw_client) {
+        pr_err("Could not detect the linked firmware client\n");
+        ret = -ENOENT;
+        goto unlink;
+    }
+
+    cl->fw_client_id = fw_client->client_id;
+    cl->state = ISHTP_CL_CONNECTING;
+
+    ret = ishtp_cl_connect(cl);
+    if (ret) {
+        pr_err("Failed to connect the kernel ishtp cl (%i)\n", ret);
+        goto unlink;
+    }
+
+    mutex_lock(&pse_dev.kclient.lock);
+    pse_kclient_swap(cl);
+    mutex_unlock(&pse_dev.kclient.lock);
+
+    return 0;
+
+unlink:
+    ishtp_cl_unlink(cl);
+    ishtp_cl_free(cl);
+    return ret;
+}
+
+/// Kernel client connection work, scheduled on probe and after resets
+static void pse_kclient_work(struct work_struct *work) {
+    if (!pse_dev.cl_device) {
+        return;
+    }
+
+    // The firmware may have been reset, along with the LEDs
+    pse_led_reset();
+
+    if (pse_kclient_connect()) {
+        pr_warn("In-kernel PSE services are unavailable\n");
+        return;
+    }
+
+    // The automotive controller can only be probed once the client is up
+    pse_hwmon_probe();
+}
+
+/// Send a command over the in-kernel PSE connection and wait for its response
+///
+/// Must not be called from the ISHTP event callback (or a notifier), since the
+/// response is delivered from there.
+///
+/// @command: The command-kind identifier
+/// @argument: The packed 16-bit header argument
+/// @in_body: Extended data/message body (may be NULL)
+/// @out_body: Storage for the response body (may be NULL)
+int pse_command_checked(u8 command, u16 argument, const struct heci_body *in_body, struct heci_body *out_body) {
+    int ret;
+    size_t len;
+    unsigned long flags;
+    u8 buffer[sizeof(struct heci_header) + sizeof(struct heci_body)];
+    struct heci_header resp_header;
+    struct heci_body resp_body;
+
+    struct heci_header header = {
+        .command = command,
+        .is_response = 0,
+        .has_next = in_body != NULL ? 1 : 0,
+        .argument = argument,
+        .status = 0
+    };
+
+    memcpy(buffer, &header, sizeof(header));
+    len = sizeof(header);
+
+    if (in_body) {
+        memcpy(buffer + len, in_body, sizeof(*in_body));
+        len += sizeof(*in_body);
+    }
+
+    mutex_lock(&pse_dev.kclient.lock);
+
+    if (!pse_dev.kclient.cl || pse_dev.kclient.cl->state != ISHTP_CL_CONNECTED) {
+        mutex_unlock(&pse_dev.kclient.lock);
+        return -ENODEV;
+    }
+
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    reinit_completion(&pse_dev.kclient.done);
+    pse_dev.kclient.pending = command;
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+    ret = ishtp_cl_send(pse_dev.kclient.cl, buffer, len);
+    if (ret) {
+        pr_err("Failed to send PSE command %u (%i)\n", command, ret);
+        goto done;
+    }
+
+    if (!wait_for_completion_timeout(&pse_dev.kclient.done, msecs_to_jiffies(WAIT_FOR_RESPONSE_MS))) {
+        pr_warn("Timed out waiting for PSE command %u\n", command);
+        ret = -ETIMEDOUT;
+        goto done;
+    }
+
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+
+    if (pse_dev.kclient.aborted) {
+        // Woken by a reset rather than a response
+        spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+        ret = -ENODEV;
+        goto done;
+    }
+
+    memcpy(&resp_header, &pse_dev.kclient.resp_header, sizeof(resp_header));
+    if (resp_header.has_next) {
+        memcpy(&resp_body, &pse_dev.kclient.resp_body, sizeof(resp_body));
+    }
+
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+    // Keep the shared state page current with everything the kernel sees
+    pse_state_update(&header, in_body, &resp_header, resp_header.has_next ? &resp_body : NULL);
+
+    if (resp_header.status) {
+        ret = -EIO;
+    } else if (resp_header.has_next) {
+        if (out_body) {
+            memcpy(out_body, &resp_body, sizeof(*out_body));
+        }
+        ret = 1;
+    } else {
+        ret = 0;
+    }
+
+done:
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    pse_dev.kclient.pending = 0;
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+    mutex_unlock(&pse_dev.kclient.lock);
+    return ret;
+}
+
+/// Route unsolicited firmware messages for @command to @fn
+int pse_register_notify(u8 command, pse_notify_fn fn, void *priv) {
+    unsigned long flags;
+
+    if (command >= kHECI_COMMAND_LAST) {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+
+    if (pse_dev.kclient.notifiers[command].fn) {
+        spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+        return -EBUSY;
+    }
+
+    pse_dev.kclient.notifiers[command].fn = fn;
+    pse_dev.kclient.notifiers[command].priv = priv;
+
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+    return 0;
+}
+
+/// Stop routing unsolicited firmware messages for @command
+///
+/// Waits for a notifier that is already running, so @priv may be freed on return. Sleeps, and
+/// must not be called from a notifier
+void pse_unregister_notify(u8 command) {
+    unsigned long flags;
+
+    if (command >= kHECI_COMMAND_LAST) {
+        return;
+    }
+
+    // rx_lock is held across dispatch, so taking it waits out a notifier call in flight
+    mutex_lock(&pse_dev.kclient.rx_lock);
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    pse_dev.kclient.notifiers[command].fn = NULL;
+    pse_dev.kclient.notifiers[command].priv = NULL;
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+    mutex_unlock(&pse_dev.kclient.rx_lock);
+}
+
+/// Convert a PSE firmware timestamp to CLOCK_MONOTONIC
+///
+/// For notifiers of firmware-stamped events, such as CAN rx and DI edges.
+/// The timestamp also feeds the ISHTP clock rate estimate, along with the
+/// time the message reporting it was received.
+///
+/// @fw_us: Firmware time of the event, in us
+/// @timestamp_ns: CLOCK_MONOTONIC time of the event
+/// @err_ns: Bound of the conversion error (may be NULL)
+///
+/// Returns 0 on success, or a negative error (-EAGAIN until the firmware clock
+/// is synced)
+int pse_fw_time_to_host(u64 fw_us, u64 *timestamp_ns, u32 *err_ns) {
+    struct ishtp_device *dev = NULL;
+    unsigned long flags;
+    ktime_t rx = 0, host;
+    int ret;
+
+    // The client may be released meanwhile; resp_lock keeps it while read,
+    // and the ISHTP device outlives it
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+    if (pse_dev.kclient.cl) {
+        dev = pse_dev.kclient.cl->dev;
+        rx = pse_dev.kclient.cl->ts_rx;
+    }
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+    if (!dev) {
+        return -ENODEV;
+    }
+
+    if (rx) {
+        ishtp_fw_clock_observe(dev, fw_us, rx);
+    }
+
+    ret = ishtp_fw_clock_to_host(dev, fw_us, &host, err_ns);
+    if (ret) {
+        return ret;
+    }
+
+    // The event can't have happened after the message reporting it arrived
+    if (rx && ktime_after(host, rx)) {
+        host = rx;
+    }
+
+    *timestamp_ns = ktime_to_ns(host);
+    return 0;
+}
+
+/// Dispatch a message received on the in-kernel client
+///
+/// Responses to the outstanding command complete it; everything else is
+/// handed to the notifier registered for its command class.
+static void pse_kclient_dispatch(struct ishtp_cl_rb *rb) {
+    unsigned long flags;
+    struct pse_notifier notifier = { 0 };
+    struct heci_header *header;
+    struct heci_body *body = NULL;
+
+    if (rb->buf_idx < sizeof(*header)) {
+        pr_warn("Dropping short PSE message (%lu bytes)\n", rb->buf_idx);
+        return;
+    }
+
+    header = (struct heci_header *)rb->buffer.data;
+
+    if (header->has_next) {
+        if (rb->buf_idx < sizeof(*header) + offsetof(struct heci_body, data)) {
+            pr_warn("Dropping PSE message with a truncated body\n");
+            return;
+        }
+
+        body = (struct heci_body *)(rb->buffer.data + sizeof(*header));
+    }
+
+    spin_lock_irqsave(&pse_dev.kclient.resp_lock, flags);
+
+    if (header->is_response && pse_dev.kclient.pending == header->command) {
+        memcpy(&pse_dev.kclient.resp_header, header, sizeof(*header));
+
+        if (body) {
+            memset(&pse_dev.kclient.resp_body, 0, sizeof(*body));
+            memcpy(&pse_dev.kclient.resp_body, body,
+                min_t(size_t, rb->buf_idx - sizeof(*header), sizeof(*body)));
+        }
+
+        pse_dev.kclient.pending = 0;
+        spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+        complete(&pse_dev.kclient.done);
+        return;
+    }
+
+    if (header->command < kHECI_COMMAND_LAST) {
+        notifier = pse_dev.kclient.notifiers[header->command];
+    }
+
+    spin_unlock_irqrestore(&pse_dev.kclient.resp_lock, flags);
+
+    if (notifier.fn) {
+        notifier.fn(header, body, notifier.priv);
+    } else {
+        pr_debug("Unhandled PSE message for command %u\n", header->command);
+    }
+}
+
 /// Callback handler for ISHTP parent bus events
 ///
 /// This function will be executed when events are received from the
 /// ISHFW
 static void ishtp_pse_event_cb(struct ishtp_cl_device *cl_device) {
     struct ishtp_cl_rb *rb;
+    struct ishtp_cl *kcl;
+
+    bool kernel_rx = false;
 
     pr_debug("PSE ISHTP Client Event Callback\n");
 
+    // Drain everything queued for the in-kernel client first; rx_lock keeps
+    // it from being released meanwhile
+    mutex_lock(&pse_dev.kclient.rx_lock);
+    kcl = pse_dev.kclient.cl;
+    while (kcl && (rb = ishtp_cl_rx_get_rb(kcl))) {
+        pse_kclient_dispatch(rb);
+        ishtp_cl_io_rb_recycle(rb);
+        kernel_rx = true;
+    }
+    mutex_unlock(&pse_dev.kclient.rx_lock);
+
     // Wait for lock
     mutex_lock(&pse_dev.pse_rb.lock);
 
     rb = pse_dev.pse_rb.rb;
 
     // Only read data if buffer is already empty
-    if (!rb) {
+    if (!rb && pse_dev.cl) {
         pr_debug("Read data from the PSE CL device\n");
         rb = ishtp_cl_rx_get_rb(pse_dev.cl);
 
-        if (!rb) {
+        if (rb) {
+            pse_dev.pse_rb.rb = rb;
+            pse_state_user_response(rb->buffer.data, rb->buf_idx);
+
+            // Don't pin the firmware's DMA Rx region on a slow reader
+            schedule_delayed_work(&pse_dev.pse_rb.unpin_work,
+                msecs_to_jiffies(CL_DMA_RX_HOLD_MS));
+        } else if (!kernel_rx) {
             pr_warn("Failed to read any data from the cl_rx read buffer\n");
             pse_dev.pse_rb.wait_exception = true;
-        } else {
-            pse_dev.pse_rb.rb = rb;
         }
     }
 
@@ -418,6 +886,9 @@ static void ishtp_cl_reset_handler(struct work_struct *work) {
         return;
     }
 
+    // The in-kernel client is always re-established after a reset
+    pse_kclient_release();
+
     // Cancel any ongoing read events
     pse_dev.pse_rb.wait_exception = true;
     wake_up_interruptible(&pse_dev.pse_rb.wq_head);
@@ -427,6 +898,7 @@ static void ishtp_cl_reset_handler(struct work_struct *work) {
 
     // Un-link any existing cl, and reconnect
     if (pse_dev.cl) {
+        pse_rb_drop();
         ishtp_cl_unlink(pse_dev.cl);
         ishtp_cl_flush_queues(pse_dev.cl);
         ishtp_cl_free(pse_dev.cl);
@@ -441,6 +913,12 @@ static void ishtp_cl_reset_handler(struct work_struct *work) {
             return;
         }
 
+        ret = ishtp_cl_enable_dma_rx_zero_copy(pse_dev.cl);
+        if (ret) {
+            pr_err("Enabling zero-copy DMA Rx failed\n");
+            goto unlink;
+        }
+
         if (pse_dev.cl->dev->dev_state != ISHTP_DEV_ENABLED) {
             pr_err("The ISHTP device isn't enabled\n");
             ret = -ENODEV;
@@ -482,6 +960,9 @@ unlink:
     }
 
     mutex_unlock(&pse_dev.pse_rb.lock);
+
+    // Bring the in-kernel client back up for the peripheral drivers
+    schedule_work(&pse_dev.kclient.work);
     return;
 }
 
@@ -579,6 +1060,14 @@ static int ishtp_pse_probe(struct ishtp_cl_device *cl_device) {
 
     // Start work
     INIT_WORK(&pse_dev.pse_rb.work, ishtp_cl_reset_handler);
+    INIT_DELAYED_WORK(&pse_dev.pse_rb.unpin_work, pse_rb_unpin_work);
+
+    // Prep the in-kernel client
+    mutex_init(&pse_dev.kclient.lock);
+    mutex_init(&pse_dev.kclient.rx_lock);
+    spin_lock_init(&pse_dev.kclient.resp_lock);
+    init_completion(&pse_dev.kclient.done);
+    INIT_WORK(&pse_dev.kclient.work, pse_kclient_work);
 
     ret = ishtp_register_event_cb(cl_device, ishtp_pse_event_cb);
     if (ret) {
@@ -591,6 +1080,24 @@ static int ishtp_pse_probe(struct ishtp_cl_device *cl_device) {
         pr_err("Failed to create the PSE character device (%i)\n", ret);
     }
 
+    // Register the peripheral drivers; they share the in-kernel client
+    ret = pse_qep_init(&cl_device->dev);
+    if (ret) {
+        pr_warn("Failed to register the PSE QEP counter (%i)\n", ret);
+    }
+
+    ret = pse_led_init(&cl_device->dev);
+    if (ret) {
+        pr_warn("Failed to register the PSE LEDs (%i)\n", ret);
+    }
+
+    ret = pse_hwmon_init(&cl_device->dev);
+    if (ret) {
+        pr_warn("Failed to register the PSE automotive hwmon (%i)\n", ret);
+    }
+
+    schedule_work(&pse_dev.kclient.work);
+
     pr_info("PSE ISHTP device sucessfully created\n");
 
     return 0;
@@ -600,6 +1107,16 @@ static int ishtp_pse_probe(struct ishtp_cl_device *cl_device) {
 static void ishtp_pse_remove(struct ishtp_cl_device *cl_device) {
     pr_info("ISHTP Client Remove\n");
 
+    // Stop the reset handler first so it cannot requeue the in-kernel client reconnect
+    cancel_work_sync(&pse_dev.pse_rb.work);
+    cancel_work_sync(&pse_dev.kclient.work);
+
+    // Drop the peripheral drivers and the in-kernel client first
+    pse_qep_exit();
+    pse_led_exit();
+    pse_hwmon_exit();
+    pse_kclient_release();
+
     // Cancel any ongoing read events
     pse_dev.pse_rb.wait_exception = true;
     wake_up_interruptible(&pse_dev.pse_rb.wq_head);
@@ -611,6 +1128,7 @@ static void ishtp_pse_remove(struct ishtp_cl_device *cl_device) {
     if (pse_dev.cl) {
         pse_dev.cl->state = ISHTP_CL_DISCONNECTING;
         ishtp_cl_disconnect(pse_dev.cl);
+        pse_rb_drop();
         ishtp_cl_unlink(pse_dev.cl);
         ishtp_cl_flush_queues(pse_dev.cl);
         ishtp_cl_free(pse_dev.cl);
@@ -618,9 +1136,12 @@ static void ishtp_pse_remove(struct ishtp_cl_device *cl_device) {
     }
 
     mutex_unlock(&pse_dev.pse_rb.lock);
+    cancel_delayed_work_sync(&pse_dev.pse_rb.unpin_work);
 
     // Destroy the mutex
     mutex_destroy(&pse_dev.pse_rb.lock);
+    mutex_destroy(&pse_dev.kclient.lock);
+    mutex_destroy(&pse_dev.kclient.rx_lock);
 
     // Close the device
     ishtp_put_device(cl_device);
@@ -663,12 +1184,41 @@ static struct ishtp_cl_driver pse_client_driver = {
 
 /// Register this driver with the ISHTP Bus
 static int __init pse_client_init(void) {
-    return ishtp_cl_driver_register(&pse_client_driver, THIS_MODULE);
+    int ret;
+
+    // The ISHTP structures are accessed directly, so intel-ishtp must be the
+    // one built from this tree (see src/Makefile)
+    ret = ishtp_check_layout(sizeof(struct ishtp_device), sizeof(struct ishtp_cl));
+    if (ret) {
+        pr_err("intel-ishtp doesn't match the ISH drivers pse was built with\n");
+        return ret;
+    }
+
+    ret = pse_state_init();
+    if (ret) {
+        return ret;
+    }
+
+    ret = pse_poll_init();
+    if (ret) {
+        pse_state_exit();
+        return ret;
+    }
+
+    ret = ishtp_cl_driver_register(&pse_client_driver, THIS_MODULE);
+    if (ret) {
+        pse_poll_exit();
+        pse_state_exit();
+    }
+
+    return ret;
 }
 
 /// Unregister this driver with the ISHTP Bus
 static void __exit pse_client_exit(void) {
-    return ishtp_cl_driver_unregister(&pse_client_driver);
+    ishtp_cl_driver_unregister(&pse_client_driver);
+    pse_poll_exit();
+    pse_state_exit();
 }
 
 // Use late_initcall to ensure the ISHTP driver will always be loaded first
@@ -0,0 +1,145 @@
+/// PSE HECI Message Types
+///
+/// Kernel-side mirror of the wire format described in examples/heci_types.h.
+/// The layouts here must stay byte-compatible with the PSE firmware.
+
+#ifndef _PSE_HECI_H_
+#define _PSE_HECI_H_
+
+#include <linux/types.h>
+
+#define MAX_HECI_DATA_LEN 224
+
+/// Valid HECI data casts
+enum heci_data_kind {
+    kHeciData_Raw = 0,
+    kHeciData_Version,
+    kHeciData_Can,
+    kHeciData_I2C,
+    kHeciData_Dio,
+    kHeciData_Uart,
+    kHeciData_Pwm,
+    kHeciData_String,
+    kHeciData_Qep,
+    kHeciData_Last
+};
+
+/// Possible HECI commands
+enum heci_command_id {
+    kHECI_SYS_INFO = 0x01,
+    kHECI_IO_COMMAND,
+    kHECI_UART_COMMAND,
+    kHECI_CAN_COMMAND,
+    kHECI_PWM_COMMAND,
+    kHECI_I2C_COMMAND,
+    kHECI_QEP_COMMAND,
+    kHECI_COMMAND_LAST
+};
+
+/// Heci command/request header
+struct heci_header {
+    u8 command;
+    u8 is_response;
+    u8 has_next;
+    u16 argument;
+    u8 status;
+} __packed;
+
+/// Heci data body (has_next == 1)
+struct heci_body {
+    u8 kind;
+    u32 length;
+    u32 padding;
+    u8 data[MAX_HECI_DATA_LEN];
+} __packed;
+
+enum heci_pwm_operation {
+    kPWM_Start = 0,
+    kPWM_Stop,
+    kPWM_SetCycles,
+    kPWM_NumOps
+};
+
+enum heci_io_operation {
+    kIO_GetInfo = 0,
+    kIO_SetOutput,
+    kIO_ClearOutput,
+    kIO_ClearCount,
+    kIO_NumOps
+};
+
+enum heci_io_device {
+    kIODev_LED = 0,
+    kIODev_DO,
+    kIODev_DI,
+    kIODev_NumDevs
+};
+
+enum heci_can_operation {
+    kCAN_Read = 0,
+    kCAN_Write,
+    kCAN_Enable,
+    kCAN_Disable,
+    kCAN_SetBaudrate,
+    kCAN_StatusReport,
+    kCAN_StatusClear,
+    kCAN_NumOps
+};
+
+enum heci_qep_operation {
+    kQEP_Configure = 0,
+    kQEP_StartDecode,
+    kQEP_StopDecode,
+    kQEP_GetDirection,
+    kQEP_GetPosCount,
+    kQEP_StartCapture,
+    kQEP_StopCapture,
+    kQEP_EnableEvent,
+    kQEP_DisableEvent,
+    kQEP_GetPhaseError,
+    kQEP_NumOps,
+};
+
+enum heci_uart_operation {
+    kUART_Read = 0,
+    kUART_Write,
+    kUART_Transfer,
+    kUART_NumOps
+};
+
+/// Pack the generic 'operation + device' argument (UART, I2C, PWM, QEP)
+#define HECI_GEN_ARG(op, dev)       ((u16)(((op) & 0xff) | (((dev) & 0xff) << 8)))
+
+/// Pack the DIO 'operation + device + pin number' argument
+#define HECI_IO_ARG(op, dev, num)   ((u16)(((op) & 0xff) | (((dev) & 0xf) << 8) | (((num) & 0xf) << 12)))
+
+/// Pack the CAN 'operation + device + argument' argument
+#define HECI_CAN_ARG(op, dev, arg)  ((u16)(((op) & 0x7) | (((dev) & 0x7) << 3) | (((arg) & 0x3ff) << 6)))
+
+/// Unpack the operation of a generic or DIO argument
+#define HECI_ARG_OP(arg)            ((arg) & 0xff)
+
+/// Unpack the device of a generic argument
+#define HECI_ARG_DEV(arg)           (((arg) >> 8) & 0xff)
+
+/// DIO Info Structure
+struct heci_dio_info {
+    u8 state;
+    u64 count;
+} __packed __aligned(2);
+
+/// HECI PWM Cycle configuration
+struct heci_pwm_data {
+    u64 period_usec;
+    u64 pulse_usec;
+} __packed __aligned(2);
+
+/// HECI QEP configuration and capture data
+struct heci_qep_data {
+    u32 data;
+    u64 buffer[16];
+} __packed __aligned(2);
+
+#define HECI_QEP_CAPTURE_LEN 16
+
+#endif /* _PSE_HECI_H_ */
@@ -0,0 +1,356 @@
+/// PSE Automotive Controller hwmon Driver
+///
+/// The automotive mode controller sits behind PSE UART 4, and every value has to
+/// be fetched with a `cfg get` transfer (see examples/automotive.c). The controller
+/// is probed once, when the in-kernel client first connects; only if it answers is
+/// the hwmon device registered. The values are then sampled in the background at
+/// `update_interval`, and the hwmon attributes are served from a cache so sensor
+/// polling never reaches the UART.
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#include "pse.h"
+
+#if IS_ENABLED(CONFIG_HWMON)
+
+#define AMD_UART_DEV     4
+#define AMD_CONFIG_GET  "cfg get %s\r\a"
+#define AMD_CONFIG_SET  "cfg set %s %u\r"
+#define AMD_VERSION_GET "ver\r\a"
+#define AMD_MIN_VERSION  123
+
+/// Controller voltages are reported in units of 10mV
+#define AMD_MV_PER_UNIT  10
+
+#define AMD_INTERVAL_MIN_MS     100
+#define AMD_INTERVAL_MAX_MS     60000
+
+static unsigned int amd_update_ms = 2000;
+module_param(amd_update_ms, uint, 0444);
+MODULE_PARM_DESC(amd_update_ms, "Initial automotive controller sample interval in ms (default 2000)");
+
+/// Sampled automotive configuration values
+enum pse_amd_value {
+    kAMD_InputVoltage,
+    kAMD_ShutdownVoltage,
+    kAMD_ShutdownTimer,
+    kAMD_HardOffTimer,
+    kAMD_StartupTimer,
+    kAMD_LowVoltageShutdownTimer,
+    kAMD_NumValues
+};
+
+/// Short names consumed by the automotive mode controller
+static const char * const pse_amd_short_names[kAMD_NumValues] = {
+    "cvl", "sdv", "sot", "hot", "sut", "lvt"
+};
+
+/// Automotive hwmon state
+///
+/// @parent: Parent device for the hwmon device
+/// @hwmon: The registered hwmon device, NULL when no controller answered
+/// @probed: The controller probe has run
+/// @lock: Protects the cache and interval
+/// @work: Background sampling work
+/// @interval_ms: Sample interval
+/// @version: Controller firmware version
+/// @values: Cached controller values
+/// @status: Per-value result of the last sample (0 when valid)
+struct pse_amd {
+    struct device *parent;
+    struct device *hwmon;
+    bool probed;
+    struct mutex lock;
+    struct delayed_work work;
+    unsigned long interval_ms;
+    u32 version;
+    u32 values[kAMD_NumValues];
+    int status[kAMD_NumValues];
+};
+
+static struct pse_amd pse_amd;
+
+/// Perform a UART transfer with the automotive controller and parse the reply
+///
+/// @request: The formatted controller command
+/// @offset: Offset of the number in the reply
+/// @value: Storage for the parsed value
+static int pse_amd_transfer(const char *request, size_t offset, u32 *value) {
+    int ret;
+    struct heci_body body = { 0 };
+
+    body.kind = kHeciData_Uart;
+    body.length = strscpy(body.data, request, sizeof(body.data));
+
+    ret = pse_command_checked(kHECI_UART_COMMAND, HECI_GEN_ARG(kUART_Transfer, AMD_UART_DEV), &body, &body);
+    if (ret < 0) {
+        return ret;
+    } else if (ret == 0) {
+        return -ENODATA;
+    }
+
+    // Replies aren't guaranteed to be terminated
+    body.data[min_t(u32, body.length, MAX_HECI_DATA_LEN - 1)] = '\0';
+
+    if (body.length <= offset || sscanf(body.data + offset, "%u", value) != 1) {
+        pr_debug("Could not parse a valid unsigned int from `%s`\n", body.data);
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+/// Read a single automotive configuration value
+static int pse_amd_get(enum pse_amd_value index, u32 *value) {
+    char request[16];
+
+    snprintf(request, sizeof(request), AMD_CONFIG_GET, pse_amd_short_names[index]);
+    return pse_amd_transfer(request, 4, value);
+}
+
+/// Program a single automotive configuration value
+static int pse_amd_set(enum pse_amd_value index, u32 value) {
+    int ret;
+    struct heci_body body = { 0 };
+
+    body.kind = kHeciData_Uart;
+    body.length = snprintf(body.data, sizeof(body.data), AMD_CONFIG_SET, pse_amd_short_names[index], value);
+
+    ret = pse_command_checked(kHECI_UART_COMMAND, HECI_GEN_ARG(kUART_Write, AMD_UART_DEV), &body, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // !Important: Wait for programming and storing the setting to complete
+    usleep_range(10000, 11000);
+
+    return 0;
+}
+
+/// Background sampling work
+static void pse_amd_work(struct work_struct *work) {
+    int i;
+    int status[kAMD_NumValues];
+    u32 values[kAMD_NumValues];
+
+    for (i = 0; i < kAMD_NumValues; i++) {
+        status[i] = pse_amd_get(i, &values[i]);
+    }
+
+    mutex_lock(&pse_amd.lock);
+
+    for (i = 0; i < kAMD_NumValues; i++) {
+        pse_amd.status[i] = status[i];
+        if (!status[i]) {
+            pse_amd.values[i] = values[i];
+        }
+    }
+
+    mutex_unlock(&pse_amd.lock);
+
+    schedule_delayed_work(&pse_amd.work, msecs_to_jiffies(READ_ONCE(pse_amd.interval_ms)));
+}
+
+/// Return a cached value, or the error of its last sample
+static int pse_amd_cached(enum pse_amd_value index, long *val) {
+    int ret;
+
+    mutex_lock(&pse_amd.lock);
+    ret = pse_amd.status[index];
+    *val = pse_amd.values[index];
+    mutex_unlock(&pse_amd.lock);
+
+    return ret;
+}
+
+static umode_t pse_amd_is_visible(const void *data, enum hwmon_sensor_types type, u32 attr, int channel) {
+    switch (type) {
+    case hwmon_chip:
+        return attr == hwmon_chip_update_interval ? 0644 : 0;
+    case hwmon_in:
+        switch (attr) {
+        case hwmon_in_input:
+        case hwmon_in_label:
+            return 0444;
+        case hwmon_in_min:
+            return 0644;
+        default:
+            return 0;
+        }
+    default:
+        return 0;
+    }
+}
+
+static int pse_amd_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *val) {
+    int ret;
+
+    switch (type) {
+    case hwmon_chip:
+        *val = READ_ONCE(pse_amd.interval_ms);
+        return 0;
+    case hwmon_in:
+        ret = pse_amd_cached(attr == hwmon_in_min ? kAMD_ShutdownVoltage : kAMD_InputVoltage, val);
+        *val *= AMD_MV_PER_UNIT;
+        return ret;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static int pse_amd_write(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long val) {
+    int ret;
+
+    switch (type) {
+    case hwmon_chip:
+        WRITE_ONCE(pse_amd.interval_ms, clamp_val(val, AMD_INTERVAL_MIN_MS, AMD_INTERVAL_MAX_MS));
+        mod_delayed_work(system_wq, &pse_amd.work, 0);
+        return 0;
+    case hwmon_in:
+        val = DIV_ROUND_CLOSEST(clamp_val(val, 0, 100000), AMD_MV_PER_UNIT);
+
+        ret = pse_amd_set(kAMD_ShutdownVoltage, val);
+        if (ret) {
+            return ret;
+        }
+
+        mutex_lock(&pse_amd.lock);
+        pse_amd.values[kAMD_ShutdownVoltage] = val;
+        pse_amd.status[kAMD_ShutdownVoltage] = 0;
+        mutex_unlock(&pse_amd.lock);
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static int pse_amd_read_string(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel,
+    const char **str) {
+    *str = "Input Voltage";
+    return 0;
+}
+
+static const struct hwmon_channel_info *pse_amd_info[] = {
+    HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+    HWMON_CHANNEL_INFO(in, HWMON_I_INPUT | HWMON_I_MIN | HWMON_I_LABEL),
+    NULL
+};
+
+static const struct hwmon_ops pse_amd_ops = {
+    .is_visible = pse_amd_is_visible,
+    .read = pse_amd_read,
+    .read_string = pse_amd_read_string,
+    .write = pse_amd_write,
+};
+
+static const struct hwmon_chip_info pse_amd_chip_info = {
+    .ops = &pse_amd_ops,
+    .info = pse_amd_info,
+};
+
+/// Cached timer attributes, in seconds
+static ssize_t pse_amd_timer_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int ret;
+    long val;
+
+    ret = pse_amd_cached(to_sensor_dev_attr(attr)->index, &val);
+    if (ret) {
+        return ret;
+    }
+
+    return sprintf(buf, "%ld\n", val);
+}
+
+static SENSOR_DEVICE_ATTR(shutdown_timer, 0444, pse_amd_timer_show, NULL, kAMD_ShutdownTimer);
+static SENSOR_DEVICE_ATTR(hard_off_timer, 0444, pse_amd_timer_show, NULL, kAMD_HardOffTimer);
+static SENSOR_DEVICE_ATTR(startup_timer, 0444, pse_amd_timer_show, NULL, kAMD_StartupTimer);
+static SENSOR_DEVICE_ATTR(low_voltage_timer, 0444, pse_amd_timer_show, NULL, kAMD_LowVoltageShutdownTimer);
+
+static struct attribute *pse_amd_attrs[] = {
+    &sensor_dev_attr_shutdown_timer.dev_attr.attr,
+    &sensor_dev_attr_hard_off_timer.dev_attr.attr,
+    &sensor_dev_attr_startup_timer.dev_attr.attr,
+    &sensor_dev_attr_low_voltage_timer.dev_attr.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(pse_amd);
+
+/// Prepare the automotive hwmon state; nothing is registered until pse_hwmon_probe()
+int pse_hwmon_init(struct device *parent) {
+    int i;
+
+    mutex_init(&pse_amd.lock);
+    INIT_DELAYED_WORK(&pse_amd.work, pse_amd_work);
+
+    pse_amd.parent = parent;
+    pse_amd.hwmon = NULL;
+    pse_amd.probed = false;
+    pse_amd.interval_ms = clamp_val(amd_update_ms, AMD_INTERVAL_MIN_MS, AMD_INTERVAL_MAX_MS);
+    pse_amd.version = 0;
+
+    // Nothing is valid until the first sample completes
+    for (i = 0; i < kAMD_NumValues; i++) {
+        pse_amd.status[i] = -ENODATA;
+    }
+
+    return 0;
+}
+
+/// Probe the automotive controller, and register the hwmon device if it answers
+///
+/// Runs once, from the in-kernel client connection work. A missing or outdated
+/// controller leaves the driver idle, so UART 4 is never polled on boards without one.
+void pse_hwmon_probe(void) {
+    int ret;
+    u32 version;
+
+    if (pse_amd.probed) {
+        return;
+    }
+
+    pse_amd.probed = true;
+
+    ret = pse_amd_transfer(AMD_VERSION_GET, 0, &version);
+    if (ret) {
+        pr_info("No automotive controller answered (%i)\n", ret);
+        return;
+    }
+
+    // Older controllers can't answer configuration reads
+    if (version < AMD_MIN_VERSION) {
+        pr_warn("Automotive controller firmware is out of date (%u)\n", version);
+        return;
+    }
+
+    pse_amd.version = version;
+
+    pse_amd.hwmon = hwmon_device_register_with_info(pse_amd.parent, "pse_automotive", &pse_amd,
+        &pse_amd_chip_info, pse_amd_groups);
+
+    if (IS_ERR(pse_amd.hwmon)) {
+        pr_warn("Failed to register the PSE automotive hwmon (%li)\n", PTR_ERR(pse_amd.hwmon));
+        pse_amd.hwmon = NULL;
+        return;
+    }
+
+    schedule_delayed_work(&pse_amd.work, 0);
+}
+
+/// Stop sampling and unregister the automotive hwmon device
+void pse_hwmon_exit(void) {
+    if (pse_amd.hwmon) {
+        cancel_delayed_work_sync(&pse_amd.work);
+        hwmon_device_unregister(pse_amd.hwmon);
+        pse_amd.hwmon = NULL;
+    }
+
+    mutex_destroy(&pse_amd.lock);
+}
+
+#endif /* CONFIG_HWMON */
@@ -0,0 +1,133 @@
+/// PSE Front-Panel LED Driver
+///
+/// Registers an LED class device for each PSE controlled LED. The K400 panel
+/// numbering (LED 1~4) is remapped to the firmware index here, so userspace and
+/// kernel triggers (timer, heartbeat, netdev, ...) can drive them directly.
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/leds.h>
+#include <linux/mutex.h>
+
+#include "pse.h"
+
+#if IS_ENABLED(CONFIG_LEDS_CLASS)
+
+#define PSE_LED_COUNT 4
+
+/// A single PSE LED
+///
+/// @cdev: The registered LED class device
+/// @index: Firmware LED index (after remapping)
+/// @state: Last state written to the firmware, -1 if unknown
+/// @name: Class device name storage
+struct pse_led {
+    struct led_classdev cdev;
+    u8 index;
+    int state;
+    char name[16];
+};
+
+static struct pse_led pse_leds[PSE_LED_COUNT];
+static DEFINE_MUTEX(pse_led_lock);
+
+/// Map the panel LED number (0~3 for LED 1~4) to the firmware LED index
+static u8 pse_led_remap(u8 led) {
+    u8 divisor = PSE_LED_COUNT - 1;
+
+    if (led / divisor) {
+        return 0;
+    }
+
+    return divisor - (led % divisor);
+}
+
+/// Set a single LED state
+///
+/// Called from the LED core workqueue, so triggers that toggle faster than the
+/// firmware round-trip are coalesced to the latest value. Writes that don't
+/// change the state never reach the firmware.
+static int pse_led_brightness_set(struct led_classdev *cdev, enum led_brightness brightness) {
+    int ret = 0;
+    int state = brightness != LED_OFF;
+    struct pse_led *led = container_of(cdev, struct pse_led, cdev);
+
+    mutex_lock(&pse_led_lock);
+
+    if (led->state != state) {
+        ret = pse_command_checked(kHECI_IO_COMMAND,
+            HECI_IO_ARG(state ? kIO_SetOutput : kIO_ClearOutput, kIODev_LED, led->index), NULL, NULL);
+
+        // Force the next write through if the firmware didn't take this one
+        led->state = ret < 0 ? -1 : state;
+    }
+
+    mutex_unlock(&pse_led_lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+/// Register the PSE LED class devices
+int pse_led_init(struct device *parent) {
+    int ret;
+    size_t i;
+
+    for (i = 0; i < PSE_LED_COUNT; i++) {
+        struct pse_led *led = &pse_leds[i];
+
+        snprintf(led->name, sizeof(led->name), "pse::led%zu", i + 1);
+
+        led->index = pse_led_remap(i);
+        led->state = -1;
+        led->cdev.name = led->name;
+        led->cdev.max_brightness = 1;
+        led->cdev.brightness_set_blocking = pse_led_brightness_set;
+
+        ret = led_classdev_register(parent, &led->cdev);
+        if (ret) {
+            pr_err("Failed to register %s (%i)\n", led->name, ret);
+            goto unregister;
+        }
+    }
+
+    return 0;
+
+unregister:
+    while (i--) {
+        led_classdev_unregister(&pse_leds[i].cdev);
+    }
+
+    return ret;
+}
+
+/// Forget the cached LED states, so the next write of each reaches the firmware
+///
+/// Called when the in-kernel client (re)connects: a firmware reset drops the
+/// LED states the cache remembers.
+void pse_led_reset(void) {
+    size_t i;
+
+    mutex_lock(&pse_led_lock);
+
+    for (i = 0; i < PSE_LED_COUNT; i++) {
+        pse_leds[i].state = -1;
+    }
+
+    mutex_unlock(&pse_led_lock);
+}
+
+/// Unregister the PSE LED class devices
+void pse_led_exit(void) {
+    size_t i;
+
+    for (i = 0; i < PSE_LED_COUNT; i++) {
+        if (pse_leds[i].cdev.dev) {
+            led_classdev_unregister(&pse_leds[i].cdev);
+        }
+    }
+
+    memset(pse_leds, 0, sizeof(pse_leds));
+}
+
+#endif /* CONFIG_LEDS_CLASS */
@@ -0,0 +1,528 @@
+/// PSE Standing Query Poller
+///
+/// Userspace registers periodic "standing queries" (command, argument, period)
+/// through IOCTL_PSE_ADD_QUERY. The driver issues them over the in-kernel client
+/// from an hrtimer-driven worker, and queues each result for every subscribed
+/// session. Identical queries from different sessions share one firmware
+/// transaction, which is issued at the fastest subscribed period.
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#include "pse.h"
+
+#define PSE_QUERY_PERIOD_MIN_MS     10
+#define PSE_QUERY_PERIOD_MAX_MS     3600000
+#define PSE_SESSION_MAX_QUERIES     32
+#define PSE_SESSION_RESULTS         16
+
+static_assert(sizeof(struct heci_header) + sizeof(struct heci_body) <= PSE_QUERY_DATA_LEN);
+
+/// A deduplicated standing query
+///
+/// @link: Entry in pse_poll.queries
+/// @subs: Subscriptions to this query
+/// @id: Query id reported to userspace
+/// @command: The HECI command
+/// @argument: The packed HECI argument
+/// @period: Effective period, the fastest of all subscriptions
+/// @next: When the query is next due
+struct pse_poll_query {
+    struct list_head link;
+    struct list_head subs;
+    u32 id;
+    u8 command;
+    u16 argument;
+    ktime_t period;
+    ktime_t next;
+};
+
+/// A session's subscription to a standing query
+///
+/// @query_link: Entry in the query's subscription list
+/// @session_link: Entry in the session's subscription list
+/// @query: The subscribed query
+/// @session: The subscribing session
+/// @period: The period requested by this session
+/// @next: When this session is next due a result
+struct pse_poll_sub {
+    struct list_head query_link;
+    struct list_head session_link;
+    struct pse_poll_query *query;
+    struct pse_session *session;
+    ktime_t period;
+    ktime_t next;
+};
+
+/// Per-open-file poller state
+///
+/// @subs: This session's subscriptions
+/// @num_subs: Number of entries in @subs
+/// @lock: Protects @results
+/// @results: Queued results, oldest dropped on overflow
+/// @wq_head: Woken when a result is queued
+/// @overruns: Results dropped because the session wasn't reading
+struct pse_session {
+    struct list_head subs;
+    unsigned int num_subs;
+    spinlock_t lock;
+    DECLARE_KFIFO(results, struct pse_query_result, PSE_SESSION_RESULTS);
+    wait_queue_head_t wq_head;
+    u32 overruns;
+};
+
+/// Poller state
+///
+/// @lock: Protects the query list and all subscriptions
+/// @queries: All registered queries
+/// @next_id: Next query id to hand out
+/// @timer: Fires when the earliest query is due
+/// @work: Issues due queries; runs on @wq
+/// @wq: Ordered workqueue, so only one batch runs at a time
+struct pse_poll {
+    struct mutex lock;
+    struct list_head queries;
+    u32 next_id;
+    struct hrtimer timer;
+    struct work_struct work;
+    struct workqueue_struct *wq;
+};
+
+static struct pse_poll pse_poll;
+
+/// Re-arm the timer for the earliest due query; caller holds pse_poll.lock
+static void pse_poll_arm(void) {
+    struct pse_poll_query *query;
+    ktime_t next = KTIME_MAX;
+
+    list_for_each_entry(query, &pse_poll.queries, link) {
+        next = min(next, query->next);
+    }
+
+    if (next == KTIME_MAX) {
+        hrtimer_try_to_cancel(&pse_poll.timer);
+        return;
+    }
+
+    hrtimer_start(&pse_poll.timer, next, HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart pse_poll_timer_fn(struct hrtimer *timer) {
+    queue_work(pse_poll.wq, &pse_poll.work);
+    return HRTIMER_NORESTART;
+}
+
+/// Queue a result for a session, dropping its oldest result if full
+static void pse_poll_deliver(struct pse_session *session, const struct pse_query_result *result) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&session->lock, flags);
+
+    if (kfifo_is_full(&session->results)) {
+        kfifo_skip(&session->results);
+        session->overruns++;
+    }
+
+    kfifo_put(&session->results, *result);
+
+    spin_unlock_irqrestore(&session->lock, flags);
+
+    wake_up_interruptible(&session->wq_head);
+}
+
+/// Issue a single query into @result
+static void pse_poll_issue(struct pse_poll_query *query, struct pse_query_result *result) {
+    int ret;
+    struct heci_body body;
+    struct heci_header header = {
+        .command = query->command,
+        .is_response = 1,
+        .argument = query->argument,
+    };
+
+    ret = pse_command_checked(query->command, query->argument, NULL, &body);
+
+    memset(result, 0, sizeof(*result));
+    result->id = query->id;
+    result->status = ret < 0 ? ret : 0;
+    result->timestamp_ns = ktime_get_ns();
+
+    if (ret < 0) {
+        return;
+    }
+
+    header.has_next = ret;
+    memcpy(result->data, &header, sizeof(header));
+    result->length = sizeof(header);
+
+    if (ret) {
+        memcpy(result->data + sizeof(header), &body, sizeof(body));
+        result->length += sizeof(body);
+    }
+}
+
+/// Claim a query that was due at @start, and schedule its next run; caller holds pse_poll.lock
+static struct pse_poll_query *pse_poll_claim(ktime_t start) {
+    struct pse_poll_query *query;
+
+    list_for_each_entry(query, &pse_poll.queries, link) {
+        if (ktime_before(start, query->next)) {
+            continue;
+        }
+
+        // Skip missed periods instead of bursting to catch up
+        query->next = ktime_add(query->next, query->period);
+        if (ktime_before(query->next, start)) {
+            query->next = ktime_add(start, query->period);
+        }
+
+        return query;
+    }
+
+    return NULL;
+}
+
+/// Look a query up by id; caller holds pse_poll.lock
+static struct pse_poll_query *pse_poll_find(u32 id) {
+    struct pse_poll_query *query;
+
+    list_for_each_entry(query, &pse_poll.queries, link) {
+        if (query->id == id) {
+            return query;
+        }
+    }
+
+    return NULL;
+}
+
+/// Issue every due query once, and fan the results out to their subscribers
+static void pse_poll_work(struct work_struct *work) {
+    ktime_t now, start;
+    struct pse_poll_sub *sub;
+    struct pse_poll_query *query;
+    struct pse_poll_query due;
+    struct pse_query_result *result;
+
+    result = kmalloc(sizeof(*result), GFP_KERNEL);
+    if (!result) {
+        // Nothing was claimed, so retry after the shortest period instead of
+        // stopping the poller (re-arming as is would fire straight away)
+        mutex_lock(&pse_poll.lock);
+        if (!list_empty(&pse_poll.queries)) {
+            hrtimer_start(&pse_poll.timer, ktime_add_ms(ktime_get(), PSE_QUERY_PERIOD_MIN_MS),
+                HRTIMER_MODE_ABS);
+        }
+        mutex_unlock(&pse_poll.lock);
+        return;
+    }
+
+    start = ktime_get();
+
+    mutex_lock(&pse_poll.lock);
+
+    while ((query = pse_poll_claim(start))) {
+        // Issue a copy with the lock dropped, so ioctls and release don't
+        // wait on the firmware; the query may be deleted meanwhile
+        due = *query;
+        mutex_unlock(&pse_poll.lock);
+
+        pse_poll_issue(&due, result);
+        now = ktime_get();
+
+        mutex_lock(&pse_poll.lock);
+
+        query = pse_poll_find(due.id);
+        if (!query) {
+            continue;
+        }
+
+        // Slower subscribers take the result closest to their own period
+        list_for_each_entry(sub, &query->subs, query_link) {
+            if (ktime_before(ktime_add(now, query->period / 2), sub->next)) {
+                continue;
+            }
+
+            pse_poll_deliver(sub->session, result);
+            sub->next = ktime_add(sub->next, sub->period);
+            if (ktime_before(sub->next, now)) {
+                sub->next = ktime_add(now, sub->period);
+            }
+        }
+    }
+
+    pse_poll_arm();
+
+    mutex_unlock(&pse_poll.lock);
+
+    kfree(result);
+}
+
+/// Recompute a query's period after its subscriptions changed
+static void pse_poll_update_period(struct pse_poll_query *query) {
+    struct pse_poll_sub *sub;
+    ktime_t period = KTIME_MAX;
+
+    list_for_each_entry(sub, &query->subs, query_link) {
+        period = min(period, sub->period);
+    }
+
+    query->period = period;
+}
+
+/// Drop a subscription, and its query once it has no subscribers; caller holds pse_poll.lock
+static void pse_poll_unsubscribe(struct pse_poll_sub *sub) {
+    struct pse_poll_query *query = sub->query;
+
+    list_del(&sub->query_link);
+    list_del(&sub->session_link);
+    sub->session->num_subs--;
+    kfree(sub);
+
+    if (list_empty(&query->subs)) {
+        list_del(&query->link);
+        kfree(query);
+    } else {
+        pse_poll_update_period(query);
+    }
+}
+
+/// Handle IOCTL_PSE_ADD_QUERY
+static int pse_poll_add(struct pse_session *session, struct pse_query *req) {
+    ktime_t now;
+    struct pse_poll_sub *sub;
+    struct pse_poll_query *query;
+
+    if (!req->command || req->command >= kHECI_COMMAND_LAST) {
+        return -EINVAL;
+    }
+
+    if (req->period_ms < PSE_QUERY_PERIOD_MIN_MS || req->period_ms > PSE_QUERY_PERIOD_MAX_MS) {
+        return -ERANGE;
+    }
+
+    sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+    if (!sub) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&pse_poll.lock);
+
+    if (session->num_subs >= PSE_SESSION_MAX_QUERIES) {
+        mutex_unlock(&pse_poll.lock);
+        kfree(sub);
+        return -ENOSPC;
+    }
+
+    // Share the firmware transaction with any identical query
+    list_for_each_entry(query, &pse_poll.queries, link) {
+        if (query->command == req->command && query->argument == req->argument) {
+            goto subscribe;
+        }
+    }
+
+    query = kzalloc(sizeof(*query), GFP_KERNEL);
+    if (!query) {
+        mutex_unlock(&pse_poll.lock);
+        kfree(sub);
+        return -ENOMEM;
+    }
+
+    INIT_LIST_HEAD(&query->subs);
+    query->id = ++pse_poll.next_id;
+    query->command = req->command;
+    query->argument = req->argument;
+    query->next = ktime_get();
+    list_add_tail(&query->link, &pse_poll.queries);
+
+subscribe:
+    now = ktime_get();
+
+    sub->query = query;
+    sub->session = session;
+    sub->period = ms_to_ktime(req->period_ms);
+    sub->next = now;
+    list_add_tail(&sub->query_link, &query->subs);
+    list_add_tail(&sub->session_link, &session->subs);
+    session->num_subs++;
+
+    pse_poll_update_period(query);
+
+    // A faster subscriber pulls the next transaction forward
+    query->next = min(query->next, ktime_add(now, query->period));
+
+    req->id = query->id;
+
+    pse_poll_arm();
+
+    mutex_unlock(&pse_poll.lock);
+    return 0;
+}
+
+/// Handle IOCTL_PSE_DEL_QUERY
+static int pse_poll_del(struct pse_session *session, u32 id) {
+    int ret = -ENOENT;
+    struct pse_poll_sub *sub;
+
+    mutex_lock(&pse_poll.lock);
+
+    list_for_each_entry(sub, &session->subs, session_link) {
+        if (sub->query->id == id) {
+            pse_poll_unsubscribe(sub);
+            pse_poll_arm();
+            ret = 0;
+            break;
+        }
+    }
+
+    mutex_unlock(&pse_poll.lock);
+    return ret;
+}
+
+/// Handle IOCTL_PSE_READ_QUERY; blocks until a result is queued
+static int pse_poll_read(struct pse_session *session, struct pse_query_result __user *ubuf) {
+    int ret;
+    unsigned long flags;
+    struct pse_query_result *result;
+
+    result = kmalloc(sizeof(*result), GFP_KERNEL);
+    if (!result) {
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        spin_lock_irqsave(&session->lock, flags);
+        ret = kfifo_get(&session->results, result);
+        spin_unlock_irqrestore(&session->lock, flags);
+
+        if (ret) {
+            break;
+        }
+
+        ret = wait_event_interruptible(session->wq_head, !kfifo_is_empty(&session->results));
+        if (ret) {
+            kfree(result);
+            return ret;
+        }
+    }
+
+    ret = copy_to_user(ubuf, result, sizeof(*result)) ? -EFAULT : 0;
+
+    kfree(result);
+    return ret;
+}
+
+/// Handle the standing query IOCTLs
+long pse_poll_ioctl(struct file *file, unsigned int cmd, unsigned long data) {
+    int ret;
+    u32 id;
+    struct pse_query req;
+    struct pse_session *session = file->private_data;
+
+    if (!session) {
+        return -ENODEV;
+    }
+
+    switch (cmd) {
+    case IOCTL_PSE_ADD_QUERY:
+        if (copy_from_user(&req, (void __user *)data, sizeof(req))) {
+            return -EFAULT;
+        }
+
+        ret = pse_poll_add(session, &req);
+        if (ret) {
+            return ret;
+        }
+
+        return copy_to_user((void __user *)data, &req, sizeof(req)) ? -EFAULT : 0;
+    case IOCTL_PSE_DEL_QUERY:
+        if (get_user(id, (u32 __user *)data)) {
+            return -EFAULT;
+        }
+
+        return pse_poll_del(session, id);
+    case IOCTL_PSE_READ_QUERY:
+        return pse_poll_read(session, (struct pse_query_result __user *)data);
+    default:
+        return -EINVAL;
+    }
+}
+
+/// Allocate the poller state for a newly opened file
+int pse_poll_open(struct file *file) {
+    struct pse_session *session;
+
+    session = kzalloc(sizeof(*session), GFP_KERNEL);
+    if (!session) {
+        return -ENOMEM;
+    }
+
+    INIT_LIST_HEAD(&session->subs);
+    spin_lock_init(&session->lock);
+    INIT_KFIFO(session->results);
+    init_waitqueue_head(&session->wq_head);
+
+    file->private_data = session;
+    return 0;
+}
+
+/// Drop all of a file's subscriptions
+void pse_poll_release(struct file *file) {
+    struct pse_poll_sub *sub, *tmp;
+    struct pse_session *session = file->private_data;
+
+    if (!session) {
+        return;
+    }
+
+    mutex_lock(&pse_poll.lock);
+
+    list_for_each_entry_safe(sub, tmp, &session->subs, session_link) {
+        pse_poll_unsubscribe(sub);
+    }
+
+    pse_poll_arm();
+
+    mutex_unlock(&pse_poll.lock);
+
+    file->private_data = NULL;
+    kfree(session);
+}
+
+/// Start the standing query poller
+int pse_poll_init(void) {
+    mutex_init(&pse_poll.lock);
+    INIT_LIST_HEAD(&pse_poll.queries);
+    INIT_WORK(&pse_poll.work, pse_poll_work);
+
+    hrtimer_init(&pse_poll.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pse_poll.timer.function = pse_poll_timer_fn;
+
+    pse_poll.wq = alloc_ordered_workqueue("pse-poll", 0);
+    if (!pse_poll.wq) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/// Stop the standing query poller
+///
+/// All files must already be released, so no queries remain.
+void pse_poll_exit(void) {
+    if (!pse_poll.wq) {
+        return;
+    }
+
+    hrtimer_cancel(&pse_poll.timer);
+    destroy_workqueue(pse_poll.wq);
+    mutex_destroy(&pse_poll.lock);
+
+    pse_poll.wq = NULL;
+}
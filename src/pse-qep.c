@@ -0,0 +1,440 @@
+/// PSE Quadrature Encoder (QEP) Counter Driver
+///
+/// Exposes the PSE QEP instances through the Linux counter subsystem. Position,
+/// direction and phase-error counts are read from the firmware on demand, and
+/// capture buffers reported by the firmware are pushed through the counter
+/// character device event FIFO.
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "pse.h"
+
+#if IS_ENABLED(CONFIG_COUNTER) && NEWER_KENREL == 1
+
+#include <linux/counter.h>
+
+MODULE_IMPORT_NS(COUNTER);
+
+#define PSE_QEP_MAX_CHANNELS 4
+
+static unsigned int qep_channels = 1;
+module_param(qep_channels, uint, 0444);
+MODULE_PARM_DESC(qep_channels, "Number of PSE QEP instances to expose (1-4, default 1)");
+
+/// Cached per-channel QEP state
+///
+/// Values are refreshed on every successful firmware query, and served as-is
+/// while an event is being pushed (the firmware can't be queried from there).
+///
+/// @enabled: Decoding has been started on the firmware
+/// @direction: Last reported count direction
+/// @position: Last reported position count
+/// @phase_errors: Last reported phase error count
+/// @capture: The capture value currently being pushed to the event FIFO
+/// @capture_on: Capture is running on the firmware
+/// @events_on: Change-of-state events are enabled on the firmware
+struct pse_qep_channel {
+    bool enabled;
+    u32 direction;
+    u64 position;
+    u64 phase_errors;
+    u64 capture;
+    bool capture_on;
+    bool events_on;
+};
+
+/// QEP counter state
+///
+/// @lock: Protects the cached channel state; watch reads run with IRQs off
+/// @in_event: Set while the notifier is pushing events
+/// @capture_mask: Channels with a capture watch registered
+/// @events_mask: Channels with a change-of-state watch registered
+/// @event_work: Applies watch changes to the firmware
+struct pse_qep {
+    spinlock_t lock;
+    bool in_event;
+    unsigned long capture_mask;
+    unsigned long events_mask;
+    struct work_struct event_work;
+    struct counter_signal signals[PSE_QEP_MAX_CHANNELS * 2];
+    struct counter_synapse synapses[PSE_QEP_MAX_CHANNELS * 2];
+    struct counter_count counts[PSE_QEP_MAX_CHANNELS];
+    char names[PSE_QEP_MAX_CHANNELS * 3][24];
+    struct pse_qep_channel channel[PSE_QEP_MAX_CHANNELS];
+};
+
+static struct counter_device *pse_qep_counter;
+
+static const enum counter_function pse_qep_functions[] = {
+    COUNTER_FUNCTION_QUADRATURE_X4,
+};
+
+static const enum counter_synapse_action pse_qep_synapse_actions[] = {
+    COUNTER_SYNAPSE_ACTION_BOTH_EDGES,
+};
+
+/// Issue a header-only QEP operation, returning the reported data word
+static int pse_qep_command(u8 op, u8 dev, u32 *value) {
+    int ret;
+    struct heci_body body;
+
+    ret = pse_command_checked(kHECI_QEP_COMMAND, HECI_GEN_ARG(op, dev), NULL, &body);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (value) {
+        if (ret == 0 || body.length < sizeof(u32)) {
+            return -EIO;
+        }
+
+        *value = ((struct heci_qep_data *)body.data)->data;
+    }
+
+    return 0;
+}
+
+static int pse_qep_count_read(struct counter_device *counter, struct counter_count *count, u64 *val) {
+    unsigned long flags;
+    int ret = 0;
+    u32 position;
+    struct pse_qep *qep = counter_priv(counter);
+    struct pse_qep_channel *ch = &qep->channel[count->id];
+
+    if (!READ_ONCE(qep->in_event)) {
+        ret = pse_qep_command(kQEP_GetPosCount, count->id, &position);
+    }
+
+    spin_lock_irqsave(&qep->lock, flags);
+    if (!ret && !READ_ONCE(qep->in_event)) {
+        ch->position = position;
+    }
+    *val = ch->position;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return ret;
+}
+
+static int pse_qep_function_read(struct counter_device *counter, struct counter_count *count,
+    enum counter_function *function) {
+    *function = COUNTER_FUNCTION_QUADRATURE_X4;
+    return 0;
+}
+
+static int pse_qep_action_read(struct counter_device *counter, struct counter_count *count,
+    struct counter_synapse *synapse, enum counter_synapse_action *action) {
+    *action = COUNTER_SYNAPSE_ACTION_BOTH_EDGES;
+    return 0;
+}
+
+/// Record which channels have watches, and apply them outside of the event lock
+static int pse_qep_events_configure(struct counter_device *counter) {
+    struct counter_event_node *event_node;
+    unsigned long capture_mask = 0;
+    unsigned long events_mask = 0;
+    struct pse_qep *qep = counter_priv(counter);
+
+    list_for_each_entry(event_node, &counter->events_list, l) {
+        if (event_node->event == COUNTER_EVENT_CAPTURE) {
+            capture_mask |= BIT(event_node->channel);
+        } else {
+            events_mask |= BIT(event_node->channel);
+        }
+    }
+
+    WRITE_ONCE(qep->capture_mask, capture_mask);
+    WRITE_ONCE(qep->events_mask, events_mask);
+
+    // Called with a spinlock held; the firmware is updated from a work item
+    schedule_work(&qep->event_work);
+
+    return 0;
+}
+
+static int pse_qep_watch_validate(struct counter_device *counter, const struct counter_watch *watch) {
+    if (watch->channel >= counter->num_counts) {
+        return -EINVAL;
+    }
+
+    switch (watch->event) {
+    case COUNTER_EVENT_CAPTURE:
+    case COUNTER_EVENT_CHANGE_OF_STATE:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static const struct counter_ops pse_qep_ops = {
+    .count_read = pse_qep_count_read,
+    .function_read = pse_qep_function_read,
+    .action_read = pse_qep_action_read,
+    .events_configure = pse_qep_events_configure,
+    .watch_validate = pse_qep_watch_validate,
+};
+
+static int pse_qep_direction_read(struct counter_device *counter, struct counter_count *count, u32 *direction) {
+    unsigned long flags;
+    int ret = 0;
+    u32 value;
+    struct pse_qep *qep = counter_priv(counter);
+    struct pse_qep_channel *ch = &qep->channel[count->id];
+
+    if (!READ_ONCE(qep->in_event)) {
+        ret = pse_qep_command(kQEP_GetDirection, count->id, &value);
+    }
+
+    spin_lock_irqsave(&qep->lock, flags);
+    if (!ret && !READ_ONCE(qep->in_event)) {
+        ch->direction = value ? COUNTER_COUNT_DIRECTION_BACKWARD : COUNTER_COUNT_DIRECTION_FORWARD;
+    }
+    *direction = ch->direction;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return ret;
+}
+
+static int pse_qep_enable_read(struct counter_device *counter, struct counter_count *count, u8 *enable) {
+    unsigned long flags;
+    struct pse_qep *qep = counter_priv(counter);
+
+    spin_lock_irqsave(&qep->lock, flags);
+    *enable = qep->channel[count->id].enabled;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return 0;
+}
+
+static int pse_qep_enable_write(struct counter_device *counter, struct counter_count *count, u8 enable) {
+    unsigned long flags;
+    int ret;
+    struct pse_qep *qep = counter_priv(counter);
+
+    ret = pse_qep_command(enable ? kQEP_StartDecode : kQEP_StopDecode, count->id, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    spin_lock_irqsave(&qep->lock, flags);
+    qep->channel[count->id].enabled = enable;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return 0;
+}
+
+static int pse_qep_phase_error_read(struct counter_device *counter, struct counter_count *count, u64 *val) {
+    unsigned long flags;
+    int ret = 0;
+    u32 value;
+    struct pse_qep *qep = counter_priv(counter);
+    struct pse_qep_channel *ch = &qep->channel[count->id];
+
+    if (!READ_ONCE(qep->in_event)) {
+        ret = pse_qep_command(kQEP_GetPhaseError, count->id, &value);
+    }
+
+    spin_lock_irqsave(&qep->lock, flags);
+    if (!ret && !READ_ONCE(qep->in_event)) {
+        ch->phase_errors = value;
+    }
+    *val = ch->phase_errors;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return ret;
+}
+
+static int pse_qep_capture_read(struct counter_device *counter, struct counter_count *count, u64 *val) {
+    unsigned long flags;
+    struct pse_qep *qep = counter_priv(counter);
+
+    spin_lock_irqsave(&qep->lock, flags);
+    *val = qep->channel[count->id].capture;
+    spin_unlock_irqrestore(&qep->lock, flags);
+
+    return 0;
+}
+
+static struct counter_comp pse_qep_count_ext[] = {
+    COUNTER_COMP_DIRECTION(pse_qep_direction_read),
+    COUNTER_COMP_ENABLE(pse_qep_enable_read, pse_qep_enable_write),
+    COUNTER_COMP_COUNT_U64("phase_error_count", pse_qep_phase_error_read, NULL),
+    COUNTER_COMP_COUNT_U64("capture", pse_qep_capture_read, NULL),
+};
+
+/// Apply the registered watches to the firmware capture/event state
+static void pse_qep_event_work(struct work_struct *work) {
+    int ret;
+    size_t i;
+    bool want;
+    struct pse_qep *qep = container_of(work, struct pse_qep, event_work);
+    unsigned long capture_mask = READ_ONCE(qep->capture_mask);
+    unsigned long events_mask = READ_ONCE(qep->events_mask);
+
+    for (i = 0; i < pse_qep_counter->num_counts; i++) {
+        struct pse_qep_channel *ch = &qep->channel[i];
+
+        want = capture_mask & BIT(i);
+        if (want != ch->capture_on) {
+            ret = pse_qep_command(want ? kQEP_StartCapture : kQEP_StopCapture, i, NULL);
+            if (ret) {
+                pr_warn("Failed to update QEP%zu capture (%i)\n", i, ret);
+            } else {
+                ch->capture_on = want;
+            }
+        }
+
+        want = events_mask & BIT(i);
+        if (want != ch->events_on) {
+            ret = pse_qep_command(want ? kQEP_EnableEvent : kQEP_DisableEvent, i, NULL);
+            if (ret) {
+                pr_warn("Failed to update QEP%zu events (%i)\n", i, ret);
+            } else {
+                ch->events_on = want;
+            }
+        }
+    }
+}
+
+/// Handle unsolicited QEP messages from the firmware
+///
+/// Capture reports (kQEP_StartCapture) carry up to 16 captured values, each of
+/// which is pushed as a separate COUNTER_EVENT_CAPTURE. Event reports
+/// (kQEP_EnableEvent) carry the current position count.
+static void pse_qep_notify(const struct heci_header *header, const struct heci_body *body, void *priv) {
+    unsigned long flags;
+    u32 i, entries;
+    struct counter_device *counter = priv;
+    struct pse_qep *qep = counter_priv(counter);
+    const struct heci_qep_data *data;
+    u8 op = HECI_ARG_OP(header->argument);
+    u8 dev = HECI_ARG_DEV(header->argument);
+
+    if (!body || dev >= counter->num_counts) {
+        return;
+    }
+
+    data = (const struct heci_qep_data *)body->data;
+
+    WRITE_ONCE(qep->in_event, true);
+
+    switch (op) {
+    case kQEP_StartCapture:
+        entries = min_t(u32, data->data, HECI_QEP_CAPTURE_LEN);
+
+        for (i = 0; i < entries; i++) {
+            spin_lock_irqsave(&qep->lock, flags);
+            qep->channel[dev].capture = data->buffer[i];
+            spin_unlock_irqrestore(&qep->lock, flags);
+
+            counter_push_event(counter, COUNTER_EVENT_CAPTURE, dev);
+        }
+        break;
+    case kQEP_EnableEvent:
+        spin_lock_irqsave(&qep->lock, flags);
+        qep->channel[dev].position = data->data;
+        spin_unlock_irqrestore(&qep->lock, flags);
+
+        counter_push_event(counter, COUNTER_EVENT_CHANGE_OF_STATE, dev);
+        break;
+    default:
+        pr_debug("Unhandled QEP notification (op %u)\n", op);
+        break;
+    }
+
+    WRITE_ONCE(qep->in_event, false);
+}
+
+/// Register the QEP counter device
+int pse_qep_init(struct device *parent) {
+    int ret;
+    size_t i;
+    struct pse_qep *qep;
+    struct counter_device *counter;
+    unsigned int channels = clamp_t(unsigned int, qep_channels, 1, PSE_QEP_MAX_CHANNELS);
+
+    counter = counter_alloc(sizeof(*qep));
+    if (!counter) {
+        return -ENOMEM;
+    }
+
+    qep = counter_priv(counter);
+    spin_lock_init(&qep->lock);
+    INIT_WORK(&qep->event_work, pse_qep_event_work);
+
+    // Each channel has an A/B phase pair feeding a single quadrature count
+    for (i = 0; i < channels; i++) {
+        snprintf(qep->names[i * 3], sizeof(qep->names[0]), "QEP%zu Phase A", i);
+        snprintf(qep->names[i * 3 + 1], sizeof(qep->names[0]), "QEP%zu Phase B", i);
+        snprintf(qep->names[i * 3 + 2], sizeof(qep->names[0]), "QEP%zu Count", i);
+
+        qep->signals[i * 2].id = i * 2;
+        qep->signals[i * 2].name = qep->names[i * 3];
+        qep->signals[i * 2 + 1].id = i * 2 + 1;
+        qep->signals[i * 2 + 1].name = qep->names[i * 3 + 1];
+
+        qep->synapses[i * 2].actions_list = pse_qep_synapse_actions;
+        qep->synapses[i * 2].num_actions = ARRAY_SIZE(pse_qep_synapse_actions);
+        qep->synapses[i * 2].signal = &qep->signals[i * 2];
+        qep->synapses[i * 2 + 1].actions_list = pse_qep_synapse_actions;
+        qep->synapses[i * 2 + 1].num_actions = ARRAY_SIZE(pse_qep_synapse_actions);
+        qep->synapses[i * 2 + 1].signal = &qep->signals[i * 2 + 1];
+
+        qep->counts[i].id = i;
+        qep->counts[i].name = qep->names[i * 3 + 2];
+        qep->counts[i].functions_list = pse_qep_functions;
+        qep->counts[i].num_functions = ARRAY_SIZE(pse_qep_functions);
+        qep->counts[i].synapses = &qep->synapses[i * 2];
+        qep->counts[i].num_synapses = 2;
+        qep->counts[i].ext = pse_qep_count_ext;
+        qep->counts[i].num_ext = ARRAY_SIZE(pse_qep_count_ext);
+    }
+
+    counter->name = "pse-qep";
+    counter->parent = parent;
+    counter->ops = &pse_qep_ops;
+    counter->signals = qep->signals;
+    counter->num_signals = channels * 2;
+    counter->counts = qep->counts;
+    counter->num_counts = channels;
+
+    ret = pse_register_notify(kHECI_QEP_COMMAND, pse_qep_notify, counter);
+    if (ret) {
+        counter_put(counter);
+        return ret;
+    }
+
+    ret = counter_add(counter);
+    if (ret) {
+        pse_unregister_notify(kHECI_QEP_COMMAND);
+        counter_put(counter);
+        return ret;
+    }
+
+    pse_qep_counter = counter;
+
+    return 0;
+}
+
+/// Unregister the QEP counter device
+void pse_qep_exit(void) {
+    struct pse_qep *qep;
+
+    if (!pse_qep_counter) {
+        return;
+    }
+
+    qep = counter_priv(pse_qep_counter);
+
+    pse_unregister_notify(kHECI_QEP_COMMAND);
+    counter_unregister(pse_qep_counter);
+    cancel_work_sync(&qep->event_work);
+    counter_put(pse_qep_counter);
+
+    pse_qep_counter = NULL;
+}
+
+#endif /* CONFIG_COUNTER */
@@ -0,0 +1,319 @@
+/// PSE Shared State Page
+///
+/// The driver keeps the last known DI/DO/LED, PWM and CAN state in a single page
+/// that userspace can mmap read-only from /dev/pse. It is updated from every
+/// successful response the driver sees, whether the request came from a
+/// /dev/pse writer or from the in-kernel client, so readers never need a
+/// firmware round-trip. Writers bump `seq` around each update (odd while an
+/// update is in progress) so readers can retry torn reads.
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "pse.h"
+
+static_assert(sizeof(struct pse_state_page) <= PAGE_SIZE);
+
+/// Shared state
+///
+/// @page: The shared page
+/// @lock: Serializes writers
+/// @req_lock: Protects @req and @req_body
+/// @req_valid: A /dev/pse request is waiting for its response
+/// @req: The last request written to /dev/pse
+/// @req_body: The body of @req, if it had one
+struct pse_state {
+    struct pse_state_page *page;
+    spinlock_t lock;
+    spinlock_t req_lock;
+    bool req_valid;
+    struct heci_header req;
+    struct heci_body req_body;
+};
+
+static struct pse_state pse_state;
+
+static void pse_state_write_begin(void) {
+    WRITE_ONCE(pse_state.page->seq, pse_state.page->seq + 1);
+    smp_wmb();
+}
+
+static void pse_state_write_end(void) {
+    smp_wmb();
+    WRITE_ONCE(pse_state.page->seq, pse_state.page->seq + 1);
+}
+
+/// Apply a DIO/LED response
+static void pse_state_update_io(const struct heci_header *req, const struct heci_body *resp_body, u64 now) {
+    u8 op = HECI_ARG_OP(req->argument);
+    u8 dev = (req->argument >> 8) & 0xf;
+    u8 num = (req->argument >> 12) & 0xf;
+    struct pse_state_dio *entry;
+    const struct heci_dio_info *info;
+
+    switch (dev) {
+    case kIODev_LED:
+        entry = &pse_state.page->led[num];
+        break;
+    case kIODev_DO:
+        entry = &pse_state.page->dout[num];
+        break;
+    case kIODev_DI:
+        entry = &pse_state.page->din[num];
+        break;
+    default:
+        return;
+    }
+
+    switch (op) {
+    case kIO_GetInfo:
+        if (!resp_body) {
+            return;
+        }
+
+        info = (const struct heci_dio_info *)resp_body->data;
+        entry->state = info->state;
+        entry->count = info->count;
+        break;
+    case kIO_SetOutput:
+        entry->state = 1;
+        break;
+    case kIO_ClearOutput:
+        entry->state = 0;
+        break;
+    case kIO_ClearCount:
+        entry->count = 0;
+        break;
+    default:
+        return;
+    }
+
+    entry->valid = 1;
+    entry->timestamp_ns = now;
+}
+
+/// Apply a PWM response
+static void pse_state_update_pwm(const struct heci_header *req, const struct heci_body *req_body, u64 now) {
+    u8 op = HECI_ARG_OP(req->argument);
+    u8 dev = HECI_ARG_DEV(req->argument);
+    struct pse_state_pwm *entry;
+    const struct heci_pwm_data *cycle;
+
+    if (dev >= PSE_STATE_PWM) {
+        return;
+    }
+
+    entry = &pse_state.page->pwm[dev];
+
+    switch (op) {
+    case kPWM_Start:
+        entry->running = 1;
+        break;
+    case kPWM_Stop:
+        entry->running = 0;
+        break;
+    case kPWM_SetCycles:
+        if (!req_body) {
+            return;
+        }
+
+        cycle = (const struct heci_pwm_data *)req_body->data;
+        entry->period_usec = cycle->period_usec;
+        entry->pulse_usec = cycle->pulse_usec;
+        break;
+    default:
+        return;
+    }
+
+    entry->valid = 1;
+    entry->timestamp_ns = now;
+}
+
+/// Apply a CAN response
+static void pse_state_update_can(const struct heci_header *req, u64 now) {
+    u8 op = req->argument & 0x7;
+    u8 dev = (req->argument >> 3) & 0x7;
+    struct pse_state_can *entry = &pse_state.page->can[dev];
+
+    switch (op) {
+    case kCAN_Enable:
+        entry->enabled = 1;
+        break;
+    case kCAN_Disable:
+        entry->enabled = 0;
+        break;
+    case kCAN_SetBaudrate:
+        entry->baudrate = req->argument >> 6;
+        break;
+    case kCAN_StatusReport:
+        // Only the freshness is tracked; the report itself isn't interpreted
+        break;
+    default:
+        return;
+    }
+
+    entry->valid = 1;
+    entry->timestamp_ns = now;
+}
+
+/// Update the shared page from a request and its successful response
+///
+/// @req: The request header
+/// @req_body: The request body (may be NULL)
+/// @resp: The response header
+/// @resp_body: The response body (may be NULL)
+void pse_state_update(const struct heci_header *req, const struct heci_body *req_body,
+    const struct heci_header *resp, const struct heci_body *resp_body) {
+    unsigned long flags;
+    u64 now = ktime_get_ns();
+
+    if (!pse_state.page || resp->status || resp->command != req->command) {
+        return;
+    }
+
+    switch (req->command) {
+    case kHECI_IO_COMMAND:
+    case kHECI_PWM_COMMAND:
+    case kHECI_CAN_COMMAND:
+        break;
+    default:
+        return;
+    }
+
+    spin_lock_irqsave(&pse_state.lock, flags);
+    pse_state_write_begin();
+
+    switch (req->command) {
+    case kHECI_IO_COMMAND:
+        pse_state_update_io(req, resp_body, now);
+        break;
+    case kHECI_PWM_COMMAND:
+        pse_state_update_pwm(req, req_body, now);
+        break;
+    case kHECI_CAN_COMMAND:
+        pse_state_update_can(req, now);
+        break;
+    }
+
+    pse_state_write_end();
+    spin_unlock_irqrestore(&pse_state.lock, flags);
+}
+
+/// Record a request written to /dev/pse, to be matched against its response
+void pse_state_user_request(const void *buf, size_t length) {
+    unsigned long flags;
+    const struct heci_header *header = buf;
+
+    if (length < sizeof(*header)) {
+        return;
+    }
+
+    spin_lock_irqsave(&pse_state.req_lock, flags);
+
+    memcpy(&pse_state.req, header, sizeof(*header));
+    memset(&pse_state.req_body, 0, sizeof(pse_state.req_body));
+
+    if (header->has_next) {
+        memcpy(&pse_state.req_body, (const u8 *)buf + sizeof(*header),
+            min_t(size_t, length - sizeof(*header), sizeof(pse_state.req_body)));
+    }
+
+    pse_state.req_valid = true;
+
+    spin_unlock_irqrestore(&pse_state.req_lock, flags);
+}
+
+/// Match a response read from the /dev/pse client against the last request
+void pse_state_user_response(const void *buf, size_t length) {
+    unsigned long flags;
+    struct heci_header req;
+    struct heci_body *req_body;
+    struct heci_body *resp_body = NULL;
+    const struct heci_header *resp = buf;
+
+    if (length < sizeof(*resp) || !resp->is_response) {
+        return;
+    }
+
+    req_body = kmalloc(sizeof(*req_body), GFP_KERNEL);
+    if (!req_body) {
+        return;
+    }
+
+    spin_lock_irqsave(&pse_state.req_lock, flags);
+
+    if (!pse_state.req_valid || pse_state.req.command != resp->command) {
+        spin_unlock_irqrestore(&pse_state.req_lock, flags);
+        kfree(req_body);
+        return;
+    }
+
+    memcpy(&req, &pse_state.req, sizeof(req));
+    memcpy(req_body, &pse_state.req_body, sizeof(*req_body));
+    pse_state.req_valid = false;
+
+    spin_unlock_irqrestore(&pse_state.req_lock, flags);
+
+    // Only DIO info is read from response bodies
+    if (resp->has_next && length >= sizeof(*resp) + offsetof(struct heci_body, data) + sizeof(struct heci_dio_info)) {
+        resp_body = (struct heci_body *)((u8 *)buf + sizeof(*resp));
+    }
+
+    pse_state_update(&req, req.has_next ? req_body : NULL, resp, resp_body);
+
+    kfree(req_body);
+}
+
+/// Map the state page read-only into userspace
+int pse_state_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (!pse_state.page) {
+        return -ENODEV;
+    }
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE) {
+        return -EINVAL;
+    }
+
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+
+#if NEWER_KENREL == 1
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(pse_state.page) >> PAGE_SHIFT,
+        vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+/// Allocate the shared state page
+int pse_state_init(void) {
+    spin_lock_init(&pse_state.lock);
+    spin_lock_init(&pse_state.req_lock);
+
+    pse_state.page = (struct pse_state_page *)get_zeroed_page(GFP_KERNEL);
+    if (!pse_state.page) {
+        return -ENOMEM;
+    }
+
+    pse_state.page->version = PSE_STATE_VERSION;
+
+    return 0;
+}
+
+/// Free the shared state page
+///
+/// All files (and so all mappings) must already be released.
+void pse_state_exit(void) {
+    if (pse_state.page) {
+        free_page((unsigned long)pse_state.page);
+        pse_state.page = NULL;
+    }
+}
@@ -6,6 +6,7 @@
 #include <linux/uuid.h>
 #include <linux/ioctl.h>
 #include <linux/version.h>
+#include <linux/device.h>
 
 #if ( LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 4, 0 ) )
   #include <linux/mei_uuid.h>
@@ -25,6 +26,93 @@
 /// After it has been performed, future reads/writes will be attached to this new client
 #define IOCTL_ISHTP_CONNECT_CLIENT _IOWR('H', 0x01, struct ishtp_cc_data)
 
+/// Register a periodic standing query, issued by the driver on the caller's behalf
+///
+/// Identical queries (command + argument) are shared between all subscribers.
+/// The query id is returned in `id`.
+#define IOCTL_PSE_ADD_QUERY _IOWR('H', 0x02, struct pse_query)
+
+/// Remove a standing query by id
+#define IOCTL_PSE_DEL_QUERY _IOW('H', 0x03, __u32)
+
+/// Block until the next standing query result is available
+#define IOCTL_PSE_READ_QUERY _IOR('H', 0x04, struct pse_query_result)
+
+/// Room for a complete heci_header_t + heci_body_t response
+#define PSE_QUERY_DATA_LEN 240
+
+/// Standing query registered by IOCTL_PSE_ADD_QUERY
+struct pse_query {
+    __u8  command;
+    __u8  reserved;
+    __u16 argument;
+    __u32 period_ms;
+    __u32 id;
+};
+
+/// Standing query result returned by IOCTL_PSE_READ_QUERY
+///
+/// @status: Zero on success, or the negative error of the transaction
+/// @timestamp_ns: CLOCK_MONOTONIC time the response was received
+/// @data: The raw response header, followed by the body if has_next is set
+struct pse_query_result {
+    __u32 id;
+    __s32 status;
+    __u64 timestamp_ns;
+    __u32 length;
+    __u8  data[PSE_QUERY_DATA_LEN];
+};
+
+/// Layout version of the shared state page
+#define PSE_STATE_VERSION 1
+
+#define PSE_STATE_DIO   16
+#define PSE_STATE_PWM   8
+#define PSE_STATE_CAN   8
+
+/// Last known state of a single DI, DO or LED
+struct pse_state_dio {
+    __u8  valid;
+    __u8  state;
+    __u8  reserved[6];
+    __u64 count;
+    __u64 timestamp_ns;
+};
+
+/// Last known configuration of a single PWM device
+struct pse_state_pwm {
+    __u8  valid;
+    __u8  running;
+    __u8  reserved[6];
+    __u64 period_usec;
+    __u64 pulse_usec;
+    __u64 timestamp_ns;
+};
+
+/// Last known state of a single CAN device
+struct pse_state_can {
+    __u8  valid;
+    __u8  enabled;
+    __u16 baudrate;
+    __u32 reserved;
+    __u64 timestamp_ns;
+};
+
+/// Read-only state page, mapped by mmap() on /dev/pse
+///
+/// @seq: Odd while the driver is updating the page; re-read if it changed
+/// @version: PSE_STATE_VERSION
+/// @timestamp_ns: Per-entry CLOCK_MONOTONIC time of the last update
+struct pse_state_page {
+    __u32 seq;
+    __u32 version;
+    struct pse_state_dio din[PSE_STATE_DIO];
+    struct pse_state_dio dout[PSE_STATE_DIO];
+    struct pse_state_dio led[PSE_STATE_DIO];
+    struct pse_state_pwm pwm[PSE_STATE_PWM];
+    struct pse_state_can can[PSE_STATE_CAN];
+};
+
 #define UUID_LE_g(a, b, c, d0, d1, d2, d3, d4, d5, d6, d7)		\
 ((guid_t)								\
 {{ (a) & 0xff, ((a) >> 8) & 0xff, ((a) >> 16) & 0xff, ((a) >> 24) & 0xff, \
@@ -55,4 +143,70 @@ struct ishtp_cc_data {
     };
 };
 #endif
+
+#include "pse-heci.h"
+
+/// Handler for unsolicited firmware messages of a single HECI command class
+typedef void (*pse_notify_fn)(const struct heci_header *header, const struct heci_body *body, void *priv);
+
+/// Send a command over the in-kernel PSE connection and wait for its response
+///
+/// Returns 0 on success with an empty body, 1 on success with a populated body
+int pse_command_checked(u8 command, u16 argument, const struct heci_body *in_body, struct heci_body *out_body);
+
+/// Route unsolicited firmware messages for @command to @fn
+int pse_register_notify(u8 command, pse_notify_fn fn, void *priv);
+/// Waits for a running notifier before returning; must not be called from a notifier
+void pse_unregister_notify(u8 command);
+
+/// Convert a firmware event timestamp to CLOCK_MONOTONIC, from a notifier
+int pse_fw_time_to_host(u64 fw_us, u64 *timestamp_ns, u32 *err_ns);
+
+/// QEP counter-subsystem driver (pse-qep.c)
+#if IS_ENABLED(CONFIG_COUNTER) && NEWER_KENREL == 1
+int pse_qep_init(struct device *parent);
+void pse_qep_exit(void);
+#else
+static inline int pse_qep_init(struct device *parent) { return 0; }
+static inline void pse_qep_exit(void) { }
+#endif
+
+/// Front-panel LED class devices (pse-led.c)
+#if IS_ENABLED(CONFIG_LEDS_CLASS)
+int pse_led_init(struct device *parent);
+void pse_led_exit(void);
+void pse_led_reset(void);
+#else
+static inline int pse_led_init(struct device *parent) { return 0; }
+static inline void pse_led_exit(void) { }
+static inline void pse_led_reset(void) { }
+#endif
+
+/// Standing query poller (pse-poll.c)
+int pse_poll_init(void);
+void pse_poll_exit(void);
+int pse_poll_open(struct file *file);
+void pse_poll_release(struct file *file);
+long pse_poll_ioctl(struct file *file, unsigned int cmd, unsigned long data);
+
+/// Shared state page (pse-state.c)
+int pse_state_init(void);
+void pse_state_exit(void);
+int pse_state_mmap(struct file *file, struct vm_area_struct *vma);
+void pse_state_update(const struct heci_header *req, const struct heci_body *req_body,
+    const struct heci_header *resp, const struct heci_body *resp_body);
+void pse_state_user_request(const void *buf, size_t length);
+void pse_state_user_response(const void *buf, size_t length);
+
+/// Automotive controller hwmon device (pse-hwmon.c)
+#if IS_ENABLED(CONFIG_HWMON)
+int pse_hwmon_init(struct device *parent);
+void pse_hwmon_probe(void);
+void pse_hwmon_exit(void);
+#else
+static inline int pse_hwmon_init(struct device *parent) { return 0; }
+static inline void pse_hwmon_probe(void) { }
+static inline void pse_hwmon_exit(void) { }
+#endif
+
 #endif /* _PSE_H_ */
\ No newline at end of file